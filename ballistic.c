@@ -0,0 +1,370 @@
+/******************************************************************************
+* File:         ballistic.c
+* Brief:        Analytic water trajectories (--analytic-water)
+*
+* Note:
+* Water drops only feel constant gravity, so the whole trajectory of a drop,
+* including the step in which it leaves the scene, is known when it is born.
+* Instead of integrating every drop in every step, only the birth step and
+* initial state of each drop are kept (see ballistic.h) and positions are
+* evaluated when rendering. Expiry is handled by a binary min-heap of death
+* steps: a step only pops the drops which die in it, the rest of the fountain
+* is not touched at all. The last live drop is moved into the slot of a dead
+* one, so live drops stay at the beginning of the arrays.
+*
+* When gravity (or the step length) changes, the stored trajectories are no
+* longer valid. All live drops are then re-based: their current position and
+* velocity become a new initial state, born in the current step, and their
+* deaths are scheduled again.
+******************************************************************************/
+#include "ballistic.h"
+#include "threadPool.h"
+
+
+
+/******************************************************************************
+* Global variables (declared in ballistic.h)
+******************************************************************************/
+Trajectories trajectories;
+
+// Min-heap of death steps and the drop each entry belongs to, position of
+// each drop in the heap. There is one entry for every live drop.
+static double *heapDeath;
+static int *heapDrop;
+static int *dropEntry;
+static int heapSize;
+static int capacity;
+
+// New trajectory parameters while re-basing
+typedef struct {
+  double steps;
+  double timeScale;
+  double acceleration;
+} Rebase;
+
+
+
+/******************************************************************************
+* Fit the arrays to the capacity of the water arrays, keeping their contents
+******************************************************************************/
+static void *resize(void *buffer, size_t size)
+{
+  buffer = realloc(buffer, (size_t)fountain.capacity * size);
+  if (!buffer) {
+    fprintf(stderr, "Could not allocate trajectories of %d drops\n", fountain.capacity);
+    exit(1);
+  }
+  return buffer;
+}
+
+static void reserveTrajectories(void)
+{
+  if (capacity == fountain.capacity)
+    return;
+  trajectories.birth = resize(trajectories.birth, sizeof(double));
+  heapDeath = resize(heapDeath, sizeof(double));
+  heapDrop = resize(heapDrop, sizeof(int));
+  dropEntry = resize(dropEntry, sizeof(int));
+  capacity = fountain.capacity;
+}
+
+
+
+/******************************************************************************
+* Take the trajectory parameters from the current gravity and step length,
+* only valid while there are no live drops
+******************************************************************************/
+static void currentTrajectory(void)
+{
+  trajectories.timeScale = fountain.clock.step / SIMULATION_TICK;
+  trajectories.acceleration = WATER_DROP_MASS * gravity * trajectories.timeScale;
+}
+
+
+
+/******************************************************************************
+* Smallest whole n >= 1 for which q*n^2 + b*n + c > 0, INFINITY if there is
+* none. The estimate given by the roots is corrected for rounding errors.
+******************************************************************************/
+static double firstPositive(double q, double b, double c)
+{
+  double n, discriminant = b * b - 4.0 * q * c;
+  int tries;
+
+  if (q + b + c > 0.0)
+    return 1.0;
+
+  if (q > 0.0)
+    n = floor((-b + sqrt(fmax(discriminant, 0.0))) / (2.0 * q)) + 1.0;
+  else if (q < 0.0) {
+    if (discriminant < 0.0)
+      return INFINITY;
+    n = floor((-b + sqrt(discriminant)) / (2.0 * q)) + 1.0;
+  }
+  else if (b > 0.0)
+    n = floor(-c / b) + 1.0;
+  else
+    return INFINITY;
+
+  if (!(n < 1e15))
+    return INFINITY;
+  n = n < 2.0 ? 2.0 : n;
+  while (n > 2.0 && (q * (n - 1.0) + b) * (n - 1.0) + c > 0.0)
+    n--;
+  for (tries = 0; (q * n + b) * n + c <= 0.0; tries++, n++)
+    if (tries == 4)
+      return q < 0.0 ? INFINITY : n;
+  return n;
+}
+
+
+
+/******************************************************************************
+* Number of steps drop "index" lives after its birth, given the trajectory
+* parameters. Same condition as the water kernels: the drop dies in the
+* first step after which it is below the fountain or above the window.
+******************************************************************************/
+double dropLifetime(int index, double timeScale, double acceleration)
+{
+  // y(n) = q*n^2 + b*n + c
+  double q = 0.5 * timeScale * acceleration;
+  double b = timeScale * fountain.yvel[index] - q;
+  double c = fountain.ypos[index];
+  double below = firstPositive(-q, -b, WATER_FOUNTAIN_Y - c);
+  double above = firstPositive(q, b, c - WINDOW_HEIGHT);
+
+  return below < above ? below : above;
+}
+
+
+
+/******************************************************************************
+* Heap maintenance
+******************************************************************************/
+static inline void placeEntry(int entry, double death, int drop)
+{
+  heapDeath[entry] = death;
+  heapDrop[entry] = drop;
+  dropEntry[drop] = entry;
+}
+
+static void siftUp(int entry)
+{
+  double death = heapDeath[entry];
+  int drop = heapDrop[entry], parent;
+
+  for (; entry > 0 && heapDeath[parent = (entry - 1) / 2] > death; entry = parent)
+    placeEntry(entry, heapDeath[parent], heapDrop[parent]);
+  placeEntry(entry, death, drop);
+}
+
+static void siftDown(int entry)
+{
+  double death = heapDeath[entry];
+  int drop = heapDrop[entry], child;
+
+  while ((child = 2 * entry + 1) < heapSize)
+  {
+    if (child + 1 < heapSize && heapDeath[child + 1] < heapDeath[child])
+      child++;
+    if (heapDeath[child] >= death)
+      break;
+    placeEntry(entry, heapDeath[child], heapDrop[child]);
+    entry = child;
+  }
+  placeEntry(entry, death, drop);
+}
+
+static void heapify(void)
+{
+  int entry;
+
+  for (entry = heapSize / 2 - 1; entry >= 0; entry--)
+    siftDown(entry);
+}
+
+
+
+/******************************************************************************
+* Re-base or schedule one chunk of drops. Drop "index" gets heap entry
+* "index", the heap is built afterwards.
+******************************************************************************/
+static void rebaseChunk(int chunk, void *parameters)
+{
+  const Rebase *rebase = parameters;
+  int index, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < heapSize ? first + PARTICLE_CHUNK_SIZE : heapSize;
+  double n;
+
+  for (index = first; index < last; index++)
+  {
+    n = rebase->steps - trajectories.birth[index];
+    dropPosition(index, n, &fountain.xpos[index], &fountain.ypos[index], &fountain.zpos[index]);
+    fountain.yvel[index] = dropVelocity(index, n);
+    trajectories.birth[index] = rebase->steps;
+  }
+}
+
+static void scheduleChunk(int chunk, void *parameters)
+{
+  const Rebase *rebase = parameters;
+  int index, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < heapSize ? first + PARTICLE_CHUNK_SIZE : heapSize;
+
+  for (index = first; index < last; index++)
+    placeEntry(index, trajectories.birth[index] +
+               dropLifetime(index, rebase->timeScale, rebase->acceleration), index);
+}
+
+
+
+/******************************************************************************
+* Give all live drops trajectories with new parameters, starting from their
+* current state, and schedule their deaths again
+******************************************************************************/
+static void rebaseTrajectories(double timeScale, double acceleration)
+{
+  Rebase rebase = { (double)fountain.clock.steps, timeScale, acceleration };
+  int chunks = (heapSize + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+
+  parallelFor(chunks, rebaseChunk, &rebase);
+  trajectories.timeScale = timeScale;
+  trajectories.acceleration = acceleration;
+  parallelFor(chunks, scheduleChunk, &rebase);
+  heapify();
+}
+
+
+
+/******************************************************************************
+* Forget all drops, called whenever the fountain is emptied
+******************************************************************************/
+void resetBallistic(void)
+{
+  heapSize = 0;
+}
+
+
+
+/******************************************************************************
+* Heap of the live drops, for snapshots (snapshot.c). ballisticHeap() makes
+* room for fountain.capacity drops and returns the heap arrays and size, 
+* setBallisticHeap() takes the size of a heap restored into them.
+******************************************************************************/
+int ballisticHeap(double **death, int **drop, int **entry)
+{
+  reserveTrajectories();
+  *death = heapDeath;
+  *drop = heapDrop;
+  *entry = dropEntry;
+  return heapSize;
+}
+
+void setBallisticHeap(int size)
+{
+  heapSize = size;
+}
+
+
+
+/******************************************************************************
+* Schedule the deaths of all live drops again, after their births were
+* changed (see prewarm.c)
+******************************************************************************/
+void rescheduleBallistic(void)
+{
+  Rebase rebase = { (double)fountain.clock.steps, trajectories.timeScale, 
+                    trajectories.acceleration };
+
+  reserveTrajectories();
+  heapSize = fountain.aliveParticles;
+  parallelFor((heapSize + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE, scheduleChunk, &rebase);
+  heapify();
+}
+
+
+
+/******************************************************************************
+* Drops [first,last) were just spawned by spawnWater(), they are born in the
+* current step. If the fountain was emptied or cut short behind our back,
+* the deaths of the remaining drops are scheduled again first.
+******************************************************************************/
+void spawnBallistic(int first, int last)
+{
+  Rebase rebase;
+  double steps = (double)fountain.clock.steps;
+  int index;
+
+  reserveTrajectories();
+  if (first == 0)
+    currentTrajectory();
+  if (heapSize != first) {
+    heapSize = first;
+    rebase.timeScale = trajectories.timeScale;
+    rebase.acceleration = trajectories.acceleration;
+    parallelFor((heapSize + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE, scheduleChunk, &rebase);
+    heapify();
+  }
+
+  for (index = first; index < last; index++)
+  {
+    trajectories.birth[index] = steps;
+    placeEntry(heapSize++, steps + dropLifetime(index, trajectories.timeScale,
+                                                trajectories.acceleration), index);
+    siftUp(heapSize - 1);
+  }
+}
+
+
+
+/******************************************************************************
+* Move the last live drop into the slot of dead drop "drop"
+******************************************************************************/
+static void removeDrop(int drop)
+{
+  int last = --fountain.aliveParticles;
+
+  if (drop == last)
+    return;
+  fountain.xpos[drop] = fountain.xpos[last];
+  fountain.ypos[drop] = fountain.ypos[last];
+  fountain.zpos[drop] = fountain.zpos[last];
+  fountain.xvel[drop] = fountain.xvel[last];
+  fountain.yvel[drop] = fountain.yvel[last];
+  fountain.zvel[drop] = fountain.zvel[last];
+  fountain.emitter[drop] = fountain.emitter[last];
+  trajectories.birth[drop] = trajectories.birth[last];
+  heapDrop[dropEntry[last]] = drop;
+  dropEntry[drop] = dropEntry[last];
+}
+
+
+
+/******************************************************************************
+* Advance the fountain by one step. Trajectories are re-based if gravity or
+* the step length changed, then the drops which die in this step are removed.
+******************************************************************************/
+void progressBallistic(void)
+{
+  double timeScale = fountain.clock.step / SIMULATION_TICK;
+  double acceleration = WATER_DROP_MASS * gravity * timeScale;
+  double steps;
+  int drop;
+
+  if (heapSize == 0)
+    currentTrajectory();
+  else if (timeScale != trajectories.timeScale || acceleration != trajectories.acceleration)
+    rebaseTrajectories(timeScale, acceleration);
+
+  steps = (double)++fountain.clock.steps;
+  while (heapSize > 0 && heapDeath[0] <= steps)
+  {
+    drop = heapDrop[0];
+    heapSize--;
+    if (heapSize > 0) {
+      placeEntry(0, heapDeath[heapSize], heapDrop[heapSize]);
+      siftDown(0);
+    }
+    removeDrop(drop);
+  }
+}
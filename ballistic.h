@@ -0,0 +1,66 @@
+/******************************************************************************
+* File:         ballistic.h
+* Brief:        Analytic water trajectories (--analytic-water)
+*
+* Note:
+* In this mode the water arrays keep the state of each drop at its birth:
+* fountain.xpos, ypos, zpos hold the initial position and fountain.xvel,
+* yvel, zvel the initial velocity. The position after any number of steps
+* is evaluated in closed form, the previous position arrays are not used.
+******************************************************************************/
+#ifndef BALLISTIC_H
+#define BALLISTIC_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Trajectories of the live drops. All of them share one step length and
+* vertical acceleration, the ones they were born (or re-based) with.
+******************************************************************************/
+typedef struct {
+	double *birth;						// Step in which each drop was born
+	double timeScale;					// Step length in ticks
+	double acceleration;				// Vertical velocity change per step
+} Trajectories;
+
+extern Trajectories trajectories;
+
+
+
+/******************************************************************************
+* Position and velocity of drop "index" "n" steps after its birth. Matches
+* the integration of progressWater() (position moves first, then velocity
+* changes) for whole "n", fractional "n" gives the state in between.
+******************************************************************************/
+static inline void dropPosition(int index, double n, real *x, real *y, real *z)
+{
+	double h = trajectories.timeScale;
+
+	*x = fountain.xpos[index] + h * n * fountain.xvel[index];
+	*y = fountain.ypos[index] + h * (n * fountain.yvel[index] +
+	     0.5 * trajectories.acceleration * n * (n - 1.0));
+	*z = fountain.zpos[index] + h * n * fountain.zvel[index];
+}
+
+static inline real dropVelocity(int index, double n)
+{
+	return fountain.yvel[index] + trajectories.acceleration * n;
+}
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void resetBallistic(void);				// Forget all drops (none alive)
+void spawnBallistic(int, int);			// Schedule deaths of drops [first,last)
+void progressBallistic(void);			// One step: re-base and expire drops
+int ballisticHeap(double**, int**, int**); // Heap arrays and size (snapshots)
+void setBallisticHeap(int);				// Heap size after filling its arrays
+void rescheduleBallistic(void);			// Schedule all deaths again from the births
+double dropLifetime(int, double, double); // Steps a drop lives, given the step
+										// length and acceleration
+
+#endif
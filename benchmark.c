@@ -0,0 +1,392 @@
+/******************************************************************************
+* File:         benchmark.c
+* Brief:        Microbenchmarks of the particle system hot paths
+*
+* Note:
+* Spawning (also shared by many emitters), the water and smoke halves of the
+* update (also with particle interactions, see spatialGrid.c), random number
+* generation and render buffer preparation (also with depth sorted smoke,
+* culled to the fountain view, with smoke as a density volume and with
+* analytic water trajectories, see ballistic.c) are measured separately for
+* particle counts from --min up to --max (1-2-5 sequence). Each measurement
+* is preceded by warm-up runs and repeated, minimum, median and 99th
+* percentile are printed and written to a JSON file.
+*
+* Usage: particleSystemBenchmark [--min N] [--max N] [--warmup N] [--reps N]
+*                                [--threads N] [--seed N] [--output FILE]
+******************************************************************************/
+#include "particleSystem.h"
+#include "kernels.h"
+#include "rng.h"
+#include "threadPool.h"
+#include "headless.h"
+#include "renderBuffer.h"
+#include "emitter.h"
+
+
+
+/******************************************************************************
+* Default benchmark parameters
+******************************************************************************/
+#define BENCHMARK_MIN_PARTICLES 1000
+#define BENCHMARK_WARMUP 3
+#define BENCHMARK_REPETITIONS 21
+#define BENCHMARK_OUTPUT "benchmark.json"
+#define BENCHMARK_EMITTERS 1000
+#define MAX_RESULTS 512
+
+
+
+/******************************************************************************
+* Benchmark definition. "prepare" is called (untimed) before every run of the
+* measured operation "run".
+******************************************************************************/
+typedef struct {
+  const char *name;
+  void (*prepare)(int);
+  void (*run)(int);
+} Benchmark;
+
+// Result of one benchmark for one particle count, times in nanoseconds
+typedef struct {
+  const char *name;
+  int particles;
+  double min, median, p99, mean;
+} Result;
+
+
+
+/******************************************************************************
+* Global variables
+******************************************************************************/
+static Result results[MAX_RESULTS];
+static int resultCount;
+static real *randomBuffer;              // Output of batch random generation
+static volatile double sink;            // Keeps single-value RNG calls alive
+static const Billboard billboard = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}};
+static Frustum fountainFrustum;         // Only the fountain in view
+static Frustum defaultFrustum;          // Both systems in view
+
+
+
+/******************************************************************************
+* Preparation functions
+******************************************************************************/
+
+// Both systems empty, "particles" to spawn in each
+static void prepareEmpty(int particles)
+{
+  fountain.totalParticles = smokeEmitter.totalParticles = particles;
+  fountain.aliveParticles = smokeEmitter.aliveParticles = 0;
+}
+
+// Both systems at full population of exactly "particles", no interactions
+static void prepareFull(int particles)
+{
+  options.waterCollisions = options.smokeDensity = options.smokeVolume = 0;
+  fountain.totalParticles = smokeEmitter.totalParticles = particles;
+  if (fountain.aliveParticles > particles)
+    fountain.aliveParticles = particles;
+  if (smokeEmitter.aliveParticles > particles)
+    smokeEmitter.aliveParticles = particles;
+  spawnParticles();
+}
+
+// As prepareFull, with drop collisions and smoke density spreading
+static void prepareInteracting(int particles)
+{
+  prepareFull(particles);
+  options.waterCollisions = options.smokeDensity = 1;
+}
+
+// As prepareFull, smoke drawn as a density volume
+static void prepareVolume(int particles)
+{
+  prepareFull(particles);
+  options.smokeVolume = 1;
+}
+
+// As prepareFull, water following analytic trajectories (emptied once)
+static void prepareAnalytic(int particles)
+{
+  if (!options.analyticWater) {
+    options.analyticWater = 1;
+    fountain.aliveParticles = 0;
+  }
+  prepareFull(particles);
+}
+
+// As prepareEmpty, each system with BENCHMARK_EMITTERS emitters
+static void prepareEmitters(int particles)
+{
+  if (waterSources.count != BENCHMARK_EMITTERS) {
+    options.waterEmitters = options.smokeEmitters = BENCHMARK_EMITTERS;
+    options.analyticWater = 0;
+    initEmitters();
+  }
+  prepareEmpty(particles);
+}
+
+static void prepareNothing(int particles)
+{
+  (void)particles;
+}
+
+
+
+/******************************************************************************
+* Measured operations
+******************************************************************************/
+static void runSpawn(int particles)
+{
+  (void)particles;
+  spawnParticles();
+}
+
+static void runWater(int particles)
+{
+  (void)particles;
+  progressWater();
+}
+
+static void runSmoke(int particles)
+{
+  (void)particles;
+  progressSmoke();
+}
+
+static void runGaussian(int particles)
+{
+  int index;
+  double sum = 0.0;
+
+  for (index = 0; index < particles; index++)
+    sum += gaussianRandom(0.0, 1.0);
+  sink = sum;
+}
+
+static void runUniform(int particles)
+{
+  int index;
+  double sum = 0.0;
+
+  for (index = 0; index < particles; index++)
+    sum += uniformRandom(1.0);
+  sink = sum;
+}
+
+static void runFillGaussian(int particles)
+{
+  fillGaussian(&defaultStream, randomBuffer, particles, 0.0, 1.0);
+}
+
+static void runRenderBuffers(int particles)
+{
+  (void)particles;
+  prepareRenderBuffers(1, &billboard, NULL);
+}
+
+static void runRenderSorted(int particles)
+{
+  (void)particles;
+  prepareRenderBuffers(1, &billboard, &defaultFrustum);
+}
+
+static void runRenderCulled(int particles)
+{
+  (void)particles;
+  prepareRenderBuffers(1, &billboard, &fountainFrustum);
+}
+
+
+
+/******************************************************************************
+* List of benchmarks
+******************************************************************************/
+static const Benchmark benchmarks[] = {
+  { "spawnParticles", prepareEmpty, runSpawn },
+  { "progressWater", prepareFull, runWater },
+  { "progressSmoke", prepareFull, runSmoke },
+  { "progressWaterCollisions", prepareInteracting, runWater },
+  { "progressSmokeDensity", prepareInteracting, runSmoke },
+  { "gaussianRandom", prepareNothing, runGaussian },
+  { "uniformRandom", prepareNothing, runUniform },
+  { "fillGaussian", prepareNothing, runFillGaussian },
+  { "prepareRenderBuffers", prepareFull, runRenderBuffers },
+  { "renderBuffersSorted", prepareFull, runRenderSorted },
+  { "renderBuffersCulled", prepareFull, runRenderCulled },
+  { "renderBuffersVolume", prepareVolume, runRenderBuffers },
+  { "progressWaterAnalytic", prepareAnalytic, runWater },
+  { "renderBuffersAnalytic", prepareAnalytic, runRenderBuffers },
+  { "spawnEmitters", prepareEmitters, runSpawn }
+};
+
+
+
+/******************************************************************************
+* Comparison function for sorting times
+******************************************************************************/
+static int compareTimes(const void *a, const void *b)
+{
+  double difference = *(const double*)a - *(const double*)b;
+  return (difference > 0.0) - (difference < 0.0);
+}
+
+
+
+/******************************************************************************
+* Measure one benchmark for given particle count and store the result
+******************************************************************************/
+static void measure(const Benchmark *benchmark, int particles, int warmup, int repetitions,
+                    double *times)
+{
+  int run;
+  double start, sum = 0.0;
+  Result *result = &results[resultCount++];
+
+  for (run = 0; run < warmup; run++)
+  {
+    benchmark->prepare(particles);
+    benchmark->run(particles);
+  }
+
+  for (run = 0; run < repetitions; run++)
+  {
+    benchmark->prepare(particles);
+    start = wallClock();
+    benchmark->run(particles);
+    times[run] = (wallClock() - start) * 1e9;
+    sum += times[run];
+  }
+
+  qsort(times, repetitions, sizeof(double), compareTimes);
+  result->name = benchmark->name;
+  result->particles = particles;
+  result->min = times[0];
+  result->median = repetitions % 2 ? times[repetitions / 2] :
+                   0.5 * (times[repetitions / 2 - 1] + times[repetitions / 2]);
+  result->p99 = times[(int)ceil(0.99 * repetitions) - 1];
+  result->mean = sum / repetitions;
+
+  printf("%-24s %9d %14.0f %14.0f %14.0f %10.2f\n", result->name, particles,
+         result->min, result->median, result->p99, result->median / particles);
+}
+
+
+
+/******************************************************************************
+* Write all results as JSON
+******************************************************************************/
+static void writeJSON(const char *path, int warmup, int repetitions)
+{
+  int index;
+  FILE *file = fopen(path, "w");
+
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return;
+  }
+
+  fprintf(file, "{\n  \"kernels\": \"%s\",\n  \"threads\": %d,\n  \"seed\": %llu,\n",
+          kernelSetName, threadCount, (unsigned long long)options.seed);
+  fprintf(file, "  \"precision\": \"%s\",\n", sizeof(real) == sizeof(float) ? "float" : "double");
+  fprintf(file, "  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [\n", warmup, repetitions);
+  for (index = 0; index < resultCount; index++)
+  {
+    fprintf(file, "    {\"benchmark\": \"%s\", \"particles\": %d, \"min_ns\": %.0f, "
+                  "\"median_ns\": %.0f, \"p99_ns\": %.0f, \"mean_ns\": %.0f, "
+                  "\"ns_per_particle\": %.3f}%s\n",
+            results[index].name, results[index].particles, results[index].min,
+            results[index].median, results[index].p99, results[index].mean,
+            results[index].median / results[index].particles,
+            index + 1 < resultCount ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  fclose(file);
+  printf("Results written to %s\n", path);
+}
+
+
+
+/******************************************************************************
+* Main method
+******************************************************************************/
+int main(int argc, char *argv[])
+{
+  int index, particles, step, minParticles = BENCHMARK_MIN_PARTICLES;
+  int maxParticles = MAX_NO_OF_PARTICLES;
+  int warmup = BENCHMARK_WARMUP, repetitions = BENCHMARK_REPETITIONS;
+  const char *output = BENCHMARK_OUTPUT;
+  const int steps[] = {1, 2, 5};
+  double *times;
+  size_t benchmark;
+  const double eye[3] = {WATER_FOUNTAIN_X + 400.0, WATER_FOUNTAIN_Y, WATER_FOUNTAIN_Z};
+  const double centre[3] = {WATER_FOUNTAIN_X, WATER_FOUNTAIN_Y + 200.0, WATER_FOUNTAIN_Z};
+  const double defaultEye[3] = {0.0, 240.0, 500.0}, defaultCentre[3] = {0.0, 240.0, 0.0};
+  const double up[3] = {0.0, 1.0, 0.0};
+
+  options.seed = 1;
+  options.threads = defaultThreadCount();
+  for (index = 1; index + 1 < argc; index++)
+  {
+    if (!strcmp(argv[index], "--min"))
+      minParticles = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--max"))
+      maxParticles = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--warmup"))
+      warmup = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--reps"))
+      repetitions = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--threads"))
+      options.threads = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--seed"))
+      options.seed = strtoull(argv[++index], NULL, 10);
+    else if (!strcmp(argv[index], "--output"))
+      output = argv[++index];
+  }
+  maxParticles = maxParticles < 1 ? 1 : maxParticles > PARTICLE_LIMIT ? PARTICLE_LIMIT : maxParticles;
+  minParticles = minParticles < 1 ? 1 : minParticles > maxParticles ? maxParticles : minParticles;
+  repetitions = repetitions < 1 ? 1 : repetitions;
+  warmup = warmup < 0 ? 0 : warmup;
+  options.maxParticles = maxParticles;
+
+  seedRandom(options.seed);
+  initThreadPool(options.threads);
+  initKernels();
+  initParticleSystem();
+  viewFrustum(&fountainFrustum, eye, centre, up, 60.0, (double)WINDOW_WIDTH / WINDOW_HEIGHT, 
+              1.0, 10000.0);
+  viewFrustum(&defaultFrustum, defaultEye, defaultCentre, up, 60.0, 
+              (double)WINDOW_WIDTH / WINDOW_HEIGHT, 1.0, 10000.0);
+  times = malloc(repetitions * sizeof(double));
+  randomBuffer = malloc(maxParticles * sizeof(real));
+  if (!times || !randomBuffer) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  printf("Kernels: %s, threads: %d, warm-up runs: %d, repetitions: %d\n",
+         kernelSetName, threadCount, warmup, repetitions);
+  printf("%-24s %9s %14s %14s %14s %10s\n", "benchmark", "particles", "min [ns]",
+         "median [ns]", "p99 [ns]", "ns/particle");
+
+  // Particle counts follow the 1-2-5 sequence, the maximum is always included
+  for (benchmark = 0; benchmark < sizeof(benchmarks) / sizeof(benchmarks[0]); benchmark++)
+  {
+    for (particles = minParticles, step = 0; resultCount < MAX_RESULTS; )
+    {
+      measure(&benchmarks[benchmark], particles, warmup, repetitions, times);
+      if (particles == maxParticles)
+        break;
+      while (steps[step % 3] * pow(10, step / 3) * BENCHMARK_MIN_PARTICLES <= particles)
+        step++;
+      particles = steps[step % 3] * pow(10, step / 3) * BENCHMARK_MIN_PARTICLES;
+      particles = particles > maxParticles ? maxParticles : particles;
+    }
+  }
+
+  writeJSON(output, warmup, repetitions);
+  free(times);
+  free(randomBuffer);
+  return 0;
+}
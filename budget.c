@@ -0,0 +1,140 @@
+/******************************************************************************
+* File:         budget.c
+* Brief:        Particle budget controlled to hold a target frame time
+*
+* Note:
+* With --target-frame MS the particle totals follow the frame time instead
+* of keys f/F/s/S: a PI controller scales both totals to hold the median
+* frame time at the target, so each machine runs the densest scene it can
+* sustain. The frame time is close to proportional to the number of
+* particles, so error and output are taken logarithmically: the error is
+* log(target / median frame time) and an output change u multiplies each
+* total by exp(weight * u). The weights of --budget-weights W,S decide
+* which system gives and takes how much, weight 0 keeps a total fixed.
+* Totals stay within [--min-particles, --max-particles].
+*
+* The controller is in velocity form, the totals themselves are its
+* integrator, so hand-made changes and the bounds need no special care. To
+* keep it from hunting:
+* - frame times are collected for BUDGET_PERIOD seconds (or BUDGET_FRAMES
+*   frames if those come first) and their median is used, so single slow
+*   frames do not count;
+* - a period is only measured once the live particles have followed the
+*   last change (smoke dies out slowly), otherwise it starts again;
+* - errors within BUDGET_DEADBAND and changes below BUDGET_MIN_CHANGE are
+*   ignored (hysteresis).
+*
+* Totals are changed through applyControl(), so they are recorded and
+* replayed like any other control; replays do not run the controller.
+* controlBudget() is called at the start of a frame, while the simulation
+* is idle.
+******************************************************************************/
+#include "particleSystem.h"
+#include "input.h"
+#include "budget.h"
+
+
+
+/******************************************************************************
+* Controller state
+******************************************************************************/
+static double frameTimes[BUDGET_FRAMES];
+static int frameCount;
+static double periodTime;               // Frame time collected so far
+static int periodWater, periodSmoke;    // Live particles when the period began
+static double lastError;
+
+
+
+/******************************************************************************
+* Start a new measuring period
+******************************************************************************/
+static void startPeriod(void)
+{
+  frameCount = 0;
+  periodTime = 0.0;
+  periodWater = fountain.aliveParticles;
+  periodSmoke = smokeEmitter.aliveParticles;
+}
+
+
+
+/******************************************************************************
+* Nonzero if the live particles of a system changed by less than
+* BUDGET_SETTLED during the period (or its total is fixed)
+******************************************************************************/
+static int settled(int before, int alive, double weight)
+{
+  return weight == 0.0 || abs(alive - before) <= BUDGET_SETTLED * before;
+}
+
+
+
+/******************************************************************************
+* Median of the frame times of the period (reorders them)
+******************************************************************************/
+static int compareValues(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static double medianFrameTime(void)
+{
+  qsort(frameTimes, frameCount, sizeof(double), compareValues);
+  return frameCount % 2 ? frameTimes[frameCount / 2] :
+         0.5 * (frameTimes[frameCount / 2 - 1] + frameTimes[frameCount / 2]);
+}
+
+
+
+/******************************************************************************
+* Scale the total of one system by exp(weight * change), within the bounds,
+* unless that changes it by less than BUDGET_MIN_CHANGE
+******************************************************************************/
+static void scaleTotal(int control, int total, double weight, double change)
+{
+  double scaled = total * exp(weight * change);
+  int limit = options.minParticles < options.maxParticles ?
+              options.minParticles : options.maxParticles;
+
+  scaled = scaled < limit ? limit : scaled > options.maxParticles ? options.maxParticles : scaled;
+  if (fabs(scaled - total) >= BUDGET_MIN_CHANGE * total)
+    applyControl(control, (int)(scaled + 0.5));
+}
+
+
+
+/******************************************************************************
+* Take the wall clock time of the last frame, and adjust the particle totals
+* once a period has been measured
+******************************************************************************/
+void controlBudget(double frameTime)
+{
+  double error, change;
+
+  if (options.targetFrameTime <= 0.0 || frameTime <= 0.0)
+    return;
+  frameTimes[frameCount++] = frameTime;
+  periodTime += frameTime;
+  if (periodTime < BUDGET_PERIOD && frameCount < BUDGET_FRAMES)
+    return;
+
+  if (!settled(periodWater, fountain.aliveParticles, options.waterWeight) ||
+      !settled(periodSmoke, smokeEmitter.aliveParticles, options.smokeWeight)) {
+    startPeriod();
+    return;
+  }
+
+  error = log(options.targetFrameTime / medianFrameTime());
+  error = fabs(error) < BUDGET_DEADBAND ? 0.0 : error;
+  change = BUDGET_GAIN_P * (error - lastError) + BUDGET_GAIN_I * error;
+  change = change < -BUDGET_MAX_STEP ? -BUDGET_MAX_STEP :
+           change > BUDGET_MAX_STEP ? BUDGET_MAX_STEP : change;
+  lastError = error;
+  if (error != 0.0) {
+    scaleTotal(CONTROL_WATER_TOTAL, fountain.totalParticles, options.waterWeight, change);
+    scaleTotal(CONTROL_SMOKE_TOTAL, smokeEmitter.totalParticles, options.smokeWeight, change);
+  }
+  startPeriod();
+}
@@ -0,0 +1,32 @@
+/******************************************************************************
+* File:         budget.h
+* Brief:        Particle budget controlled to hold a target frame time
+******************************************************************************/
+#ifndef BUDGET_H
+#define BUDGET_H
+
+
+
+/******************************************************************************
+* Controller parameters. The error is the logarithm of target over measured
+* frame time, the output scales the particle totals logarithmically.
+******************************************************************************/
+#define BUDGET_PERIOD 0.5				// Seconds of frames between adjustments
+#define BUDGET_FRAMES 256				// Frames ending a period before BUDGET_PERIOD
+#define BUDGET_GAIN_P 0.25				// Proportional and integral gains
+#define BUDGET_GAIN_I 0.5
+#define BUDGET_DEADBAND 0.05			// Errors below this count as none
+#define BUDGET_MAX_STEP 0.4				// Largest output change per adjustment
+#define BUDGET_MIN_CHANGE 0.02			// Smaller relative changes are not made
+#define BUDGET_SETTLED 0.02				// Live particles must have changed less in
+										// a period to measure it
+#define BUDGET_MIN_PARTICLES 1000		// Default of --min-particles
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void controlBudget(double);				// Measure a frame time, adjust totals
+
+#endif
@@ -5,10 +5,26 @@ File:         build.py
 Author:       Krzysztof Koch  
 Date created: 11/11/2016
 Last mod:     11/11/2016
-Brief: 		  Build script for particle system
+Brief: 		  Build script for particle system. Builds the interactive program
+			  (particleSystem), a version without graphics, which does not 
+			  need OpenGL or GLUT (particleSystemHeadless) and microbenchmarks
+			  of the simulation (particleSystemBenchmark)
 """
 
 import os
+import platform
 
-bashCommand = "gcc -DMACOSX -framework OpenGL -framework GLUT -framework CoreFoundation particleSystem.c -o particleSystem -lSOIL"
-os.system(bashCommand)
\ No newline at end of file
+core = "particleSystem.c kernels.c rng.c threadPool.c headless.c renderBuffer.c ballistic.c depthSort.c emitter.c spatialGrid.c smokeVolume.c metrics.c trace.c snapshot.c input.c prewarm.c budget.c"
+simulation = core + " main.c"
+
+if platform.system() == "Darwin":
+	bashCommand = "gcc -O2 -DMACOSX -framework OpenGL -framework GLUT -framework CoreFoundation " + simulation + " graphics.c pipeline.c capture.c -o particleSystem -lSOIL -lz"
+else:
+	bashCommand = "gcc -O2 " + simulation + " graphics.c pipeline.c capture.c -o particleSystem -pthread -lSOIL -lglut -lGLU -lGL -lEGL -lz -lm"
+os.system(bashCommand)
+
+bashCommand = "gcc -O2 -DNO_GRAPHICS " + simulation + " -o particleSystemHeadless -pthread -lm"
+os.system(bashCommand)
+
+bashCommand = "gcc -O2 " + core + " benchmark.c -o particleSystemBenchmark -pthread -lm"
+os.system(bashCommand)
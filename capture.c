@@ -0,0 +1,410 @@
+/******************************************************************************
+* File:         capture.c
+* Brief:        Offscreen rendering to image sequences
+*
+* Note:
+* With --capture DIR frames are drawn into a framebuffer object of
+* --capture-size instead of a window, and written to DIR as
+* frame00000.png, frame00001.png, ... (raw RGB .ppm images with
+* --capture-raw). The context is created through EGL, on the surfaceless
+* Mesa platform if there is one, so capturing needs neither a display
+* server nor a GPU (llvmpipe renders on the CPU).
+*
+* Reading pixels back must not wait for the frame just drawn: each frame is
+* read into one of CAPTURE_PIXEL_BUFFERS pixel buffer objects, the transfer
+* runs while the next frame is simulated and drawn, and only then is the
+* buffer mapped and copied. The copies are queued for a pool of encoder
+* threads (--capture-threads). The queue holds at most CAPTURE_QUEUE frames;
+* when it is full, drawing waits for an encoder (backpressure), so memory
+* stays bounded. PNG images use the fastest zlib level, with enough encoders
+* drawing is rarely held up by them. With --target-frame the particle
+* budget follows the wall clock time of the captured frames (drawing,
+* reading back and any wait for the encoders), not the simulated tick.
+******************************************************************************/
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "graphics.h"
+#include "capture.h"
+
+#ifndef MACOSX
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
+#endif
+
+
+
+/******************************************************************************
+* Capture state
+******************************************************************************/
+
+// Frame read back, waiting for an encoder
+typedef struct {
+  unsigned char *pixels;                // RGBA, bottom row first
+  int index;                            // Number of the frame
+} CaptureJob;
+
+static int width, height;
+static size_t frameSize;                // Bytes of an RGBA frame
+static GLuint framebuffer, colourBuffer;
+static GLuint pixelBuffers[CAPTURE_PIXEL_BUFFERS];
+static int framesRead;                  // Frames read into pixel buffers so far
+
+// Frame copies, free or queued, and the encoders taking them
+static unsigned char *freeFrames[CAPTURE_QUEUE];
+static int freeCount;
+static CaptureJob queue[CAPTURE_QUEUE];
+static int queueHead, queueCount;
+static int closing;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frameQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t frameFreed = PTHREAD_COND_INITIALIZER;
+static pthread_t *encoders;
+static int encoderCount;
+static double encoderWait;              // Time drawing waited for a free copy
+
+
+
+/******************************************************************************
+* Create an OpenGL context without a window and make it current. Returns
+* zero if there is none.
+******************************************************************************/
+static int createContext(void)
+{
+#ifdef MACOSX
+  fprintf(stderr, "Offscreen capture needs EGL\n");
+  return 0;
+#else
+  const EGLint attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  const char *extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC platformDisplay =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLConfig config = EGL_NO_CONFIG_KHR;
+  EGLContext context;
+  EGLint major, minor, configs = 0;
+
+  // Surfaceless Mesa first, it works without a display server
+  if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless") && platformDisplay)
+    display = platformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+    display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+      fprintf(stderr, "Could not initialise EGL (error 0x%x)\n", eglGetError());
+      return 0;
+    }
+  }
+
+  // No surface is drawn to, a config is only needed if the display has some
+  if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, attributes, &config, 1, &configs))
+    configs = 0;
+  context = eglCreateContext(display, configs ? config : EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+  if (context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    fprintf(stderr, "Could not create an offscreen OpenGL context (error 0x%x)\n", eglGetError());
+    return 0;
+  }
+  return 1;
+#endif
+}
+
+
+
+/******************************************************************************
+* Store "value" big-endian, as PNG does
+******************************************************************************/
+static void storeBig(unsigned char *bytes, uint32_t value)
+{
+  bytes[0] = value >> 24;
+  bytes[1] = value >> 16;
+  bytes[2] = value >> 8;
+  bytes[3] = value;
+}
+
+
+
+/******************************************************************************
+* Write a PNG chunk of "type" holding "data"
+******************************************************************************/
+static void writeChunk(FILE *file, const char *type, const unsigned char *data, uint32_t size)
+{
+  unsigned char header[8], crc[4];
+  uLong sum;
+
+  // crc32() of a NULL buffer is its initial value, not the sum so far
+  storeBig(header, size);
+  memcpy(header + 4, type, 4);
+  sum = crc32(0, header + 4, 4);
+  storeBig(crc, size ? crc32(sum, data, size) : sum);
+  fwrite(header, 1, 8, file);
+  fwrite(data, 1, size, file);
+  fwrite(crc, 1, 4, file);
+}
+
+
+
+/******************************************************************************
+* Convert the RGBA frame read back into RGB rows, top row first. For PNG
+* each row starts with its filter type, "sub" (differences to the pixel on
+* the left), which compresses the smooth smoke much better than none.
+******************************************************************************/
+static void convertRows(const unsigned char *pixels, unsigned char *rows, int png)
+{
+  const unsigned char *source, *left;
+  int row, x, channel;
+
+  for (row = 0; row < height; row++)
+  {
+    source = pixels + (size_t)(height - 1 - row) * width * 4;
+    left = source;
+    if (png) {
+      *rows++ = 1;
+      for (channel = 0; channel < 3; channel++)
+        *rows++ = source[channel];
+      source += 4;
+    }
+    for (x = png; x < width; x++, source += 4, left += 4)
+      for (channel = 0; channel < 3; channel++)
+        *rows++ = png ? source[channel] - left[channel] : source[channel];
+  }
+}
+
+
+
+/******************************************************************************
+* Encode one frame into its file, "rows" and "compressed" are the buffers of
+* the encoder (see encodeFrames())
+******************************************************************************/
+static void writeFrame(const CaptureJob *job, unsigned char *rows,
+                       unsigned char *compressed, uLongf bound)
+{
+  static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+  unsigned char header[13] = { 0 };
+  char path[FILENAME_MAX];
+  uLongf size = bound;
+  size_t rowBytes = (size_t)width * 3 + !options.captureRaw;
+  FILE *file;
+  int written;
+
+  snprintf(path, sizeof(path), "%s/frame%05d.%s", options.captureDir, job->index,
+           options.captureRaw ? "ppm" : "png");
+  convertRows(job->pixels, rows, !options.captureRaw);
+  if (!options.captureRaw &&
+      compress2(compressed, &size, rows, rowBytes * height, CAPTURE_PNG_LEVEL) != Z_OK) {
+    fprintf(stderr, "Could not compress %s\n", path);
+    return;
+  }
+
+  file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+    return;
+  }
+  if (options.captureRaw) {
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    fwrite(rows, rowBytes, height, file);
+  }
+  else {
+    // 8 bits per channel, RGB, no interlacing
+    storeBig(header, width);
+    storeBig(header + 4, height);
+    header[8] = 8;
+    header[9] = 2;
+    fwrite(signature, 1, sizeof(signature), file);
+    writeChunk(file, "IHDR", header, sizeof(header));
+    writeChunk(file, "IDAT", compressed, size);
+    writeChunk(file, "IEND", NULL, 0);
+  }
+  written = !ferror(file);
+  if (fclose(file) || !written)
+    fprintf(stderr, "Could not write %s\n", path);
+}
+
+
+
+/******************************************************************************
+* Encoder thread: write queued frames and free their copies, until the
+* capture is closed and the queue empty
+******************************************************************************/
+static void *encodeFrames(void *argument)
+{
+  size_t rowBytes = (size_t)width * 3 + 1;
+  uLongf bound = compressBound(rowBytes * height);
+  unsigned char *rows = malloc(rowBytes * height);
+  unsigned char *compressed = options.captureRaw ? NULL : malloc(bound);
+  CaptureJob job;
+
+  (void)argument;
+  for (;;)
+  {
+    pthread_mutex_lock(&lock);
+    while (!queueCount && !closing)
+      pthread_cond_wait(&frameQueued, &lock);
+    if (!queueCount) {
+      pthread_mutex_unlock(&lock);
+      break;
+    }
+    job = queue[queueHead];
+    queueHead = (queueHead + 1) % CAPTURE_QUEUE;
+    queueCount--;
+    pthread_mutex_unlock(&lock);
+
+    if (rows && (compressed || options.captureRaw))
+      writeFrame(&job, rows, compressed, bound);
+    else
+      fprintf(stderr, "Could not allocate encoder buffers, frame %d skipped\n", job.index);
+
+    pthread_mutex_lock(&lock);
+    freeFrames[freeCount++] = job.pixels;
+    pthread_cond_signal(&frameFreed);
+    pthread_mutex_unlock(&lock);
+  }
+  free(compressed);
+  free(rows);
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Copy the frame in pixel buffer "buffer" and queue it for the encoders,
+* waiting for a free copy if the queue is full
+******************************************************************************/
+static void queueFrame(GLuint buffer, int index)
+{
+  const void *pixels;
+  unsigned char *copy;
+  double start = wallClock();
+
+  TRACE_BEGIN("queueFrame");
+  pthread_mutex_lock(&lock);
+  while (!freeCount)
+    pthread_cond_wait(&frameFreed, &lock);
+  copy = freeFrames[--freeCount];
+  pthread_mutex_unlock(&lock);
+  encoderWait += wallClock() - start;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer);
+  pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  if (pixels) {
+    memcpy(copy, pixels, frameSize);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  else
+    memset(copy, 0, frameSize);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  pthread_mutex_lock(&lock);
+  queue[(queueHead + queueCount++) % CAPTURE_QUEUE] = (CaptureJob){ copy, index };
+  pthread_cond_signal(&frameQueued);
+  pthread_mutex_unlock(&lock);
+  TRACE_END();
+}
+
+
+
+/******************************************************************************
+* Create the offscreen context, a "w" x "h" framebuffer object drawn into
+* from now on, the pixel buffers and the encoders. Returns zero on failure.
+******************************************************************************/
+int openCapture(int w, int h)
+{
+  int major = 1, minor = 0, index, count;
+  const char *version;
+
+  width = w;
+  height = h;
+  frameSize = (size_t)width * height * 4;
+  if (mkdir(options.captureDir, 0777) && errno != EEXIST) {
+    fprintf(stderr, "Could not create %s: %s\n", options.captureDir, strerror(errno));
+    return 0;
+  }
+  if (!createContext())
+    return 0;
+
+  // Framebuffer and pixel buffer objects are core in OpenGL 3.0
+  version = (const char*)glGetString(GL_VERSION);
+  if (version)
+    sscanf(version, "%d.%d", &major, &minor);
+  if (major < 3) {
+    fprintf(stderr, "Offscreen capture needs OpenGL 3.0, the context has %d.%d\n", major, minor);
+    return 0;
+  }
+  glGenRenderbuffers(1, &colourBuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, colourBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colourBuffer);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Could not create a %d x %d framebuffer\n", width, height);
+    return 0;
+  }
+  glGenBuffers(CAPTURE_PIXEL_BUFFERS, pixelBuffers);
+  for (index = 0; index < CAPTURE_PIXEL_BUFFERS; index++)
+  {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[index]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+  for (freeCount = 0; freeCount < CAPTURE_QUEUE; freeCount++)
+    if (!(freeFrames[freeCount] = malloc(frameSize))) {
+      fprintf(stderr, "Could not allocate capture queue\n");
+      return 0;
+    }
+  count = options.captureThreads > 0 ? options.captureThreads : 1;
+  encoders = malloc(count * sizeof(pthread_t));
+  for (encoderCount = 0; encoders && encoderCount < count; encoderCount++)
+    if (pthread_create(&encoders[encoderCount], NULL, encodeFrames, NULL))
+      break;
+  if (!encoderCount) {
+    fprintf(stderr, "Could not start encoder threads\n");
+    return 0;
+  }
+  printf("Capturing %d x %d to %s, %d encoders\n", width, height, options.captureDir,
+         encoderCount);
+  return 1;
+}
+
+
+
+/******************************************************************************
+* Start reading the frame drawn back, and queue the previous one, whose
+* transfer has had a frame to complete
+******************************************************************************/
+void captureFrame(void)
+{
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffers[framesRead % CAPTURE_PIXEL_BUFFERS]);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (framesRead > 0)
+    queueFrame(pixelBuffers[(framesRead - 1) % CAPTURE_PIXEL_BUFFERS], framesRead - 1);
+  framesRead++;
+}
+
+
+
+/******************************************************************************
+* Queue the last frame, wait for the encoders to write all frames and stop
+* them. Returns the time drawing waited for the encoders in seconds.
+******************************************************************************/
+double closeCapture(void)
+{
+  int index;
+
+  if (framesRead > 0)
+    queueFrame(pixelBuffers[(framesRead - 1) % CAPTURE_PIXEL_BUFFERS], framesRead - 1);
+  pthread_mutex_lock(&lock);
+  closing = 1;
+  pthread_cond_broadcast(&frameQueued);
+  pthread_mutex_unlock(&lock);
+  for (index = 0; index < encoderCount; index++)
+    pthread_join(encoders[index], NULL);
+  for (index = 0; index < freeCount; index++)
+    free(freeFrames[index]);
+  free(encoders);
+  return encoderWait;
+}
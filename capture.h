@@ -0,0 +1,30 @@
+/******************************************************************************
+* File:         capture.h
+* Brief:        Offscreen rendering to image sequences
+******************************************************************************/
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+
+
+/******************************************************************************
+* Capture parameters
+******************************************************************************/
+#define CAPTURE_WIDTH 1920				// Default of --capture-size
+#define CAPTURE_HEIGHT 1080
+#define CAPTURE_PIXEL_BUFFERS 2			// Pixel buffers read back in turn
+#define CAPTURE_QUEUE 8					// Most frames read back and not yet
+										// written (bounds the memory used)
+#define CAPTURE_PNG_LEVEL 1				// zlib level of PNG images (1 = fastest)
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+int openCapture(int, int);				// Offscreen context and framebuffer
+void captureFrame(void);				// Read the frame back, queue the last one
+double closeCapture(void);				// Write the frames left, returns the time
+										// spent waiting for the encoders
+
+#endif
@@ -0,0 +1,266 @@
+/******************************************************************************
+* File:         depthSort.c
+* Brief:        Back-to-front ordering of smoke sprites (parallel radix sort)
+*
+* Note:
+* Alpha blended sprites have to be drawn from the furthest to the nearest.
+* Depths are quantised to 16-bit keys and sorted by a least significant 
+* digit radix sort with two passes of 8 bits, which is linear in the number
+* of sprites and stable. Every pass is split into blocks sorted in parallel:
+* each block counts its digits, a prefix sum over (digit, block) gives every
+* block its place in each bucket, then the blocks scatter their sprites 
+* independently. A pass whose digit is the same for all sprites would not
+* change the order and is skipped, the digits of all passes are counted 
+* while quantising so this is known up front and the last pass needed can 
+* write the index buffer directly.
+*
+* The result is an index buffer of whole quads (four vertices per sprite), 
+* the vertices themselves stay where they were packed.
+******************************************************************************/
+#include "depthSort.h"
+#include "kernels.h"
+#include "threadPool.h"
+
+
+
+/******************************************************************************
+* Sort state. Buffers are grown as needed and reused between frames.
+******************************************************************************/
+#define SORT_BLOCK_SIZE PARTICLE_CHUNK_SIZE
+#define SORT_PASSES (DEPTH_KEY_BITS / DEPTH_DIGIT_BITS)
+
+static uint16_t *keys[2];               // Keys before and after a pass
+static unsigned int *order[2];          // Sprites in the same order as keys
+static int (*offsets)[SORT_PASSES][DEPTH_BUCKETS]; // Per block and pass
+static int sortCapacity, blockCapacity;
+
+// Parameters of one sort
+typedef struct {
+  const real *depth;                    // Sprite depths
+  real nearest;                         // Depth of the largest key
+  real scale;                           // Key units per unit of depth
+  int count;                            // Number of sprites
+  int pass;                             // Current pass
+  int shift;                            // First bit of its digit
+  int source;                           // Buffers it reads (0 or 1)
+  unsigned int *indices;                // Output of the last pass (if not NULL)
+} Sort;
+
+
+
+/******************************************************************************
+* Grow the sort buffers to hold "count" sprites
+******************************************************************************/
+static void *grow(void *buffer, size_t size)
+{
+  buffer = realloc(buffer, size);
+  if (!buffer) {
+    fprintf(stderr, "Could not allocate depth sort buffers\n");
+    exit(1);
+  }
+  return buffer;
+}
+
+static void reserveSort(int count)
+{
+  int blocks = (count + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+
+  if (count > sortCapacity) {
+    keys[0] = grow(keys[0], (size_t)count * sizeof(uint16_t));
+    keys[1] = grow(keys[1], (size_t)count * sizeof(uint16_t));
+    order[0] = grow(order[0], (size_t)count * sizeof(unsigned int));
+    order[1] = grow(order[1], (size_t)count * sizeof(unsigned int));
+    sortCapacity = count;
+  }
+  if (blocks > blockCapacity) {
+    offsets = grow(offsets, (size_t)blocks * sizeof(*offsets));
+    blockCapacity = blocks;
+  }
+}
+
+
+
+/******************************************************************************
+* Quantise the depths of one block into keys, the furthest sprite gets key 0.
+* Digits of all passes are counted at the same time, the totals tell which
+* passes are needed.
+******************************************************************************/
+static void quantiseBlock(int block, void *parameters)
+{
+  const Sort *sort = parameters;
+  int index, pass, first = block * SORT_BLOCK_SIZE;
+  int last = first + SORT_BLOCK_SIZE < sort->count ? first + SORT_BLOCK_SIZE : sort->count;
+  real key;
+
+  memset(offsets[block], 0, sizeof(offsets[0]));
+  for (index = first; index < last; index++)
+  {
+    key = (sort->depth[index] - sort->nearest) * sort->scale;
+    key = key < 0.0f ? 0.0f : key > 65535.0f ? 65535.0f : key;
+    keys[0][index] = 65535 - (uint16_t)key;
+    order[0][index] = index;
+    for (pass = 0; pass < SORT_PASSES; pass++)
+      offsets[block][pass][(keys[0][index] >> (pass * DEPTH_DIGIT_BITS)) & (DEPTH_BUCKETS - 1)]++;
+  }
+}
+
+
+
+/******************************************************************************
+* Count the digits of one block again after the previous passes moved them
+******************************************************************************/
+static void countBlock(int block, void *parameters)
+{
+  const Sort *sort = parameters;
+  int index, first = block * SORT_BLOCK_SIZE;
+  int last = first + SORT_BLOCK_SIZE < sort->count ? first + SORT_BLOCK_SIZE : sort->count;
+  int *count = offsets[block][sort->pass];
+  const uint16_t *key = keys[sort->source];
+
+  memset(count, 0, sizeof(offsets[0][0]));
+  for (index = first; index < last; index++)
+    count[(key[index] >> sort->shift) & (DEPTH_BUCKETS - 1)]++;
+}
+
+
+
+/******************************************************************************
+* Test whether a pass changes the order at all, i.e. whether the sprites do
+* not all share the same digit
+******************************************************************************/
+static int passNeeded(int blocks, int pass, int count)
+{
+  int block, digit, total;
+
+  for (digit = 0; digit < DEPTH_BUCKETS; digit++)
+  {
+    for (block = 0, total = 0; block < blocks; block++)
+      total += offsets[block][pass][digit];
+    if (total == count)
+      return 0;
+  }
+  return 1;
+}
+
+
+
+/******************************************************************************
+* Turn the digit counts of all blocks into the first destination of every
+* (digit, block), blocks keep their order within each digit
+******************************************************************************/
+static void prefixSum(int blocks, int pass)
+{
+  int block, digit, total = 0, count;
+
+  for (digit = 0; digit < DEPTH_BUCKETS; digit++)
+  {
+    for (block = 0; block < blocks; block++)
+    {
+      count = offsets[block][pass][digit];
+      offsets[block][pass][digit] = total;
+      total += count;
+    }
+  }
+}
+
+
+
+/******************************************************************************
+* Write the four vertex indices of sprite "sprite" to "quad"
+******************************************************************************/
+static inline void quadIndices(unsigned int *quad, unsigned int sprite)
+{
+  quad[0] = 4 * sprite;
+  quad[1] = 4 * sprite + 1;
+  quad[2] = 4 * sprite + 2;
+  quad[3] = 4 * sprite + 3;
+}
+
+
+
+/******************************************************************************
+* Move the sprites of one block to their places for the current digit. The
+* last pass writes the indices of each sprite instead.
+******************************************************************************/
+static void scatterBlock(int block, void *parameters)
+{
+  const Sort *sort = parameters;
+  int index, first = block * SORT_BLOCK_SIZE;
+  int last = first + SORT_BLOCK_SIZE < sort->count ? first + SORT_BLOCK_SIZE : sort->count;
+  int *offset = offsets[block][sort->pass], destination;
+  const uint16_t *key = keys[sort->source];
+  const unsigned int *sprite = order[sort->source];
+  uint16_t *keyOut = keys[!sort->source];
+  unsigned int *spriteOut = order[!sort->source];
+
+  for (index = first; index < last; index++)
+  {
+    destination = offset[(key[index] >> sort->shift) & (DEPTH_BUCKETS - 1)]++;
+    if (sort->indices)
+      quadIndices(sort->indices + 4 * (size_t)destination, sprite[index]);
+    else {
+      keyOut[destination] = key[index];
+      spriteOut[destination] = sprite[index];
+    }
+  }
+}
+
+// All depths equal (or no pass needed), draw in the order packed
+static void identityBlock(int block, void *parameters)
+{
+  const Sort *sort = parameters;
+  int index, first = block * SORT_BLOCK_SIZE;
+  int last = first + SORT_BLOCK_SIZE < sort->count ? first + SORT_BLOCK_SIZE : sort->count;
+
+  for (index = first; index < last; index++)
+    quadIndices(sort->indices + 4 * (size_t)index, index);
+}
+
+
+
+/******************************************************************************
+* Write the vertex indices of "count" quads to "indices" (4 per sprite) so 
+* that the sprites are drawn from the largest "depth" to the smallest
+******************************************************************************/
+void sortSprites(const real *depth, int count, unsigned int *indices)
+{
+  Sort sort;
+  int blocks = (count + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+  int pass, lastPass = -1, moved = 0, needed[SORT_PASSES];
+  real furthest = -FLT_MAX;
+
+  if (count <= 0)
+    return;
+  reserveSort(count);
+  sort.depth = depth;
+  sort.count = count;
+  sort.nearest = FLT_MAX;
+  arrayRange(depth, count, &sort.nearest, &furthest);
+  sort.scale = furthest > sort.nearest ? 65535.0f / (furthest - sort.nearest) : 0.0f;
+  parallelFor(blocks, quantiseBlock, &sort);
+  for (pass = 0; pass < SORT_PASSES; pass++)
+    if ((needed[pass] = passNeeded(blocks, pass, count)))
+      lastPass = pass;
+
+  sort.indices = indices;
+  if (lastPass < 0) {
+    parallelFor(blocks, identityBlock, &sort);
+    return;
+  }
+
+  sort.source = 0;
+  for (pass = 0; pass <= lastPass; pass++)
+  {
+    if (!needed[pass])
+      continue;
+    sort.pass = pass;
+    sort.shift = pass * DEPTH_DIGIT_BITS;
+    sort.indices = pass == lastPass ? indices : NULL;
+    if (moved)
+      parallelFor(blocks, countBlock, &sort);
+    prefixSum(blocks, pass);
+    parallelFor(blocks, scatterBlock, &sort);
+    sort.source = !sort.source;
+    moved = 1;
+  }
+}
@@ -0,0 +1,27 @@
+/******************************************************************************
+* File:         depthSort.h
+* Brief:        Back-to-front ordering of smoke sprites (parallel radix sort)
+******************************************************************************/
+#ifndef DEPTH_SORT_H
+#define DEPTH_SORT_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Depth keys are quantised to DEPTH_KEY_BITS bits between the nearest and the
+* furthest sprite, each sort pass handles DEPTH_DIGIT_BITS of them
+******************************************************************************/
+#define DEPTH_KEY_BITS 16
+#define DEPTH_DIGIT_BITS 8
+#define DEPTH_BUCKETS (1 << DEPTH_DIGIT_BITS)
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void sortSprites(const real*, int, unsigned int*); // Quad indices, furthest first
+
+#endif
@@ -0,0 +1,181 @@
+/******************************************************************************
+* File:         emitter.c
+* Brief:        Registry of particle emitters (fountains and smoke sources)
+*
+* Note:
+* Spawning replaces dead particles of a system up to its total, the emitters
+* share the new particles in proportion to their rates. The batch is split
+* by systematic sampling: new particle k goes to the emitter whose part of
+* the summed rates contains (k + offset) / count of it, with a random offset
+* per step. Emitters therefore get their share exactly on average, even when
+* there are more emitters than particles to spawn, and the particles of one
+* emitter are next to each other in the batch, so spawning can fill whole
+* runs of particles with the parameters of one emitter.
+******************************************************************************/
+#include "emitter.h"
+
+
+
+/******************************************************************************
+* Global variables (declared in emitter.h)
+******************************************************************************/
+EmitterRegistry waterSources;
+EmitterRegistry smokeSources;
+
+
+
+/******************************************************************************
+* Grow the arrays of a registry to hold "capacity" emitters
+******************************************************************************/
+static void *resize(void *buffer, int capacity, size_t size)
+{
+  buffer = realloc(buffer, (size_t)capacity * size);
+  if (!buffer) {
+    fprintf(stderr, "Could not allocate %d emitters\n", capacity);
+    exit(1);
+  }
+  return buffer;
+}
+
+static void reserveEmitters(EmitterRegistry *registry, int capacity)
+{
+  if (capacity <= registry->capacity)
+    return;
+  capacity = capacity > 2 * registry->capacity ? capacity : 2 * registry->capacity;
+  capacity = capacity < EMITTER_LIMIT ? capacity : EMITTER_LIMIT;
+  registry->emitters = resize(registry->emitters, capacity, sizeof(Emitter));
+  registry->active = resize(registry->active, capacity, sizeof(int));
+  registry->cumulative = resize(registry->cumulative, capacity, sizeof(double));
+  registry->capacity = capacity;
+}
+
+
+
+/******************************************************************************
+* Collect the active emitters and the running sum of their rates
+******************************************************************************/
+void updateEmitters(EmitterRegistry *registry)
+{
+  int index;
+  double total = 0.0;
+
+  registry->activeCount = 0;
+  for (index = 0; index < registry->count; index++)
+  {
+    if (!(registry->emitters[index].rate > 0.0))
+      continue;
+    total += registry->emitters[index].rate;
+    registry->active[registry->activeCount] = index;
+    registry->cumulative[registry->activeCount++] = total;
+  }
+}
+
+
+
+/******************************************************************************
+* Add an emitter to a registry, returns its index or -1 if the registry is
+* full
+******************************************************************************/
+int addEmitter(EmitterRegistry *registry, const Emitter *emitter)
+{
+  if (registry->count == EMITTER_LIMIT)
+    return -1;
+  reserveEmitters(registry, registry->count + 1);
+  registry->emitters[registry->count++] = *emitter;
+  updateEmitters(registry);
+  return registry->count - 1;
+}
+
+
+
+/******************************************************************************
+* Replace the emitters of a registry with "count" emitters (restored from a
+* snapshot, the tags of live particles refer to them)
+******************************************************************************/
+void setEmitters(EmitterRegistry *registry, const Emitter *emitters, int count)
+{
+  reserveEmitters(registry, count);
+  memcpy(registry->emitters, emitters, (size_t)count * sizeof(Emitter));
+  registry->count = count;
+  updateEmitters(registry);
+}
+
+
+
+/******************************************************************************
+* Fill a registry with "count" copies of "emitter" on a square grid in the
+* plane of the emitter, centred on its position
+******************************************************************************/
+static void addGrid(EmitterRegistry *registry, const Emitter *emitter, int count)
+{
+  int index, side = (int)ceil(sqrt((double)count));
+  Emitter cell = *emitter;
+
+  registry->count = 0;
+  reserveEmitters(registry, count);
+  for (index = 0; index < count; index++)
+  {
+    cell.position[0] = emitter->position[0] + (index % side - 0.5 * (side - 1)) * EMITTER_SPACING;
+    cell.position[2] = emitter->position[2] + (index / side - 0.5 * (side - 1)) * EMITTER_SPACING;
+    registry->emitters[registry->count++] = cell;
+  }
+  updateEmitters(registry);
+}
+
+
+
+/******************************************************************************
+* Set up the default emitters: the fountain and the smoke source of the
+* original scene, repeated on a grid if more than one was asked for
+******************************************************************************/
+void initEmitters(void)
+{
+  const Emitter fountainEmitter = {
+    { WATER_FOUNTAIN_X, WATER_FOUNTAIN_Y, WATER_FOUNTAIN_Z }, WATER_SIDE_SPLASH_VAR,
+    WATER_SPEED_MEAN, WATER_SPEED_VAR,
+    { WATER_DROP_COLOUR_R, WATER_DROP_COLOUR_G, WATER_DROP_COLOUR_B }, 1.0
+  };
+  const Emitter smokeSource = {
+    { SMOKE_EMITTER_X, SMOKE_EMITTER_Y, SMOKE_EMITTER_Z }, SMOKE_EMITTER_SIZE,
+    SMOKE_SPEED_MEAN, SMOKE_SPEED_VAR, { 1.0, 1.0, 1.0 }, 1.0
+  };
+  int water = options.waterEmitters, smoke = options.smokeEmitters;
+
+  addGrid(&waterSources, &fountainEmitter, water < 1 ? 1 : water > EMITTER_LIMIT ? EMITTER_LIMIT : water);
+  addGrid(&smokeSources, &smokeSource, smoke < 1 ? 1 : smoke > EMITTER_LIMIT ? EMITTER_LIMIT : smoke);
+}
+
+
+
+/******************************************************************************
+* Write the emitters of "count" consecutive new particles to "tags". The
+* first one is at "position" (batch index plus the offset of the step) of a
+* batch in which every particle stands for "spacing" of the summed rates.
+******************************************************************************/
+void assignEmitters(const EmitterRegistry *registry, unsigned short *tags, int count,
+                    double position, double spacing)
+{
+  int index, low = 0, high = registry->activeCount - 1, middle;
+  double share = position * spacing;
+
+  if (registry->activeCount == 0)
+    return;
+
+  // First active emitter whose part ends after the first particle
+  while (low < high)
+  {
+    middle = (low + high) / 2;
+    if (registry->cumulative[middle] <= share)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for (index = 0; index < count; index++)
+  {
+    share = (position + index) * spacing;
+    while (low < registry->activeCount - 1 && registry->cumulative[low] <= share)
+      low++;
+    tags[index] = registry->active[low];
+  }
+}
@@ -0,0 +1,74 @@
+/******************************************************************************
+* File:         emitter.h
+* Brief:        Registry of particle emitters (fountains and smoke sources)
+*
+* Note:
+* Each particle system has one pool of particles shared by all its emitters,
+* every particle records the emitter which spawned it (Water.emitter,
+* Smoke.emitter). An emitter is only a small block of spawn parameters, so
+* spawning and updating stay single passes over the whole pool however many
+* emitters there are.
+******************************************************************************/
+#ifndef EMITTER_H
+#define EMITTER_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Registry parameters
+******************************************************************************/
+#define EMITTER_LIMIT 65536				// Most emitters per system (16-bit tags)
+#define EMITTER_SPACING 50.0			// Distance between emitters of a grid
+
+
+
+/******************************************************************************
+* Spawn parameters of one emitter. The meaning of "spread" and "colour"
+* depends on the particle system.
+******************************************************************************/
+typedef struct {
+	double position[3];					// Spawn location
+	double spread;						// Water: deviation of the side splash,
+										// smoke: half size of the spawn square
+	double speedMean;					// Initial vertical speed, mean and variance
+	double speedVar;
+	double colour[3];					// Water: drop colour, smoke: tint of the
+										// system shade (Smoke.r0, g0, b0)
+	double rate;						// Share of spawned particles, relative to
+										// the other emitters (0 = switched off)
+} Emitter;
+
+
+
+/******************************************************************************
+* Emitters of one particle system. Emitters are never removed, so the tags
+* of live particles stay valid, switch one off by setting its rate to 0.
+******************************************************************************/
+typedef struct {
+	Emitter *emitters;
+	int count;
+	int capacity;
+	int *active;						// Emitters with a positive rate
+	double *cumulative;					// Sum of the rates of active[0..i]
+	int activeCount;
+} EmitterRegistry;
+
+extern EmitterRegistry waterSources;
+extern EmitterRegistry smokeSources;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void initEmitters(void);				// Default grids of options.waterEmitters,
+										// options.smokeEmitters emitters
+int addEmitter(EmitterRegistry*, const Emitter*); // Register, returns its index
+void setEmitters(EmitterRegistry*, const Emitter*, int); // Replace all emitters
+void updateEmitters(EmitterRegistry*);	// Call after changing any rate
+void assignEmitters(const EmitterRegistry*, unsigned short*, int, double, double);
+										// Emitters of a batch of new particles
+
+#endif
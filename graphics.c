@@ -0,0 +1,774 @@
+/******************************************************************************
+* File:         graphics.c
+* Brief:        Rendering and user interaction using OpenGL and GLUT
+* Author:       Krzysztof Koch  
+* Date created: 04/10/2016
+* Last mod:     11/11/2016
+*
+* Note:
+* Two rendering options are available (by changing the value of RENDERING_METHOD)
+*   1. Particles are drawn as points
+*   2. Water movement is drawn using lines, while smoke is rendered using 
+*   textured sprites. All smoke images are packed into a single texture atlas, 
+*   so the smoke is drawn in one batch without texture changes. Very dense
+*   smoke is drawn as slices of a 3D texture instead (smokeVolume.c).
+*
+* Particles are packed into interleaved vertex arrays (renderBuffer.c) and 
+* drawn in batches from vertex buffer objects, or from client memory when 
+* vertex buffer objects are not available (or --client-arrays is given).
+*
+* The simulation advances in fixed steps as wall clock time passes, not once
+* per frame, particles are drawn between their last two simulated positions.
+* Every frame is recorded in the metrics (metrics.c), key 'm' shows them.
+* With --trace the phases of the frame are traced as zones, key 't' writes
+* the trace (trace.c).
+* The next frame is simulated and packed by another thread while the current
+* one is drawn (pipeline.c), input handlers wait for it before changing the
+* simulation. Controls changing it go through input.c, so that they can be
+* recorded and replayed; key 'p' saves a snapshot, key 'P' restores it.
+* With --capture frames are drawn offscreen and written as images instead
+* (capture.c).
+*       
+******************************************************************************/
+#include "graphics.h"
+
+
+
+/******************************************************************************
+* Global variables (declared in graphics.h)
+******************************************************************************/
+int frameCount, currentTime, previousTime;
+double fps;
+char stringBuffer[50];
+int useVertexBuffers;
+GLuint waterBuffer, smokeBuffer, indexBuffer;
+GLuint smokeAtlas;
+GLuint smokeVolumeTexture;
+
+// Viewport size in pixels, the height is used to size the smoke sprites, 
+// and aspect ratio of the projection, used for culling
+static int viewportWidth = WINDOW_WIDTH;
+static int viewportHeight = WINDOW_HEIGHT;
+static double aspectRatio = (double)WINDOW_WIDTH / WINDOW_HEIGHT;
+
+// Wall clock time of the previous frame, zero before the first one
+static double previousFrame;
+
+// Frame being drawn, its metrics and whether they are shown
+static const Frame *frame;
+static FrameMetrics frameMetrics;
+static int showMetrics;
+
+
+
+/******************************************************************************
+* Camera views
+******************************************************************************/
+
+// General view, shows both the fountain an smoke emitter together with parameter values
+CameraView DEFAULT_VEW = {
+    .eyeX = 0.0,
+    .eyeY = 240.0,
+    .eyeZ = 500.0,
+    .centerX = 0.0,
+    .centerY = 240.0,
+    .centerZ = 0.0,
+    .upX = 0.0,
+    .upY = 1.0,
+    .upZ = 0.0
+};
+
+// Only fountain shown
+CameraView FOUNTAIN_VIEW = {
+    .eyeX = WATER_FOUNTAIN_X + 400,
+    .eyeY = WATER_FOUNTAIN_Y,
+    .eyeZ = WATER_FOUNTAIN_Z,
+    .centerX = WATER_FOUNTAIN_X,
+    .centerY = WATER_FOUNTAIN_Y + 200,
+    .centerZ = WATER_FOUNTAIN_Z,
+    .upX = 0.0,
+    .upY = 1.0,
+    .upZ = 0.0
+};
+
+// Only smoke shown
+CameraView SMOKE_VIEW = {
+    .eyeX = SMOKE_EMITTER_X - 400,
+    .eyeY = SMOKE_EMITTER_Y,
+    .eyeZ = SMOKE_EMITTER_Z,
+    .centerX = SMOKE_EMITTER_X,
+    .centerY = SMOKE_EMITTER_Y + 200,
+    .centerZ = SMOKE_EMITTER_Z,
+    .upX = 0.0,
+    .upY = 1.0,
+    .upZ = 0.0
+};
+
+// View of the fountain from above
+CameraView FOUNTAIN_TOP_VIEW = {
+    .eyeX = WATER_FOUNTAIN_X,
+    .eyeY = 600,
+    .eyeZ = WATER_FOUNTAIN_Z,
+    .centerX = WATER_FOUNTAIN_X,
+    .centerY = WATER_FOUNTAIN_Y,
+    .centerZ = WATER_FOUNTAIN_Z,
+    .upX = 0.0,
+    .upY = 0.0,
+    .upZ = 1.0
+};
+
+// View of the smoke from above
+CameraView SMOKE_TOP_VIEW = {
+    .eyeX = SMOKE_EMITTER_X,
+    .eyeY = 600,
+    .eyeZ = SMOKE_EMITTER_Z,
+    .centerX = SMOKE_EMITTER_X,
+    .centerY = SMOKE_EMITTER_Y,
+    .centerZ = SMOKE_EMITTER_Z,
+    .upX = 0.0,
+    .upY = 0.0,
+    .upZ = 1.0
+};
+
+// Current view
+CameraView *currentView = &DEFAULT_VEW;
+
+
+
+/******************************************************************************
+* Return OpenGL version of the current context as major * 10 + minor
+******************************************************************************/
+static int openGLVersion(void)
+{
+  int major = 1, minor = 0;
+  const char *version = (const char*)glGetString(GL_VERSION);
+
+  if (version)
+    sscanf(version, "%d.%d", &major, &minor);
+  return major * 10 + minor;
+}
+
+
+
+/******************************************************************************
+* Load all smoke images into one texture atlas. Each image is resampled into
+* a square cell (point sprites used to stretch them to squares as well), cell
+* "index" holds Textures/smoke<index>.png. Returns the texture name.
+******************************************************************************/
+static GLuint loadSmokeAtlas(void)
+{
+  int index, row, width, height, channels;
+  size_t cellRow = SMOKE_ATLAS_CELL * 4;
+  unsigned char *image, *cell, *atlas, *destination;
+  GLuint texture;
+
+  atlas = calloc((size_t)SMOKE_ATLAS_SIZE * SMOKE_ATLAS_SIZE, 4);
+  cell = malloc(cellRow * SMOKE_ATLAS_CELL);
+  if (!atlas || !cell) {
+    fprintf(stderr, "Could not allocate smoke texture atlas\n");
+    exit(1);
+  }
+
+  for (index = 0; index < SMOKE_TEXTURE_NUMBER; index++) 
+  {
+    sprintf(stringBuffer, "Textures/smoke%d.png", index);
+    image = SOIL_load_image(stringBuffer, &width, &height, &channels, SOIL_LOAD_RGBA);
+    if (!image) {
+      fprintf(stderr, "Could not load %s: %s\n", stringBuffer, SOIL_last_result());
+      continue;
+    }
+    gluScaleImage(GL_RGBA, width, height, GL_UNSIGNED_BYTE, image, 
+                  SMOKE_ATLAS_CELL, SMOKE_ATLAS_CELL, GL_UNSIGNED_BYTE, cell);
+    SOIL_free_image_data(image);
+
+    destination = atlas + ((size_t)(index / SMOKE_ATLAS_COLUMNS) * SMOKE_ATLAS_CELL * SMOKE_ATLAS_SIZE + 
+                           (index % SMOKE_ATLAS_COLUMNS) * SMOKE_ATLAS_CELL) * 4;
+    for (row = 0; row < SMOKE_ATLAS_CELL; row++)
+      memcpy(destination + (size_t)row * SMOKE_ATLAS_SIZE * 4, cell + row * cellRow, cellRow);
+  }
+
+  texture = SOIL_create_OGL_texture(atlas, SMOKE_ATLAS_SIZE, SMOKE_ATLAS_SIZE, 4, 
+                                    SOIL_CREATE_NEW_ID, SOIL_FLAG_MIPMAPS);
+  free(cell);
+  free(atlas);
+  return texture;
+}
+
+
+
+/******************************************************************************
+* Rendering state, set up once there is a context (window or offscreen)
+******************************************************************************/
+static void initRendering(void)
+{
+  // Use vertex buffer objects if OpenGL 1.5 is available, client arrays otherwise
+  useVertexBuffers = !options.clientArrays && openGLVersion() >= 15;
+  if (useVertexBuffers) {
+    glGenBuffers(1, &waterBuffer);
+    glGenBuffers(1, &smokeBuffer);
+    glGenBuffers(1, &indexBuffer);
+  }
+  printf("Renderer: %s, %s\n", glGetString(GL_RENDERER), 
+         useVertexBuffers ? "vertex buffer objects" : "client vertex arrays");
+
+  // Render points as circles and make them span a few pixels instead of one
+  glEnable(GL_POINT_SMOOTH);
+  glPointSize(POINT_SIZE);
+
+  /*--------------------------------------------------------------------------
+  * Setup for the smoke rendering method using textures
+  *-------------------------------------------------------------------------*/
+  #if RENDERING_METHOD == 2
+
+    // Render antialiased points and lines in arbitrary order, pixel aithmetic
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_BLEND);
+    // Texture colour is modulated by the particle colour
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+
+    // Load all smoke images into one texture, it stays bound from now on
+    smokeAtlas = loadSmokeAtlas();
+    glBindTexture(GL_TEXTURE_2D, smokeAtlas);
+
+    // Texture of the smoke density volume (3D textures need OpenGL 1.2)
+    if (openGLVersion() >= 12) {
+      glGenTextures(1, &smokeVolumeTexture);
+      glBindTexture(GL_TEXTURE_3D, smokeVolumeTexture);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    }
+    else
+      options.smokeVolume = 0;
+  #endif
+}
+
+
+
+/******************************************************************************
+* Initialisation function
+******************************************************************************/
+void initGraphics(int argc, char *argv[])
+{
+  glutInit(&argc, argv);
+  glutInitWindowPosition(100, 100);
+  glutInitDisplayMode(GLUT_DOUBLE | GLUT_DEPTH);
+  glutCreateWindow("Particle system");
+  glutFullScreen();
+  glutDisplayFunc(display);
+  glutKeyboardFunc(keyboard);
+  glutSpecialFunc(cursor_keys);
+  glutReshapeFunc(reshape);
+  createMenu();
+  initRendering();
+}
+
+
+
+/******************************************************************************
+* Calculate camera axes for smoke sprites. Sprites are SPRITE_SIZE pixels 
+* large at the distance of the point the camera looks at (see reshape()).
+******************************************************************************/
+static void billboardAxes(Billboard *billboard)
+{
+  double forward[3], right[3], up[3], length, distance, halfSize;
+  int axis;
+
+  forward[0] = currentView->centerX - currentView->eyeX;
+  forward[1] = currentView->centerY - currentView->eyeY;
+  forward[2] = currentView->centerZ - currentView->eyeZ;
+  distance = sqrt(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+
+  // right = forward x up, up = right x forward (as in gluLookAt())
+  right[0] = forward[1] * currentView->upZ - forward[2] * currentView->upY;
+  right[1] = forward[2] * currentView->upX - forward[0] * currentView->upZ;
+  right[2] = forward[0] * currentView->upY - forward[1] * currentView->upX;
+  length = sqrt(right[0] * right[0] + right[1] * right[1] + right[2] * right[2]);
+  for (axis = 0; axis < 3; axis++)
+    right[axis] /= length;
+  up[0] = (right[1] * forward[2] - right[2] * forward[1]) / distance;
+  up[1] = (right[2] * forward[0] - right[0] * forward[2]) / distance;
+  up[2] = (right[0] * forward[1] - right[1] * forward[0]) / distance;
+
+  halfSize = SPRITE_SIZE * distance * tan(0.5 * FIELD_OF_VIEW * DEG_TO_RAD) / viewportHeight;
+  for (axis = 0; axis < 3; axis++)
+  {
+    billboard->right[axis] = right[axis] * halfSize;
+    billboard->up[axis] = up[axis] * halfSize;
+  }
+}
+
+
+
+/******************************************************************************
+* Calculate the view frustum of the current view (see setView() and 
+* reshape()), particles outside of it are not packed for drawing
+******************************************************************************/
+static void cullingFrustum(Frustum *frustum)
+{
+  const double eye[3] = {currentView->eyeX, currentView->eyeY, currentView->eyeZ};
+  const double centre[3] = {currentView->centerX, currentView->centerY, currentView->centerZ};
+  const double up[3] = {currentView->upX, currentView->upY, currentView->upZ};
+
+  viewFrustum(frustum, eye, centre, up, FIELD_OF_VIEW, aspectRatio, NEAR_PLANE, FAR_PLANE);
+}
+
+
+
+/******************************************************************************
+* Take the next simulated frame, "elapsed" seconds after the previous one,
+* and draw its particles. Wall clock time "now" is that of the frame, the
+* time since the previous one is recorded and controls the particle budget.
+******************************************************************************/
+static void drawFrame(double now, double elapsed)
+{
+  double start, frameTime = previousFrame > 0.0 ? now - previousFrame : 0.0;
+  Billboard billboard;
+  Frustum frustum;
+
+  // Take the simulated frame, the next one catches up with the elapsed time
+  billboardAxes(&billboard);
+  cullingFrustum(&frustum);
+  start = wallClock();
+  TRACE_BEGIN("nextFrame");
+  frame = nextFrame(elapsed, frameTime, RENDERING_METHOD == 2, 
+                    RENDERING_METHOD == 2 ? &billboard : NULL, &frustum);
+  TRACE_END();
+  frameMetrics = frame->metrics;
+  frameMetrics.value[METRIC_FENCE] = wallClock() - start;
+  frameMetrics.value[METRIC_FRAME] = frameTime;
+  previousFrame = now;
+
+  start = wallClock();
+  setView();
+  frameMetrics.value[METRIC_SET_VIEW] = wallClock() - start;
+  start = wallClock();
+  TRACE_BEGIN("drawParticles");
+  glClear(GL_COLOR_BUFFER_BIT);         // Clear the screen and depth buffer
+  drawParticles();                      // Render particles (interpolated)
+  TRACE_END();
+  frameMetrics.value[METRIC_DRAW] = wallClock() - start;
+}
+
+
+
+/******************************************************************************
+* Callback function, called whenever graphics should be redrawn
+******************************************************************************/
+void display()
+{
+  double now = wallClock(), start;
+
+  TRACE_BEGIN("display");
+  drawFrame(now, previousFrame > 0.0 ? now - previousFrame : 0.0);
+  glutPostRedisplay();                  // Mark the current window to be redisplayed
+  calculateFPS();                       // Calculate the frame rate
+  
+  if (currentView == &DEFAULT_VEW)      // Display simulation parameter values
+    displayData();  
+  if (showMetrics)                      // Display frame metrics, in any view
+    displayMetrics();
+
+  start = wallClock();
+  TRACE_BEGIN("glutSwapBuffers");
+  glutSwapBuffers();                    // Double buffering in place
+  TRACE_END();
+  frameMetrics.value[METRIC_SWAP] = wallClock() - start;
+  recordFrame(&frameMetrics);
+  TRACE_END();
+}
+
+
+
+/******************************************************************************
+* Draw "frames" frames offscreen and write them as images (--capture, see
+* capture.c). Like headless runs every frame stands for one tick of wall
+* clock time, however long drawing and encoding take; with --target-frame
+* the particle totals follow the measured time of the captured frames. The
+* overlays are not drawn, GLUT fonts need a window. Returns program exit
+* status.
+******************************************************************************/
+int runCapture(int frames)
+{
+  double start, captureStart, waited, total;
+  int index;
+
+  if (!openCapture(options.captureWidth, options.captureHeight))
+    return 1;
+  initRendering();
+  reshape(options.captureWidth, options.captureHeight);
+
+  // Pipelined frames are shown one frame late, the first one is empty
+  start = wallClock();
+  if (options.pipeline)
+    drawFrame(start, SIMULATION_TICK);
+  for (index = 0; index < frames; index++)
+  {
+    TRACE_BEGIN("capture");
+    drawFrame(wallClock(), SIMULATION_TICK);
+
+    // Reading back takes the place of the swap
+    captureStart = wallClock();
+    captureFrame();
+    frameMetrics.value[METRIC_SWAP] = wallClock() - captureStart;
+    recordFrame(&frameMetrics);
+    TRACE_END();
+  }
+  waitFrame();
+  waited = closeCapture();
+  total = wallClock() - start;
+
+  printf("Captured %d frames in %.3f s (%.1f frames/s), waited %.3f s for the encoders\n",
+         frames, total, frames / total, waited);
+  dumpMetrics();
+  return 0;
+}
+
+
+
+/******************************************************************************
+* Hand vertex data over to OpenGL. With vertex buffer objects the data is 
+* copied into "buffer" and the returned pointer is an offset into it, 
+* otherwise client memory is used directly.
+******************************************************************************/
+static const void *vertexData(GLuint buffer, const void *data, size_t size)
+{
+  frameMetrics.value[METRIC_BYTES] += size;
+  if (!useVertexBuffers)
+    return data;
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  glBufferData(GL_ARRAY_BUFFER, size, data, GL_STREAM_DRAW);
+  return NULL;
+}
+
+// The same for vertex indices
+static const void *indexData(GLuint buffer, const void *data, size_t size)
+{
+  frameMetrics.value[METRIC_BYTES] += size;
+  if (!useVertexBuffers)
+    return data;
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, data, GL_STREAM_DRAW);
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Draw the smoke density volume: upload its texels and draw the slices back
+* to front from client memory (a few dozen quads). Texels are premultiplied
+* by alpha.
+******************************************************************************/
+static void drawSmokeVolume(const SmokeVolume *volume)
+{
+  glBindTexture(GL_TEXTURE_3D, smokeVolumeTexture);
+  glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA, volume->size[0], volume->size[1], volume->size[2], 
+               0, GL_RGBA, GL_UNSIGNED_BYTE, volume->texels);
+  frameMetrics.value[METRIC_TEXTURE_BINDS]++;
+  frameMetrics.value[METRIC_BYTES] += 4.0 * volume->size[0] * volume->size[1] * volume->size[2] + 
+                                      volume->vertexCount * sizeof(SliceVertex);
+  if (useVertexBuffers)
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glTexCoordPointer(3, GL_FLOAT, sizeof(SliceVertex), &volume->vertices[0].s);
+  glVertexPointer(3, GL_FLOAT, sizeof(SliceVertex), &volume->vertices[0].x);
+  glColor4f(1.0, 1.0, 1.0, 1.0);
+  glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+  glEnable(GL_TEXTURE_3D);
+  glDrawArrays(GL_QUADS, 0, volume->vertexCount);
+  frameMetrics.value[METRIC_DRAW_CALLS]++;
+  glDisable(GL_TEXTURE_3D);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+}
+
+
+
+/******************************************************************************
+* Render the particles of the current frame, packed into vertex arrays by 
+* the simulation. Each system is drawn with a single glDrawArrays() call.
+******************************************************************************/
+void drawParticles() 
+{
+  const RenderBuffers *buffers = &frame->buffers;
+  const void *vertices;
+
+  // Draw the fountains, as points or joining the current position and the 
+  // future one (determined by velocity vector) by a line, in the colour of 
+  // their emitters
+  vertices = vertexData(waterBuffer, buffers->water, 
+                        buffers->waterVertices * sizeof(ColouredVertex));
+  glInterleavedArrays(GL_C4UB_V3F, 0, vertices);
+  glDrawArrays(RENDERING_METHOD == 1 ? GL_POINTS : GL_LINES, 0, buffers->waterVertices);
+  frameMetrics.value[METRIC_DRAW_CALLS]++;
+
+  /*--------------------------------------------------------------------------
+  * Smoke as points, colours come from the vertex array
+  *-------------------------------------------------------------------------*/
+  #if RENDERING_METHOD == 1
+
+    vertices = vertexData(smokeBuffer, buffers->smoke, 
+                          buffers->smokeVertices * sizeof(ColouredVertex));
+    glInterleavedArrays(GL_C4UB_V3F, 0, vertices);
+    glDrawArrays(GL_POINTS, 0, buffers->smokeVertices);
+    frameMetrics.value[METRIC_DRAW_CALLS]++;
+
+  /*--------------------------------------------------------------------------
+  * Smoke as textured sprites with alpha blending, all cells of one atlas. 
+  * Sprites are drawn back to front through the index buffer if sorted. 
+  * Too many sprites have been replaced by a density volume.
+  *-------------------------------------------------------------------------*/
+  #else
+
+    if (buffers->volume.vertexCount)
+      drawSmokeVolume(&buffers->volume);
+    else {
+      vertices = vertexData(smokeBuffer, buffers->sprites, 
+                            buffers->spriteVertices * sizeof(TexturedVertex));
+      glInterleavedArrays(GL_T2F_C4UB_V3F, 0, vertices);
+      glEnable(GL_TEXTURE_2D);
+      if (buffers->spriteIndexCount)
+        glDrawElements(GL_QUADS, buffers->spriteIndexCount, GL_UNSIGNED_INT, 
+                       indexData(indexBuffer, buffers->spriteIndices, 
+                                 buffers->spriteIndexCount * sizeof(unsigned int)));
+      else
+        glDrawArrays(GL_QUADS, 0, buffers->spriteVertices);
+      frameMetrics.value[METRIC_DRAW_CALLS]++;
+      glDisable(GL_TEXTURE_2D);
+      glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+
+  #endif
+
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  if (useVertexBuffers) {
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  }
+}
+
+
+
+/******************************************************************************
+* Interactive control of the environment using standard keyboard keys
+******************************************************************************/
+void keyboard(unsigned char key, int x, int y)
+{
+  waitFrame();
+  switch(key) 
+  {
+    // Quit the program
+    case 27: exit(0); break;
+
+    // Show or hide the frame metrics, write the trace (with --trace)
+    case 'm': showMetrics = !showMetrics; break;
+    case 't': writeTrace(); break;
+
+    // Save the state to --snapshot FILE and restore it
+    case 'p': saveSnapshot(options.snapshotFile); break;
+    case 'P': applyControl(CONTROL_RESTORE, 0); break;
+
+    // Everything else changes the simulation (see input.c)
+    default: applyControl(CONTROL_KEY, key); break;
+  }
+  glutPostRedisplay();
+}
+
+
+
+/******************************************************************************
+* Interactive control of  the enviroment using special keys: gravity (up and
+* down) and wind direction (left and right), see input.c
+******************************************************************************/
+void cursor_keys(int key, int x, int y) 
+{
+  waitFrame();
+  applyControl(CONTROL_SPECIAL_KEY, key);
+} // cursor_keys()
+
+
+
+/******************************************************************************
+* Create manu interface
+******************************************************************************/
+void createMenu(void) {
+  glutCreateMenu (menu);
+  glutAddMenuEntry ("Reset simulation", 1);
+  glutAddMenuEntry ("", 999);
+  glutAddMenuEntry ("Default view", 2);
+  glutAddMenuEntry ("Fountain view", 3);
+  glutAddMenuEntry ("Smoke view", 4);
+  glutAddMenuEntry ("Fountain top view", 5);
+  glutAddMenuEntry ("Smoke top view", 6);
+  glutAddMenuEntry ("", 999);
+  glutAddMenuEntry ("Frame metrics", 8);
+  glutAddMenuEntry ("Save snapshot", 9);
+  glutAddMenuEntry ("Restore snapshot", 10);
+  glutAddMenuEntry ("Quit", 7);
+  glutAttachMenu (GLUT_RIGHT_BUTTON);
+}
+
+
+
+/******************************************************************************
+* Create menu entries for changing properties of the particle system
+******************************************************************************/
+void menu (int menuentry) {
+  waitFrame();
+  switch (menuentry) 
+  {
+    // Reset parameters to starting values
+    case 1: applyControl(CONTROL_RESET, 0); 
+            currentView = &DEFAULT_VEW;
+            break;
+    case 2: currentView = &DEFAULT_VEW; break;
+    case 3: currentView = &FOUNTAIN_VIEW; break;
+    case 4: currentView = &SMOKE_VIEW; break;
+    case 5: currentView = &FOUNTAIN_TOP_VIEW; break;
+    case 6: currentView = &SMOKE_TOP_VIEW; break;
+    case 7: exit(0); 
+    case 8: showMetrics = !showMetrics; break;
+    case 9: saveSnapshot(options.snapshotFile); break;
+    case 10: applyControl(CONTROL_RESTORE, 0); break;
+  }
+}
+
+
+
+/******************************************************************************
+* Reshape function called whenever the application window is reshaped
+******************************************************************************/
+void reshape(int width, int height)
+{
+  viewportWidth = width > 0 ? width : 1;
+  viewportHeight = height > 0 ? height : 1;
+  aspectRatio = (double)viewportWidth / viewportHeight;
+  glClearColor(0.0, 0.0, 0.0, 1.0);
+  glViewport(0, 0, (GLsizei)width, (GLsizei)height);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  gluPerspective(FIELD_OF_VIEW, aspectRatio, NEAR_PLANE, FAR_PLANE);
+  glMatrixMode(GL_MODELVIEW);
+}
+
+
+
+/******************************************************************************
+* Implement various camera views
+******************************************************************************/
+void setView (void) 
+{
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+  gluLookAt(currentView->eyeX, currentView->eyeY, currentView->eyeZ,  
+            currentView->centerX, currentView->centerY, currentView->centerZ,  
+            currentView->upX, currentView->upY, currentView->upZ); 
+}
+
+
+
+/******************************************************************************
+* Calculate the number of frames per second
+******************************************************************************/
+void calculateFPS()
+{
+  //  Increase frame count
+  frameCount++;
+
+  //  Get the number of milliseconds since glutInit called (or first call
+  //  to glutGet(GLUT ELAPSED TIME)) and calculate time passed
+  currentTime = glutGet(GLUT_ELAPSED_TIME);
+  int timeInterval = currentTime - previousTime;
+
+  if(timeInterval > 1000)
+  {
+    // Calculate the number of frames per second, set the time and reset
+    // the frame count
+    fps = frameCount / (timeInterval / 1000.0f);  
+    previousTime = currentTime;                   
+    frameCount = 0;                         
+  }
+}
+
+
+
+/******************************************************************************
+* Display important characteristics of the simulation (as of the frame drawn)
+******************************************************************************/
+void displayData(void) 
+{
+  glColor3f(1.0, 1.0, 1.0);
+  sprintf(stringBuffer, "FPS: %.2f", fps);
+  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y, stringBuffer);
+  sprintf(stringBuffer, "Water particles: %d", frame->waterParticles);
+  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 1 * FONT_HEIGHT, stringBuffer);
+  sprintf(stringBuffer, "Smoke particles: %d", frame->smokeParticles);
+  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 2 * FONT_HEIGHT, stringBuffer);
+  sprintf(stringBuffer, "Gravity: %.2f m/s^2", frame->gravity);
+  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 3 * FONT_HEIGHT, stringBuffer);
+  sprintf(stringBuffer, "Wind speed: %.2f m/s", frame->windSpeed);
+  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 4 * FONT_HEIGHT, stringBuffer);
+}
+
+
+
+/******************************************************************************
+* Display the frame metrics (key 'm') in window coordinates, so that they
+* show in every view. The statistics are taken twice a second.
+******************************************************************************/
+void displayMetrics(void)
+{
+  static char lines[METRIC_COUNT + 1][80];
+  static double refreshed;
+  double now = wallClock();
+  MetricSummary summary;
+  int metric;
+
+  if (now - refreshed >= METRICS_REFRESH)
+  {
+    sprintf(lines[0], "%-18s %9s %9s %9s %9s", "", "min", "median", "p99", "max");
+    for (metric = 0; metric < METRIC_COUNT; metric++)
+    {
+      summariseMetric(metric, &summary);
+      sprintf(stringBuffer, *metricUnit(metric) ? "%s [%s]" : "%s", metricName(metric), 
+              metricUnit(metric));
+      sprintf(lines[metric + 1], *metricUnit(metric) ? "%-18s %9.2f %9.2f %9.2f %9.2f" : 
+              "%-18s %9.0f %9.0f %9.0f %9.0f", stringBuffer, summary.min, summary.median,
+              summary.p99, summary.max);
+    }
+    refreshed = now;
+  }
+
+  glMatrixMode(GL_PROJECTION);
+  glPushMatrix();
+  glLoadIdentity();
+  gluOrtho2D(0.0, viewportWidth, 0.0, viewportHeight);
+  glMatrixMode(GL_MODELVIEW);
+  glPushMatrix();
+  glLoadIdentity();
+  glColor3f(1.0, 1.0, 1.0);
+  for (metric = 0; metric <= METRIC_COUNT; metric++)
+    drawString(GLUT_BITMAP_8_BY_13, METRICS_LINE_HEIGHT, 
+               viewportHeight - (metric + 1) * METRICS_LINE_HEIGHT, lines[metric]);
+  glPopMatrix();
+  glMatrixMode(GL_PROJECTION);
+  glPopMatrix();
+  glMatrixMode(GL_MODELVIEW);
+}
+
+
+
+/******************************************************************************
+* Draw string ’str’ in font ’font’, at world (x,y,0)
+******************************************************************************/
+void drawString(void* font, float x, float y, char* str) 
+{
+  char* ch;
+  glRasterPos3f(x, y, 0.0);
+  for (ch = str; *ch; ch++)
+    glutBitmapCharacter(font, (int) *ch);
+}
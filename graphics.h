@@ -0,0 +1,125 @@
+/******************************************************************************
+* File:         graphics.h
+* Author:       Krzysztof Koch  
+* Date created: 04/10/2016
+* Last mod:     11/11/2016
+* Brief:        Rendering and user interaction parameters and prototypes
+******************************************************************************/
+#ifndef GRAPHICS_H
+#define GRAPHICS_H
+
+
+
+/******************************************************************************
+* Import relevant libraries
+******************************************************************************/
+#include "particleSystem.h"
+#include "renderBuffer.h"
+#include "pipeline.h"
+#include "headless.h"					// Wall clock
+#include "trace.h"
+#include "snapshot.h"
+#include "input.h"
+#include "capture.h"
+#include "SOIL.h"						// Library for loading textures from files
+
+#ifdef MACOSX							// Include GLUT
+    #include <GLUT/glut.h> 				// MACOSX
+#else
+    #define GL_GLEXT_PROTOTYPES			// OpenGL 1.5+ functions (buffer objects)
+    #include <GL/glut.h>				// Linux
+#endif
+
+
+
+/******************************************************************************
+* Rendering method used
+******************************************************************************/
+#define RENDERING_METHOD 2
+
+
+
+/******************************************************************************
+* Rendering parameters
+******************************************************************************/
+#define FIELD_OF_VIEW 60.0				// Vertical field of view in degrees
+#define NEAR_PLANE 1.0					// Distance of the clipping planes
+#define FAR_PLANE 10000.0
+#define SPRITE_SIZE 100					// Smoke sprite size in pixels (at the view centre)
+#define POINT_SIZE 3					// Point size (non-textured rendering)
+#define TEXT_X -60						// Starting position of text to draw
+#define TEXT_Y 510
+#define FONT_HEIGHT 12					// Font height (used for drawing multiple lines)
+#define METRICS_LINE_HEIGHT 14			// Line height of the metrics overlay (8x13 font)
+#define METRICS_REFRESH 0.5				// Seconds between updates of the overlay
+
+
+
+/******************************************************************************
+* Camera views
+******************************************************************************/
+
+// Camera view definition
+typedef struct {
+	double eyeX, eyeY, eyeZ;            // position of camera
+    double centerX, centerY, centerZ;   // point at which camera looks
+    double upX, upY, upZ;               // "up" direction of camera
+} CameraView;
+
+
+// Predefined views (see graphics.c)
+extern CameraView DEFAULT_VEW;			// General view, both systems and parameter values
+extern CameraView FOUNTAIN_VIEW;		// Only fountain shown
+extern CameraView SMOKE_VIEW;			// Only smoke shown
+extern CameraView FOUNTAIN_TOP_VIEW;	// View of the fountain from above
+extern CameraView SMOKE_TOP_VIEW;		// View of the smoke from above
+
+// Current view
+extern CameraView *currentView;
+
+
+
+/******************************************************************************
+* Global variables for calculation of Frame Rate
+******************************************************************************/
+extern int frameCount, currentTime, previousTime;
+extern double fps;
+
+
+
+/******************************************************************************
+* String buffer for displaying performance data
+******************************************************************************/
+extern char stringBuffer[50];
+
+
+
+/******************************************************************************
+* Vertex buffer objects used for particle rendering (if supported)
+******************************************************************************/
+extern int useVertexBuffers;
+extern GLuint waterBuffer, smokeBuffer, indexBuffer;
+extern GLuint smokeAtlas;				// Texture holding all smoke images
+extern GLuint smokeVolumeTexture;		// 3D texture of the smoke density volume
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void drawParticles(void); 				// Render particles
+void display(void); 					// OpenGL callback function
+void setView (void);					// Implement various camera views
+void keyboard(unsigned char, int, int); // Keyboard callback function
+void cursor_keys(int, int, int);  		// Special keys callback function
+void reshape(int, int); 				// Window reshape callback function
+void initGraphics(int, char *argv[]); 	// OpenGL initialisation function
+int runCapture(int);					// Draw frames offscreen into images
+void calculateFPS(void); 				// Calculate the number of frames per second
+void drawString (void*, float, float, char*); // Draw string on screen
+void displayData(void); 				// Display simulation parameters
+void displayMetrics(void);				// Display frame metrics
+void createMenu(void);                  // Create menu interface
+void menu(int);                         // Create menu entries
+
+#endif
@@ -0,0 +1,88 @@
+/******************************************************************************
+* File:         headless.c
+* Brief:        Simulation without graphics, measures simulation throughput
+*
+* Note:
+* Runs the simulation of the interactive program (advanceSimulation(), as
+* pipeline.c does) for a fixed number of frames without rendering, so
+* simulation cost can be measured separately from rendering cost. Every
+* frame stands for one tick (SIMULATION_TICK) of wall clock time,
+* independent of how long it actually takes. Frames are recorded in the
+* metrics (metrics.c) like those drawn, and with --target-frame the particle
+* totals follow their times (budget.c).
+******************************************************************************/
+#include "particleSystem.h"
+#include "kernels.h"
+#include "threadPool.h"
+#include "headless.h"
+#include "metrics.h"
+#include "trace.h"
+#include "input.h"
+#include "snapshot.h"
+#include "budget.h"
+
+
+
+/******************************************************************************
+* Return monotonic wall clock time in seconds
+******************************************************************************/
+double wallClock(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+
+
+/******************************************************************************
+* Run "steps" frames and report frames per second, particles per second,
+* time per particle update, the spread of frame times and a checksum of the
+* final state. Returns program exit status.
+******************************************************************************/
+int runHeadless(int steps)
+{
+  int step;
+  double start, frameStart, spawnTime = 0.0, updateTime = 0.0;
+  double totalTime, particleUpdates = 0.0, frameTime = SIMULATION_TICK, lastFrame = 0.0;
+  MetricSummary frames;
+
+  start = wallClock();
+  for (step = 0; step < steps; step++)
+  {
+    TRACE_BEGIN("frame");
+    controlBudget(lastFrame);
+    recordElapsed(frameTime);
+    frameStart = wallClock();
+    advanceSimulation(frameTime);
+    spawnTime += simulationMetrics.value[METRIC_SPAWN];
+    updateTime += simulationMetrics.value[METRIC_PROGRESS];
+    particleUpdates += simulationMetrics.value[METRIC_UPDATED];
+    simulationMetrics.value[METRIC_FRAME] = lastFrame = wallClock() - frameStart;
+    recordFrame(&simulationMetrics);
+    memset(&simulationMetrics, 0, sizeof(simulationMetrics));
+    TRACE_END();
+  }
+  totalTime = wallClock() - start;
+
+  printf("Headless run: %d frames, %d water and %d smoke particles\n", 
+         steps, fountain.totalParticles, smokeEmitter.totalParticles);
+  printf("  Steps taken:            %llu water, %llu smoke (%.1f s simulated)\n", 
+         fountain.clock.steps, smokeEmitter.clock.steps, 
+         steps * SIMULATION_TICK * options.timeScale);
+  printf("  Total time:             %.3f s (spawn %.3f s, update %.3f s)\n", 
+         totalTime, spawnTime, updateTime);
+  if (steps > 0 && totalTime > 0.0 && particleUpdates > 0.0) {
+    printf("  Frames/s:               %.1f\n", steps / totalTime);
+    printf("  Particles/s:            %.4g\n", particleUpdates / totalTime);
+    printf("  ns per particle-update: %.2f\n", updateTime * 1e9 / particleUpdates);
+    summariseMetric(METRIC_FRAME, &frames);
+    printf("  Frame time [ms]:        min %.3f, median %.3f, p99 %.3f, max %.3f "
+           "(last %d frames)\n", frames.min, frames.median, frames.p99, frames.max,
+           steps < METRICS_WINDOW ? steps : METRICS_WINDOW);
+  }
+  printf("  State checksum:         %016llx\n", (unsigned long long)stateChecksum());
+  dumpMetrics();
+  return 0;
+}
@@ -0,0 +1,16 @@
+/******************************************************************************
+* File:         headless.h
+* Brief:        Simulation without graphics, measures simulation throughput
+******************************************************************************/
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+int runHeadless(int);                   // Run given number of steps, report speed
+double wallClock(void);                 // Monotonic wall clock time in seconds
+
+#endif
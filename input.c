@@ -0,0 +1,329 @@
+/******************************************************************************
+* File:         input.c
+* Brief:        Simulation controls, input recording and deterministic replay
+*
+* Note:
+* The simulation only depends on its options, its seed and the wall clock
+* time simulated for every frame, apart from the controls the user applies
+* between frames. With --record FILE these are written to FILE as text: a
+* header with the options the state was initialised from (and the snapshot
+* it was restored from, if any), then one line per frame ("f" and the
+* elapsed seconds) and per control, in the order they happened. Totals set
+* by the particle budget (budget.c) are recorded as controls.
+*
+* --replay FILE initialises the simulation from the header and applies the
+* frames and controls again without graphics, so the replayed run goes
+* through exactly the same states (independent of the thread count) while
+* its frames are timed. Snapshots restored during the recording must still
+* hold what they held then.
+******************************************************************************/
+#include "particleSystem.h"
+#include "rng.h"
+#include "headless.h"
+#include "metrics.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "input.h"
+#include "prewarm.h"
+
+
+
+/******************************************************************************
+* Recording in progress (NULL if none)
+******************************************************************************/
+static FILE *recording;
+
+
+
+/******************************************************************************
+* Start recording to options.recordFile, after the simulation was set up
+******************************************************************************/
+static void stopRecording(void)
+{
+  if (recording)
+    fclose(recording);
+  recording = NULL;
+}
+
+void startRecording(void)
+{
+  if (!options.recordFile)
+    return;
+  recording = fopen(options.recordFile, "w");
+  if (!recording) {
+    fprintf(stderr, "Could not open %s\n", options.recordFile);
+    return;
+  }
+  fprintf(recording, "particleSystem input log %d\n", INPUT_LOG_VERSION);
+  fprintf(recording, "seed %llu\n", (unsigned long long)options.seed);
+  fprintf(recording, "water %d\nsmoke %d\n", options.waterParticles, options.smokeParticles);
+  fprintf(recording, "water-emitters %d\nsmoke-emitters %d\n", options.waterEmitters,
+          options.smokeEmitters);
+  fprintf(recording, "max-particles %d\n", options.maxParticles);
+  fprintf(recording, "water-dt %.17g\nsmoke-dt %.17g\n", options.waterTimeStep,
+          options.smokeTimeStep);
+  fprintf(recording, "time-scale %.17g\n", options.timeScale);
+  fprintf(recording, "analytic-water %d\n", options.analyticWater);
+  fprintf(recording, "water-collisions %d\nsmoke-density %d\n", options.waterCollisions,
+          options.smokeDensity);
+  fprintf(recording, "prewarm %d\nprewarm-time %.17g\n", options.prewarm, options.prewarmTime);
+  fprintf(recording, "water-rate %.17g\nsmoke-rate %.17g\n", options.waterRate,
+          options.smokeRate);
+  fprintf(recording, "spawn-budget %d\n", options.spawnBudget);
+  fprintf(recording, "snapshot %s\n", options.snapshotFile);
+  if (options.restoreFile)
+    fprintf(recording, "restore %s\n", options.restoreFile);
+  fprintf(recording, "begin\n");
+  fflush(recording);
+  atexit(stopRecording);
+}
+
+
+
+/******************************************************************************
+* Record the wall clock time simulated for a frame
+******************************************************************************/
+void recordElapsed(double elapsed)
+{
+  if (recording)
+    fprintf(recording, "f %.17g\n", elapsed);
+}
+
+
+
+/******************************************************************************
+* Apply a control to the simulation and record it. Must be called while the
+* simulation is idle (see waitFrame()).
+******************************************************************************/
+void applyControl(int control, int code)
+{
+  if (recording) {
+    if (control == CONTROL_KEY || control == CONTROL_SPECIAL_KEY)
+      fprintf(recording, "%c %d\n", control == CONTROL_KEY ? 'k' : 's', code);
+    else if (control == CONTROL_WATER_TOTAL || control == CONTROL_SMOKE_TOTAL)
+      fprintf(recording, "%s-total %d\n", control == CONTROL_WATER_TOTAL ? "water" : "smoke",
+              code);
+    else
+      fprintf(recording, control == CONTROL_RESET ? "reset\n" : "restore\n");
+    fflush(recording);
+  }
+
+  if (control == CONTROL_RESET) {
+    initParticleSystem();
+    prewarmParticles();
+  }
+  else if (control == CONTROL_RESTORE)
+    loadSnapshot(options.snapshotFile);
+  else if (control == CONTROL_WATER_TOTAL)
+    fountain.totalParticles = limitParticles(code);
+  else if (control == CONTROL_SMOKE_TOTAL)
+    smokeEmitter.totalParticles = limitParticles(code);
+  else if (control == CONTROL_SPECIAL_KEY) {
+    switch (code)
+    {
+      // Increase and decrease gravitational force
+      case INPUT_KEY_UP: gravity *= DECREASE_VAL; break;
+      case INPUT_KEY_DOWN: gravity *= INCREASE_VAL; break;
+
+      // Change the wind direction by WIND_DIRECTION_CHANGE degrees
+      case INPUT_KEY_LEFT:
+        angle += SMOKE_WIND_DIRECTION_CHANGE % 360;
+        computeWind();
+        break;
+      case INPUT_KEY_RIGHT:
+        angle -= SMOKE_WIND_DIRECTION_CHANGE % 360;
+        computeWind();
+        break;
+    }
+  }
+  else switch (code)
+  {
+    // Decrease and increase the speed of smoke particle movement
+    case 'c': smokeEmitter.chaoticSpeed *= DECREASE_VAL; break;
+    case 'C': smokeEmitter.chaoticSpeed *= INCREASE_VAL; break;
+
+    // Decrease and Increase water particle number (up to --max-particles)
+    case 'f': if (fountain.totalParticles / 2 >= 1)
+                fountain.totalParticles /= 2;
+              break;
+    case 'F': fountain.totalParticles = limitParticles(fountain.totalParticles * 2);
+              break;
+
+    // Decrease and Increase smoke particle number (up to --max-particles)
+    case 's': if (smokeEmitter.totalParticles / 2 >= 1)
+                smokeEmitter.totalParticles /= 2;
+              break;
+    case 'S': smokeEmitter.totalParticles = limitParticles(smokeEmitter.totalParticles * 2);
+              break;
+
+    // Decrease and increase the starting red colour component of smoke particle
+    case 'r': if (smokeEmitter.r0 - SMOKE_COLOUR_CHANGE >= 0.0)
+                smokeEmitter.r0 -= SMOKE_COLOUR_CHANGE;
+              break;
+    case 'R': if (smokeEmitter.r0 + SMOKE_COLOUR_CHANGE <= 1.0)
+                smokeEmitter.r0 += SMOKE_COLOUR_CHANGE;
+              break;
+
+    // Decrease and increase the starting green colour component of smoke particle
+    case 'g': if (smokeEmitter.g0 - SMOKE_COLOUR_CHANGE >= 0.0)
+                smokeEmitter.g0 -= SMOKE_COLOUR_CHANGE;
+              break;
+    case 'G': if (smokeEmitter.g0 + SMOKE_COLOUR_CHANGE <= 1.0)
+                smokeEmitter.g0 += SMOKE_COLOUR_CHANGE;
+              break;
+
+    // Decrease and increase the starting blue colour component of smoke particle
+    case 'b': if (smokeEmitter.b0 - SMOKE_COLOUR_CHANGE >= 0.0)
+                smokeEmitter.b0 -= SMOKE_COLOUR_CHANGE;
+              break;
+    case 'B': if (smokeEmitter.b0 + SMOKE_COLOUR_CHANGE <= 1.0)
+                smokeEmitter.b0 += SMOKE_COLOUR_CHANGE;
+              break;
+
+    // Decrease and increase the wind speed
+    case 'w': windSpeed *= DECREASE_VAL;
+              computeWind();
+              break;
+    case 'W': windSpeed *= INCREASE_VAL;
+              computeWind();
+              break;
+  }
+}
+
+
+
+/******************************************************************************
+* Take an option from the header of a recording, returns 0 at its end
+******************************************************************************/
+static int replayOption(const char *line)
+{
+  char name[32], value[1024];
+
+  if (!strncmp(line, "begin", 5))
+    return 0;
+  if (sscanf(line, "%31s %1023[^\n]", name, value) != 2)
+    return 1;
+  if (!strcmp(name, "seed"))
+    options.seed = strtoull(value, NULL, 10);
+  else if (!strcmp(name, "water"))
+    options.waterParticles = atoi(value);
+  else if (!strcmp(name, "smoke"))
+    options.smokeParticles = atoi(value);
+  else if (!strcmp(name, "water-emitters"))
+    options.waterEmitters = atoi(value);
+  else if (!strcmp(name, "smoke-emitters"))
+    options.smokeEmitters = atoi(value);
+  else if (!strcmp(name, "max-particles"))
+    options.maxParticles = atoi(value);
+  else if (!strcmp(name, "water-dt"))
+    options.waterTimeStep = strtod(value, NULL);
+  else if (!strcmp(name, "smoke-dt"))
+    options.smokeTimeStep = strtod(value, NULL);
+  else if (!strcmp(name, "time-scale"))
+    options.timeScale = strtod(value, NULL);
+  else if (!strcmp(name, "analytic-water"))
+    options.analyticWater = atoi(value);
+  else if (!strcmp(name, "water-collisions"))
+    options.waterCollisions = atoi(value);
+  else if (!strcmp(name, "smoke-density"))
+    options.smokeDensity = atoi(value);
+  else if (!strcmp(name, "prewarm"))
+    options.prewarm = atoi(value);
+  else if (!strcmp(name, "prewarm-time"))
+    options.prewarmTime = strtod(value, NULL);
+  else if (!strcmp(name, "water-rate"))
+    options.waterRate = strtod(value, NULL);
+  else if (!strcmp(name, "smoke-rate"))
+    options.smokeRate = strtod(value, NULL);
+  else if (!strcmp(name, "spawn-budget"))
+    options.spawnBudget = atoi(value);
+  else if (!strcmp(name, "snapshot"))
+    options.snapshotFile = strdup(value);
+  else if (!strcmp(name, "restore"))
+    options.restoreFile = strdup(value);
+  return 1;
+}
+
+
+
+/******************************************************************************
+* Replay recording "path" without graphics, timing every frame, and report
+* the final state checksum (equal for equal runs). Returns program exit
+* status.
+******************************************************************************/
+int runReplay(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  char line[1100];
+  int version, code, frames = 0, controls = 0;
+  double elapsed, start, frameStart, simulated = 0.0;
+  MetricSummary summary;
+
+  if (!file || !fgets(line, sizeof(line), file) ||
+      sscanf(line, "particleSystem input log %d", &version) != 1 ||
+      version != INPUT_LOG_VERSION) {
+    fprintf(stderr, "Could not replay %s: not an input log of version %d\n", path,
+            INPUT_LOG_VERSION);
+    if (file)
+      fclose(file);
+    return 1;
+  }
+  options.restoreFile = NULL;
+  while (fgets(line, sizeof(line), file) && replayOption(line))
+    ;
+  seedRandom(options.seed);
+  initParticleSystem();
+  if (!options.restoreFile)
+    prewarmParticles();
+  else if (!loadSnapshot(options.restoreFile)) {
+    fclose(file);
+    return 1;
+  }
+
+  start = wallClock();
+  while (fgets(line, sizeof(line), file))
+  {
+    if (sscanf(line, "f %lf", &elapsed) == 1) {
+      TRACE_BEGIN("frame");
+      frameStart = wallClock();
+      advanceSimulation(elapsed);
+      simulationMetrics.value[METRIC_FRAME] = wallClock() - frameStart;
+      recordFrame(&simulationMetrics);
+      memset(&simulationMetrics, 0, sizeof(simulationMetrics));
+      simulated += elapsed * options.timeScale;
+      frames++;
+      TRACE_END();
+      continue;
+    }
+    if (sscanf(line, "k %d", &code) == 1)
+      applyControl(CONTROL_KEY, code);
+    else if (sscanf(line, "s %d", &code) == 1)
+      applyControl(CONTROL_SPECIAL_KEY, code);
+    else if (!strncmp(line, "reset", 5))
+      applyControl(CONTROL_RESET, 0);
+    else if (!strncmp(line, "restore", 7))
+      applyControl(CONTROL_RESTORE, 0);
+    else if (sscanf(line, "water-total %d", &code) == 1)
+      applyControl(CONTROL_WATER_TOTAL, code);
+    else if (sscanf(line, "smoke-total %d", &code) == 1)
+      applyControl(CONTROL_SMOKE_TOTAL, code);
+    else
+      continue;
+    controls++;
+  }
+  fclose(file);
+
+  printf("Replay of %s: %d frames, %d controls, %.1f s simulated in %.3f s\n", path, frames,
+         controls, simulated, wallClock() - start);
+  printf("  Particles:              %d water, %d smoke alive\n", fountain.aliveParticles,
+         smokeEmitter.aliveParticles);
+  if (frames > 0) {
+    summariseMetric(METRIC_FRAME, &summary);
+    printf("  Frame time [ms]:        min %.3f, median %.3f, p99 %.3f, max %.3f "
+           "(last %d frames)\n", summary.min, summary.median, summary.p99, summary.max,
+           frames < METRICS_WINDOW ? frames : METRICS_WINDOW);
+  }
+  printf("  State checksum:         %016llx\n", (unsigned long long)stateChecksum());
+  dumpMetrics();
+  return 0;
+}
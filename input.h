@@ -0,0 +1,41 @@
+/******************************************************************************
+* File:         input.h
+* Brief:        Simulation controls, input recording and deterministic replay
+******************************************************************************/
+#ifndef INPUT_H
+#define INPUT_H
+
+
+
+/******************************************************************************
+* Controls changing the simulation (all other input only changes the view)
+******************************************************************************/
+enum {
+	CONTROL_KEY,						// Key pressed (see applyControl())
+	CONTROL_SPECIAL_KEY,				// Arrow key pressed, INPUT_KEY_*
+	CONTROL_RESET,						// Reset the simulation (menu)
+	CONTROL_RESTORE,					// Restore options.snapshotFile
+	CONTROL_WATER_TOTAL,				// Set the total of a system (budget.c)
+	CONTROL_SMOKE_TOTAL
+};
+
+// Arrow keys, same codes as GLUT_KEY_*
+#define INPUT_KEY_LEFT 100
+#define INPUT_KEY_UP 101
+#define INPUT_KEY_RIGHT 102
+#define INPUT_KEY_DOWN 103
+
+#define INPUT_LOG_VERSION 4				// Incremented whenever the format changes
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void startRecording(void);				// Record to options.recordFile (if set)
+void recordElapsed(double);				// Record the time simulated for a frame
+void applyControl(int, int);			// Apply and record a control
+int runReplay(const char*);				// Replay a recording headless, returns
+										// program exit status
+
+#endif
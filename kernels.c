@@ -0,0 +1,568 @@
+/******************************************************************************
+* File:         kernels.c
+* Brief:        Vectorised particle integration kernels
+*
+* Note:
+* Every kernel integrates a block of particles unconditionally and writes a
+* death mask instead of branching on the death tests, the caller removes dead
+* particles afterwards. SIMD kernels are only built for single precision on
+* x86, they are compiled with per-function target attributes so the rest of
+* the program does not require any particular instruction set. The best
+* kernels supported by the CPU are picked at runtime by initKernels().
+* Operations are done in the same order in every variant (no fused
+* multiply-add), so all kernels produce identical results.
+*
+* Dead particles are removed by stream compaction kernels which copy the live
+* elements of an array in order (AVX2 lane permutation, AVX-512 compress
+* store, branch-free scalar loop otherwise). Range kernels find the minimum
+* and maximum of an array, used for the bounding boxes of particle chunks.
+******************************************************************************/
+#include <string.h>
+#include <stdint.h>
+#include "kernels.h"
+
+#if !defined(DOUBLE_PRECISION) && (defined(__x86_64__) || defined(__i386__))
+    #define SIMD_KERNELS
+    #include <immintrin.h>
+#endif
+
+// AVX-512 implies FMA, keep the compiler from contracting multiplications and
+// additions of the intrinsics into fused operations
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC optimize ("fp-contract=off")
+#elif defined(__clang__)
+    #pragma clang fp contract(off)
+#endif
+
+
+
+/******************************************************************************
+* Scalar kernels, used as a fallback and for the remainder of a block which
+* does not fill a whole SIMD register. Integration starts at particle "start".
+******************************************************************************/
+static void waterScalar(const WaterBlock *block, const WaterStepParams *params, int start)
+{
+  int index;
+
+  for (index = start; index < block->count; index++)
+  {
+    block->xpos[index] += block->xvel[index] * params->timeScale;
+    block->ypos[index] += block->yvel[index] * params->timeScale;
+    block->zpos[index] += block->zvel[index] * params->timeScale;
+    block->yvel[index] += params->yAcceleration;
+    block->dead[index] = block->ypos[index] < params->minY ||
+                         block->ypos[index] > params->maxY;
+  }
+}
+
+static void smokeScalar(const SmokeBlock *block, const SmokeStepParams *params, int start)
+{
+  int index;
+  real ypos, threshold = params->deathThreshold;
+
+  for (index = start; index < block->count; index++)
+  {
+    // Move the particle. If smoke hits the ground, make it crawl on it
+    block->xpos[index] += block->xvel[index] * params->timeScale;
+    block->zpos[index] += block->zvel[index] * params->timeScale;
+    ypos = block->ypos[index] + block->yvel[index] * params->timeScale;
+    ypos = ypos < params->groundY ? params->groundY : ypos;
+    block->ypos[index] = ypos;
+
+    // Chaotic movement, wind and gravity
+    block->xvel[index] += block->xnoise[index] + ypos * params->xWind;
+    block->zvel[index] += block->znoise[index] + ypos * params->zWind;
+    block->yvel[index] += params->yAcceleration + block->ynoise[index];
+
+    // Fade away
+    block->r[index] -= block->shadeChange[index];
+    block->g[index] -= block->shadeChange[index];
+    block->b[index] -= block->shadeChange[index];
+    block->alpha[index] -= params->alphaChange;
+    block->dead[index] = (block->r[index] <= threshold &&
+                          block->g[index] <= threshold &&
+                          block->b[index] <= threshold) ||
+                          block->alpha[index] <= threshold;
+  }
+}
+
+static void updateWaterScalar(const WaterBlock *block, const WaterStepParams *params)
+{
+  waterScalar(block, params, 0);
+}
+
+static void updateSmokeScalar(const SmokeBlock *block, const SmokeStepParams *params)
+{
+  smokeScalar(block, params, 0);
+}
+
+
+
+/******************************************************************************
+* Scalar stream compaction, starting at particle "index" with "written" 
+* particles already stored. Every particle is stored without a branch, the 
+* destination only advances for live ones. The loop stops once all "alive" 
+* particles are stored, so nothing is written past destination[alive - 1].
+******************************************************************************/
+static void compactTail(real *destination, const real *source, const unsigned char *dead,
+                        int index, int count, int written, int alive)
+{
+  for (; index < count && written < alive; index++)
+  {
+    destination[written] = source[index];
+    written += !dead[index];
+  }
+}
+
+static void compactScalar(real *destination, const real *source, const unsigned char *dead,
+                          int count, int alive)
+{
+  compactTail(destination, source, dead, 0, count, 0, alive);
+}
+
+
+
+/******************************************************************************
+* Scalar range of an array, starting at element "index"
+******************************************************************************/
+static void rangeTail(const real *values, int index, int count, real *min, real *max)
+{
+  for (; index < count; index++)
+  {
+    *min = values[index] < *min ? values[index] : *min;
+    *max = values[index] > *max ? values[index] : *max;
+  }
+}
+
+static void rangeScalar(const real *values, int count, real *min, real *max)
+{
+  rangeTail(values, 0, count, min, max);
+}
+
+
+
+#ifdef SIMD_KERNELS
+
+/******************************************************************************
+* Expand 4 bits of a comparison mask into 4 bytes of the death mask
+******************************************************************************/
+static const uint32_t maskBytes[16] = {
+  0x00000000, 0x00000001, 0x00000100, 0x00000101,
+  0x00010000, 0x00010001, 0x00010100, 0x00010101,
+  0x01000000, 0x01000001, 0x01000100, 0x01000101,
+  0x01010000, 0x01010001, 0x01010100, 0x01010101
+};
+
+static inline void storeMask(unsigned char *dead, unsigned int bits, int lanes)
+{
+  int lane;
+
+  for (lane = 0; lane < lanes; lane += 4, bits >>= 4)
+    memcpy(dead + lane, &maskBytes[bits & 0xF], 4);
+}
+
+
+
+/******************************************************************************
+* SSE2 kernels, 4 particles per iteration
+******************************************************************************/
+__attribute__((target("sse2")))
+static void updateWaterSSE2(const WaterBlock *block, const WaterStepParams *params)
+{
+  int index, vectorCount = block->count & ~3;
+  __m128 acceleration = _mm_set1_ps(params->yAcceleration);
+  __m128 timeScale = _mm_set1_ps(params->timeScale);
+  __m128 minY = _mm_set1_ps(params->minY), maxY = _mm_set1_ps(params->maxY);
+  __m128 ypos, dead;
+
+  for (index = 0; index < vectorCount; index += 4)
+  {
+    _mm_storeu_ps(block->xpos + index, _mm_add_ps(_mm_loadu_ps(block->xpos + index),
+        _mm_mul_ps(_mm_loadu_ps(block->xvel + index), timeScale)));
+    _mm_storeu_ps(block->zpos + index, _mm_add_ps(_mm_loadu_ps(block->zpos + index),
+        _mm_mul_ps(_mm_loadu_ps(block->zvel + index), timeScale)));
+    ypos = _mm_add_ps(_mm_loadu_ps(block->ypos + index),
+                      _mm_mul_ps(_mm_loadu_ps(block->yvel + index), timeScale));
+    _mm_storeu_ps(block->ypos + index, ypos);
+    _mm_storeu_ps(block->yvel + index, _mm_add_ps(_mm_loadu_ps(block->yvel + index), acceleration));
+    dead = _mm_or_ps(_mm_cmplt_ps(ypos, minY), _mm_cmpgt_ps(ypos, maxY));
+    storeMask(block->dead + index, _mm_movemask_ps(dead), 4);
+  }
+  waterScalar(block, params, vectorCount);
+}
+
+__attribute__((target("sse2")))
+static void rangeSSE2(const real *values, int count, real *min, real *max)
+{
+  int index, vectorCount = count & ~3;
+  __m128 lower = _mm_set1_ps(*min), upper = _mm_set1_ps(*max);
+  float lanes[8];
+
+  for (index = 0; index < vectorCount; index += 4)
+  {
+    lower = _mm_min_ps(lower, _mm_loadu_ps(values + index));
+    upper = _mm_max_ps(upper, _mm_loadu_ps(values + index));
+  }
+  _mm_storeu_ps(lanes, lower);
+  _mm_storeu_ps(lanes + 4, upper);
+  rangeTail(lanes, 0, 4, min, max);
+  rangeTail(lanes + 4, 0, 4, min, max);
+  rangeTail(values, vectorCount, count, min, max);
+}
+
+__attribute__((target("sse2")))
+static void updateSmokeSSE2(const SmokeBlock *block, const SmokeStepParams *params)
+{
+  int index, vectorCount = block->count & ~3;
+  __m128 acceleration = _mm_set1_ps(params->yAcceleration);
+  __m128 timeScale = _mm_set1_ps(params->timeScale);
+  __m128 groundY = _mm_set1_ps(params->groundY);
+  __m128 xWind = _mm_set1_ps(params->xWind), zWind = _mm_set1_ps(params->zWind);
+  __m128 alphaChange = _mm_set1_ps(params->alphaChange);
+  __m128 threshold = _mm_set1_ps(params->deathThreshold);
+  __m128 ypos, shade, r, g, b, alpha, faded;
+
+  for (index = 0; index < vectorCount; index += 4)
+  {
+    // Move the particle, crawl on the ground
+    _mm_storeu_ps(block->xpos + index, _mm_add_ps(_mm_loadu_ps(block->xpos + index),
+        _mm_mul_ps(_mm_loadu_ps(block->xvel + index), timeScale)));
+    _mm_storeu_ps(block->zpos + index, _mm_add_ps(_mm_loadu_ps(block->zpos + index),
+        _mm_mul_ps(_mm_loadu_ps(block->zvel + index), timeScale)));
+    ypos = _mm_add_ps(_mm_loadu_ps(block->ypos + index),
+                      _mm_mul_ps(_mm_loadu_ps(block->yvel + index), timeScale));
+    ypos = _mm_max_ps(ypos, groundY);
+    _mm_storeu_ps(block->ypos + index, ypos);
+
+    // Chaotic movement, wind and gravity
+    _mm_storeu_ps(block->xvel + index, _mm_add_ps(_mm_loadu_ps(block->xvel + index),
+        _mm_add_ps(_mm_loadu_ps(block->xnoise + index), _mm_mul_ps(ypos, xWind))));
+    _mm_storeu_ps(block->zvel + index, _mm_add_ps(_mm_loadu_ps(block->zvel + index),
+        _mm_add_ps(_mm_loadu_ps(block->znoise + index), _mm_mul_ps(ypos, zWind))));
+    _mm_storeu_ps(block->yvel + index, _mm_add_ps(_mm_loadu_ps(block->yvel + index),
+        _mm_add_ps(acceleration, _mm_loadu_ps(block->ynoise + index))));
+
+    // Fade away
+    shade = _mm_loadu_ps(block->shadeChange + index);
+    r = _mm_sub_ps(_mm_loadu_ps(block->r + index), shade);
+    g = _mm_sub_ps(_mm_loadu_ps(block->g + index), shade);
+    b = _mm_sub_ps(_mm_loadu_ps(block->b + index), shade);
+    alpha = _mm_sub_ps(_mm_loadu_ps(block->alpha + index), alphaChange);
+    _mm_storeu_ps(block->r + index, r);
+    _mm_storeu_ps(block->g + index, g);
+    _mm_storeu_ps(block->b + index, b);
+    _mm_storeu_ps(block->alpha + index, alpha);
+    faded = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(r, threshold), _mm_cmple_ps(g, threshold)),
+                       _mm_cmple_ps(b, threshold));
+    faded = _mm_or_ps(faded, _mm_cmple_ps(alpha, threshold));
+    storeMask(block->dead + index, _mm_movemask_ps(faded), 4);
+  }
+  smokeScalar(block, params, vectorCount);
+}
+
+
+
+/******************************************************************************
+* AVX2 kernels, 8 particles per iteration
+******************************************************************************/
+__attribute__((target("avx2")))
+static void updateWaterAVX2(const WaterBlock *block, const WaterStepParams *params)
+{
+  int index, vectorCount = block->count & ~7;
+  __m256 acceleration = _mm256_set1_ps(params->yAcceleration);
+  __m256 timeScale = _mm256_set1_ps(params->timeScale);
+  __m256 minY = _mm256_set1_ps(params->minY), maxY = _mm256_set1_ps(params->maxY);
+  __m256 ypos, dead;
+
+  for (index = 0; index < vectorCount; index += 8)
+  {
+    _mm256_storeu_ps(block->xpos + index, _mm256_add_ps(_mm256_loadu_ps(block->xpos + index),
+        _mm256_mul_ps(_mm256_loadu_ps(block->xvel + index), timeScale)));
+    _mm256_storeu_ps(block->zpos + index, _mm256_add_ps(_mm256_loadu_ps(block->zpos + index),
+        _mm256_mul_ps(_mm256_loadu_ps(block->zvel + index), timeScale)));
+    ypos = _mm256_add_ps(_mm256_loadu_ps(block->ypos + index),
+                         _mm256_mul_ps(_mm256_loadu_ps(block->yvel + index), timeScale));
+    _mm256_storeu_ps(block->ypos + index, ypos);
+    _mm256_storeu_ps(block->yvel + index, _mm256_add_ps(_mm256_loadu_ps(block->yvel + index),
+                                                        acceleration));
+    dead = _mm256_or_ps(_mm256_cmp_ps(ypos, minY, _CMP_LT_OQ),
+                        _mm256_cmp_ps(ypos, maxY, _CMP_GT_OQ));
+    storeMask(block->dead + index, _mm256_movemask_ps(dead), 8);
+  }
+  waterScalar(block, params, vectorCount);
+}
+
+__attribute__((target("avx2")))
+static void updateSmokeAVX2(const SmokeBlock *block, const SmokeStepParams *params)
+{
+  int index, vectorCount = block->count & ~7;
+  __m256 acceleration = _mm256_set1_ps(params->yAcceleration);
+  __m256 timeScale = _mm256_set1_ps(params->timeScale);
+  __m256 groundY = _mm256_set1_ps(params->groundY);
+  __m256 xWind = _mm256_set1_ps(params->xWind), zWind = _mm256_set1_ps(params->zWind);
+  __m256 alphaChange = _mm256_set1_ps(params->alphaChange);
+  __m256 threshold = _mm256_set1_ps(params->deathThreshold);
+  __m256 ypos, shade, r, g, b, alpha, faded;
+
+  for (index = 0; index < vectorCount; index += 8)
+  {
+    // Move the particle, crawl on the ground
+    _mm256_storeu_ps(block->xpos + index, _mm256_add_ps(_mm256_loadu_ps(block->xpos + index),
+        _mm256_mul_ps(_mm256_loadu_ps(block->xvel + index), timeScale)));
+    _mm256_storeu_ps(block->zpos + index, _mm256_add_ps(_mm256_loadu_ps(block->zpos + index),
+        _mm256_mul_ps(_mm256_loadu_ps(block->zvel + index), timeScale)));
+    ypos = _mm256_add_ps(_mm256_loadu_ps(block->ypos + index),
+                         _mm256_mul_ps(_mm256_loadu_ps(block->yvel + index), timeScale));
+    ypos = _mm256_max_ps(ypos, groundY);
+    _mm256_storeu_ps(block->ypos + index, ypos);
+
+    // Chaotic movement, wind and gravity
+    _mm256_storeu_ps(block->xvel + index, _mm256_add_ps(_mm256_loadu_ps(block->xvel + index),
+        _mm256_add_ps(_mm256_loadu_ps(block->xnoise + index), _mm256_mul_ps(ypos, xWind))));
+    _mm256_storeu_ps(block->zvel + index, _mm256_add_ps(_mm256_loadu_ps(block->zvel + index),
+        _mm256_add_ps(_mm256_loadu_ps(block->znoise + index), _mm256_mul_ps(ypos, zWind))));
+    _mm256_storeu_ps(block->yvel + index, _mm256_add_ps(_mm256_loadu_ps(block->yvel + index),
+        _mm256_add_ps(acceleration, _mm256_loadu_ps(block->ynoise + index))));
+
+    // Fade away
+    shade = _mm256_loadu_ps(block->shadeChange + index);
+    r = _mm256_sub_ps(_mm256_loadu_ps(block->r + index), shade);
+    g = _mm256_sub_ps(_mm256_loadu_ps(block->g + index), shade);
+    b = _mm256_sub_ps(_mm256_loadu_ps(block->b + index), shade);
+    alpha = _mm256_sub_ps(_mm256_loadu_ps(block->alpha + index), alphaChange);
+    _mm256_storeu_ps(block->r + index, r);
+    _mm256_storeu_ps(block->g + index, g);
+    _mm256_storeu_ps(block->b + index, b);
+    _mm256_storeu_ps(block->alpha + index, alpha);
+    faded = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(r, threshold, _CMP_LE_OQ),
+                                        _mm256_cmp_ps(g, threshold, _CMP_LE_OQ)),
+                          _mm256_cmp_ps(b, threshold, _CMP_LE_OQ));
+    faded = _mm256_or_ps(faded, _mm256_cmp_ps(alpha, threshold, _CMP_LE_OQ));
+    storeMask(block->dead + index, _mm256_movemask_ps(faded), 8);
+  }
+  smokeScalar(block, params, vectorCount);
+}
+
+__attribute__((target("avx2")))
+static void rangeAVX2(const real *values, int count, real *min, real *max)
+{
+  int index, vectorCount = count & ~7;
+  __m256 lower = _mm256_set1_ps(*min), upper = _mm256_set1_ps(*max);
+  float lanes[16];
+
+  for (index = 0; index < vectorCount; index += 8)
+  {
+    lower = _mm256_min_ps(lower, _mm256_loadu_ps(values + index));
+    upper = _mm256_max_ps(upper, _mm256_loadu_ps(values + index));
+  }
+  _mm256_storeu_ps(lanes, lower);
+  _mm256_storeu_ps(lanes + 8, upper);
+  rangeTail(lanes, 0, 8, min, max);
+  rangeTail(lanes + 8, 0, 8, min, max);
+  rangeTail(values, vectorCount, count, min, max);
+}
+
+// Lane permutation moving the live lanes of each 8-bit live mask to the front
+static int32_t compactLanes[256][8] __attribute__((aligned(32)));
+
+static void initCompactLanes(void)
+{
+  int bits, lane, live;
+
+  for (bits = 0; bits < 256; bits++)
+    for (lane = 0, live = 0; lane < 8; lane++)
+      if (bits & (1 << lane))
+        compactLanes[bits][live++] = lane;
+}
+
+__attribute__((target("avx2")))
+static void compactAVX2(real *destination, const real *source, const unsigned char *dead,
+                        int count, int alive)
+{
+  int index, written = 0, live;
+  __m128i flags;
+
+  // All 8 lanes are stored, so stop while they could reach past the end
+  for (index = 0; index + 8 <= count && written + 8 <= alive; index += 8)
+  {
+    flags = _mm_loadl_epi64((const __m128i*)(dead + index));
+    live = _mm_movemask_epi8(_mm_cmpeq_epi8(flags, _mm_setzero_si128())) & 0xFF;
+    _mm256_storeu_ps(destination + written, 
+        _mm256_permutevar8x32_ps(_mm256_loadu_ps(source + index),
+                                 _mm256_load_si256((const __m256i*)compactLanes[live])));
+    written += __builtin_popcount(live);
+  }
+  compactTail(destination, source, dead, index, count, written, alive);
+}
+
+
+
+/******************************************************************************
+* AVX-512 kernels, 16 particles per iteration. Comparisons produce mask
+* registers directly.
+******************************************************************************/
+__attribute__((target("avx512f")))
+static void updateWaterAVX512(const WaterBlock *block, const WaterStepParams *params)
+{
+  int index, vectorCount = block->count & ~15;
+  __m512 acceleration = _mm512_set1_ps(params->yAcceleration);
+  __m512 timeScale = _mm512_set1_ps(params->timeScale);
+  __m512 minY = _mm512_set1_ps(params->minY), maxY = _mm512_set1_ps(params->maxY);
+  __m512 ypos;
+  __mmask16 dead;
+
+  for (index = 0; index < vectorCount; index += 16)
+  {
+    _mm512_storeu_ps(block->xpos + index, _mm512_add_ps(_mm512_loadu_ps(block->xpos + index),
+        _mm512_mul_ps(_mm512_loadu_ps(block->xvel + index), timeScale)));
+    _mm512_storeu_ps(block->zpos + index, _mm512_add_ps(_mm512_loadu_ps(block->zpos + index),
+        _mm512_mul_ps(_mm512_loadu_ps(block->zvel + index), timeScale)));
+    ypos = _mm512_add_ps(_mm512_loadu_ps(block->ypos + index),
+                         _mm512_mul_ps(_mm512_loadu_ps(block->yvel + index), timeScale));
+    _mm512_storeu_ps(block->ypos + index, ypos);
+    _mm512_storeu_ps(block->yvel + index, _mm512_add_ps(_mm512_loadu_ps(block->yvel + index),
+                                                        acceleration));
+    dead = _mm512_cmp_ps_mask(ypos, minY, _CMP_LT_OQ) | _mm512_cmp_ps_mask(ypos, maxY, _CMP_GT_OQ);
+    storeMask(block->dead + index, dead, 16);
+  }
+  waterScalar(block, params, vectorCount);
+}
+
+__attribute__((target("avx512f")))
+static void updateSmokeAVX512(const SmokeBlock *block, const SmokeStepParams *params)
+{
+  int index, vectorCount = block->count & ~15;
+  __m512 acceleration = _mm512_set1_ps(params->yAcceleration);
+  __m512 timeScale = _mm512_set1_ps(params->timeScale);
+  __m512 groundY = _mm512_set1_ps(params->groundY);
+  __m512 xWind = _mm512_set1_ps(params->xWind), zWind = _mm512_set1_ps(params->zWind);
+  __m512 alphaChange = _mm512_set1_ps(params->alphaChange);
+  __m512 threshold = _mm512_set1_ps(params->deathThreshold);
+  __m512 ypos, shade, r, g, b, alpha;
+  __mmask16 faded;
+
+  for (index = 0; index < vectorCount; index += 16)
+  {
+    // Move the particle, crawl on the ground
+    _mm512_storeu_ps(block->xpos + index, _mm512_add_ps(_mm512_loadu_ps(block->xpos + index),
+        _mm512_mul_ps(_mm512_loadu_ps(block->xvel + index), timeScale)));
+    _mm512_storeu_ps(block->zpos + index, _mm512_add_ps(_mm512_loadu_ps(block->zpos + index),
+        _mm512_mul_ps(_mm512_loadu_ps(block->zvel + index), timeScale)));
+    ypos = _mm512_add_ps(_mm512_loadu_ps(block->ypos + index),
+                         _mm512_mul_ps(_mm512_loadu_ps(block->yvel + index), timeScale));
+    ypos = _mm512_max_ps(ypos, groundY);
+    _mm512_storeu_ps(block->ypos + index, ypos);
+
+    // Chaotic movement, wind and gravity
+    _mm512_storeu_ps(block->xvel + index, _mm512_add_ps(_mm512_loadu_ps(block->xvel + index),
+        _mm512_add_ps(_mm512_loadu_ps(block->xnoise + index), _mm512_mul_ps(ypos, xWind))));
+    _mm512_storeu_ps(block->zvel + index, _mm512_add_ps(_mm512_loadu_ps(block->zvel + index),
+        _mm512_add_ps(_mm512_loadu_ps(block->znoise + index), _mm512_mul_ps(ypos, zWind))));
+    _mm512_storeu_ps(block->yvel + index, _mm512_add_ps(_mm512_loadu_ps(block->yvel + index),
+        _mm512_add_ps(acceleration, _mm512_loadu_ps(block->ynoise + index))));
+
+    // Fade away
+    shade = _mm512_loadu_ps(block->shadeChange + index);
+    r = _mm512_sub_ps(_mm512_loadu_ps(block->r + index), shade);
+    g = _mm512_sub_ps(_mm512_loadu_ps(block->g + index), shade);
+    b = _mm512_sub_ps(_mm512_loadu_ps(block->b + index), shade);
+    alpha = _mm512_sub_ps(_mm512_loadu_ps(block->alpha + index), alphaChange);
+    _mm512_storeu_ps(block->r + index, r);
+    _mm512_storeu_ps(block->g + index, g);
+    _mm512_storeu_ps(block->b + index, b);
+    _mm512_storeu_ps(block->alpha + index, alpha);
+    faded = _mm512_cmp_ps_mask(r, threshold, _CMP_LE_OQ) &
+            _mm512_cmp_ps_mask(g, threshold, _CMP_LE_OQ) &
+            _mm512_cmp_ps_mask(b, threshold, _CMP_LE_OQ);
+    faded |= _mm512_cmp_ps_mask(alpha, threshold, _CMP_LE_OQ);
+    storeMask(block->dead + index, faded, 16);
+  }
+  smokeScalar(block, params, vectorCount);
+}
+
+__attribute__((target("avx512f")))
+static void compactAVX512(real *destination, const real *source, const unsigned char *dead,
+                          int count, int alive)
+{
+  int index, written = 0, vectorCount = count & ~15;
+  __m512i flags;
+  __mmask16 live;
+
+  // Masked compress store only writes the live lanes
+  for (index = 0; index < vectorCount && written < alive; index += 16)
+  {
+    flags = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(dead + index)));
+    live = _mm512_testn_epi32_mask(flags, flags);
+    _mm512_mask_compressstoreu_ps(destination + written, live, _mm512_loadu_ps(source + index));
+    written += __builtin_popcount(live);
+  }
+  compactTail(destination, source, dead, index, count, written, alive);
+}
+
+__attribute__((target("avx512f")))
+static void rangeAVX512(const real *values, int count, real *min, real *max)
+{
+  int index, vectorCount = count & ~15;
+  __m512 lower = _mm512_set1_ps(*min), upper = _mm512_set1_ps(*max);
+
+  for (index = 0; index < vectorCount; index += 16)
+  {
+    lower = _mm512_min_ps(lower, _mm512_loadu_ps(values + index));
+    upper = _mm512_max_ps(upper, _mm512_loadu_ps(values + index));
+  }
+  *min = _mm512_reduce_min_ps(lower);
+  *max = _mm512_reduce_max_ps(upper);
+  rangeTail(values, vectorCount, count, min, max);
+}
+
+#endif
+
+
+
+/******************************************************************************
+* Currently selected kernels, scalar until initKernels() is called
+******************************************************************************/
+WaterKernel updateWaterBlock = updateWaterScalar;
+SmokeKernel updateSmokeBlock = updateSmokeScalar;
+CompactKernel compactArray = compactScalar;
+RangeKernel arrayRange = rangeScalar;
+const char *kernelSetName = "scalar";
+
+
+
+/******************************************************************************
+* Select the widest kernels supported by the CPU (and the operating system)
+******************************************************************************/
+void initKernels(void)
+{
+  updateWaterBlock = updateWaterScalar;
+  updateSmokeBlock = updateSmokeScalar;
+  compactArray = compactScalar;
+  arrayRange = rangeScalar;
+  kernelSetName = "scalar";
+
+  #ifdef SIMD_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      updateWaterBlock = updateWaterAVX512;
+      updateSmokeBlock = updateSmokeAVX512;
+      compactArray = compactAVX512;
+      arrayRange = rangeAVX512;
+      kernelSetName = "avx512";
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+      updateWaterBlock = updateWaterAVX2;
+      updateSmokeBlock = updateSmokeAVX2;
+      compactArray = compactAVX2;
+      arrayRange = rangeAVX2;
+      initCompactLanes();
+      kernelSetName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+      updateWaterBlock = updateWaterSSE2;
+      updateSmokeBlock = updateSmokeSSE2;
+      arrayRange = rangeSSE2;
+      kernelSetName = "sse2";
+    }
+  #endif
+}
@@ -0,0 +1,95 @@
+/******************************************************************************
+* File:         kernels.h
+* Brief:        Vectorised particle integration kernels with runtime CPU 
+*               dispatch (AVX-512, AVX2, SSE2 and scalar fallback)
+******************************************************************************/
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Number of particles integrated per kernel call. Random inputs for a block 
+* are generated into small buffers which stay in L1 cache.
+******************************************************************************/
+#define KERNEL_BLOCK_SIZE 1024
+
+
+
+/******************************************************************************
+* Block of water particles to integrate. Each pointer refers to the first 
+* particle of the block. 'dead' receives 1 for every particle to be killed.
+******************************************************************************/
+typedef struct {
+    real *xpos, *ypos, *zpos;           // Position
+    real *xvel, *yvel, *zvel;           // Velocity
+    unsigned char *dead;                // Output death mask
+    int count;                          // Number of particles in the block
+} WaterBlock;
+
+// Parameters constant across a single water update
+typedef struct {
+    real timeScale;                     // Step length in simulation ticks
+    real yAcceleration;                 // Gravity scaled by water drop mass
+    real minY, maxY;                    // Particles outside [minY, maxY] die
+} WaterStepParams;
+
+
+
+/******************************************************************************
+* Block of smoke particles to integrate together with per-particle random 
+* inputs (chaotic movement and colour fade)
+******************************************************************************/
+typedef struct {
+    real *xpos, *ypos, *zpos;           // Position
+    real *xvel, *yvel, *zvel;           // Velocity
+    real *r, *g, *b, *alpha;            // Colour and alpha value
+    const real *xnoise, *ynoise, *znoise; // Chaotic velocity change
+    const real *shadeChange;            // Colour fade
+    unsigned char *dead;                // Output death mask
+    int count;                          // Number of particles in the block
+} SmokeBlock;
+
+// Parameters constant across a single smoke update
+typedef struct {
+    real timeScale;                     // Step length in simulation ticks
+    real yAcceleration;                 // Gravity scaled by smoke particle mass
+    real groundY;                       // Smoke crawls on the ground below this
+    real xWind, zWind;                  // Wind acceleration per unit of height
+    real alphaChange;                   // Alpha fade per step
+    real deathThreshold;                // Colour/alpha below which particle dies
+} SmokeStepParams;
+
+
+
+/******************************************************************************
+* Kernel types and currently selected kernels
+******************************************************************************/
+typedef void (*WaterKernel)(const WaterBlock*, const WaterStepParams*);
+typedef void (*SmokeKernel)(const SmokeBlock*, const SmokeStepParams*);
+
+// Copy elements of "source" not flagged in "dead" to "destination", keeping 
+// their order. "alive" must be the number of such elements, nothing past 
+// destination[alive - 1] is written.
+typedef void (*CompactKernel)(real *destination, const real *source, 
+                              const unsigned char *dead, int count, int alive);
+
+// Extend the range [*min, *max] to hold the first "count" elements of "values"
+typedef void (*RangeKernel)(const real *values, int count, real *min, real *max);
+
+extern WaterKernel updateWaterBlock;    // Integrate a block of water particles
+extern SmokeKernel updateSmokeBlock;    // Integrate a block of smoke particles
+extern CompactKernel compactArray;      // Remove dead particles from an array
+extern RangeKernel arrayRange;          // Minimum and maximum of an array
+extern const char *kernelSetName;       // Instruction set of selected kernels
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void initKernels(void);                 // Select the fastest kernels for this CPU
+
+#endif
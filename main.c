@@ -0,0 +1,264 @@
+/******************************************************************************
+* File:         main.c
+* Brief:        Entry point of the particle system simulation, command line 
+*               options
+*
+* Note:
+* When compiled with -DNO_GRAPHICS the program does not use (nor link) OpenGL
+* and GLUT and always runs headless.
+******************************************************************************/
+#include "particleSystem.h"
+#include "kernels.h"
+#include "rng.h"
+#include "threadPool.h"
+#include "headless.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "input.h"
+#include "prewarm.h"
+#include "budget.h"
+#include "capture.h"
+
+#ifndef NO_GRAPHICS
+    #include "graphics.h"
+#endif
+
+
+
+/******************************************************************************
+* Main method
+******************************************************************************/
+int main(int argc, char *argv[])
+{
+  parseArguments(argc, argv);
+  startTrace();
+  seedRandom(options.seed);
+  initThreadPool(options.threads);
+  initKernels();
+  if (options.replayFile)
+    return runReplay(options.replayFile);
+  initParticleSystem();
+  if (!options.restoreFile)
+    prewarmParticles();
+  else if (!loadSnapshot(options.restoreFile))
+    return 1;
+  startRecording();
+  printf("Random seed: %llu, threads: %d, kernels: %s\n", 
+         (unsigned long long)options.seed, threadCount, kernelSetName);
+
+  if (options.headless)
+    return runHeadless(options.steps);
+
+  #ifdef NO_GRAPHICS
+    return 0;
+  #else
+    if (options.captureDir)
+      return runCapture(options.steps);
+    initGraphics(argc, argv);
+    glutMainLoop();
+    return 0;
+  #endif
+}
+
+
+
+/******************************************************************************
+* Parse the number of particles, clamped to [1, PARTICLE_LIMIT]. Particle 
+* counts are limited to --max-particles later on (see limitParticles()).
+******************************************************************************/
+static int parseParticleCount(const char *string)
+{
+  long count = strtol(string, NULL, 10);
+  return count < 1 ? 1 : count > PARTICLE_LIMIT ? PARTICLE_LIMIT : (int)count;
+}
+
+
+
+/******************************************************************************
+* Parse a positive number, "fallback" is returned for anything else
+******************************************************************************/
+static double parsePositive(const char *string, double fallback)
+{
+  double value = strtod(string, NULL);
+  return value > 0.0 ? value : fallback;
+}
+
+
+
+/******************************************************************************
+* Parse the budget weights "W,S" of water and smoke, negative ones are taken
+* as 0
+******************************************************************************/
+static void parseWeights(const char *string)
+{
+  double water, smoke;
+
+  if (sscanf(string, "%lf,%lf", &water, &smoke) != 2)
+    return;
+  options.waterWeight = water > 0.0 ? water : 0.0;
+  options.smokeWeight = smoke > 0.0 ? smoke : 0.0;
+}
+
+
+
+/******************************************************************************
+* Parse the capture size "WxH", sizes below one pixel are ignored
+******************************************************************************/
+static void parseSize(const char *string)
+{
+  int width, height;
+
+  if (sscanf(string, "%dx%d", &width, &height) != 2 || width < 1 || height < 1)
+    return;
+  options.captureWidth = width;
+  options.captureHeight = height;
+}
+
+
+
+/******************************************************************************
+* Parse command line options, other arguments are left for GLUT
+*   --seed N      seed of the random number generators (default: current time)
+*   --threads N   number of simulation threads (default: number of processors)
+*   --water N     initial number of water particles
+*   --smoke N     initial number of smoke particles
+*   --water-emitters N  number of fountains, on a grid (default: 1)
+*   --smoke-emitters N  number of smoke sources, on a grid (default: 1)
+*   --max-particles N  limit of particles in each system (default: 2000000)
+*   --water-dt S  water simulation step in seconds (default: 1/60)
+*   --smoke-dt S  smoke simulation step in seconds (default: 1/60)
+*   --time-scale X  simulated seconds per second of wall clock time
+*   --headless    run the simulation without graphics and report its speed
+*   --steps N     number of headless or captured frames (ticks of 1/60 s)
+*   --client-arrays  render from client vertex arrays instead of buffer objects
+*   --analytic-water  closed-form water trajectories instead of integration
+*   --no-pipeline  simulate and draw in sequence instead of overlapping them
+*   --no-depth-sort  draw smoke sprites in storage order, not back to front
+*   --water-collisions  water drops collide with each other
+*   --smoke-density  smoke is pushed out of dense regions
+*   --smoke-volume N  draw smoke as a density volume above N visible sprites
+*                 (default: 250000, 0 = always sprites)
+*   --metrics FILE  write frame metrics every few seconds, JSON if FILE ends
+*                 in .json, CSV otherwise (see metrics.c)
+*   --trace FILE  record a timeline of the hot functions, written to FILE in
+*                 the Chrome trace-event format at exit and on key 't'
+*   --snapshot FILE  snapshot saved by key 'p' and restored by key 'P'
+*                 (default: particleSystem.snapshot, see snapshot.c)
+*   --restore FILE  start from a snapshot
+*   --record FILE  record the frames and controls to FILE (see input.c)
+*   --replay FILE  replay a recording headless and time it
+*   --no-prewarm  start with all particles at their emitters instead of in
+*                 steady state (see prewarm.c)
+*   --prewarm-time S  fast-forward S simulated seconds before the first frame
+*   --water-rate N  new water particles per simulated second (default: enough
+*                 to refill the fountain in 0.25 s)
+*   --smoke-rate N  new smoke particles per simulated second (likewise)
+*   --spawn-budget N  most particles each system spawns in one frame
+*                 (default: unlimited)
+*   --target-frame MS  adjust the particle totals to hold this frame time
+*                 (see budget.c)
+*   --min-particles N  lower bound of the adjusted totals (default: 1000)
+*   --budget-weights W,S  shares of water and smoke in the adjustments
+*                 (default: 1,1)
+*   --capture DIR  draw offscreen and write the frames to DIR as PNG images
+*                 (see capture.c)
+*   --capture-size WxH  size of the captured images (default: 1920x1080)
+*   --capture-raw  write raw RGB (PPM) images instead of PNG
+*   --capture-threads N  number of image encoders (default: number of
+*                 processors)
+******************************************************************************/
+void parseArguments(int argc, char *argv[])
+{
+  int index;
+
+  options.seed = time(NULL);
+  options.threads = defaultThreadCount();
+  options.snapshotFile = SNAPSHOT_FILE;
+  options.minParticles = BUDGET_MIN_PARTICLES;
+  options.captureWidth = CAPTURE_WIDTH;
+  options.captureHeight = CAPTURE_HEIGHT;
+  options.captureThreads = defaultThreadCount();
+  #ifdef NO_GRAPHICS
+    options.headless = 1;
+  #endif
+
+  for (index = 1; index < argc; index++)
+  {
+    if (!strcmp(argv[index], "--headless"))
+      options.headless = 1;
+    else if (!strcmp(argv[index], "--client-arrays"))
+      options.clientArrays = 1;
+    else if (!strcmp(argv[index], "--analytic-water"))
+      options.analyticWater = 1;
+    else if (!strcmp(argv[index], "--no-pipeline"))
+      options.pipeline = 0;
+    else if (!strcmp(argv[index], "--no-depth-sort"))
+      options.depthSort = 0;
+    else if (!strcmp(argv[index], "--water-collisions"))
+      options.waterCollisions = 1;
+    else if (!strcmp(argv[index], "--smoke-density"))
+      options.smokeDensity = 1;
+    else if (!strcmp(argv[index], "--no-prewarm"))
+      options.prewarm = 0;
+    else if (!strcmp(argv[index], "--capture-raw"))
+      options.captureRaw = 1;
+    else if (index + 1 == argc)
+      break;
+    else if (!strcmp(argv[index], "--seed"))
+      options.seed = strtoull(argv[++index], NULL, 10);
+    else if (!strcmp(argv[index], "--threads"))
+      options.threads = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--water"))
+      options.waterParticles = parseParticleCount(argv[++index]);
+    else if (!strcmp(argv[index], "--smoke"))
+      options.smokeParticles = parseParticleCount(argv[++index]);
+    else if (!strcmp(argv[index], "--water-emitters"))
+      options.waterEmitters = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--smoke-emitters"))
+      options.smokeEmitters = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--max-particles"))
+      options.maxParticles = parseParticleCount(argv[++index]);
+    else if (!strcmp(argv[index], "--water-dt"))
+      options.waterTimeStep = parsePositive(argv[++index], options.waterTimeStep);
+    else if (!strcmp(argv[index], "--smoke-dt"))
+      options.smokeTimeStep = parsePositive(argv[++index], options.smokeTimeStep);
+    else if (!strcmp(argv[index], "--time-scale"))
+      options.timeScale = parsePositive(argv[++index], options.timeScale);
+    else if (!strcmp(argv[index], "--steps"))
+      options.steps = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--smoke-volume"))
+      options.smokeVolume = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--metrics"))
+      options.metricsFile = argv[++index];
+    else if (!strcmp(argv[index], "--trace"))
+      options.traceFile = argv[++index];
+    else if (!strcmp(argv[index], "--snapshot"))
+      options.snapshotFile = argv[++index];
+    else if (!strcmp(argv[index], "--restore"))
+      options.restoreFile = argv[++index];
+    else if (!strcmp(argv[index], "--record"))
+      options.recordFile = argv[++index];
+    else if (!strcmp(argv[index], "--replay"))
+      options.replayFile = argv[++index];
+    else if (!strcmp(argv[index], "--prewarm-time"))
+      options.prewarmTime = parsePositive(argv[++index], 0.0);
+    else if (!strcmp(argv[index], "--water-rate"))
+      options.waterRate = parsePositive(argv[++index], 0.0);
+    else if (!strcmp(argv[index], "--smoke-rate"))
+      options.smokeRate = parsePositive(argv[++index], 0.0);
+    else if (!strcmp(argv[index], "--spawn-budget"))
+      options.spawnBudget = atoi(argv[++index]);
+    else if (!strcmp(argv[index], "--target-frame"))
+      options.targetFrameTime = parsePositive(argv[++index], 0.0) / 1000.0;
+    else if (!strcmp(argv[index], "--min-particles"))
+      options.minParticles = parseParticleCount(argv[++index]);
+    else if (!strcmp(argv[index], "--budget-weights"))
+      parseWeights(argv[++index]);
+    else if (!strcmp(argv[index], "--capture"))
+      options.captureDir = argv[++index];
+    else if (!strcmp(argv[index], "--capture-size"))
+      parseSize(argv[++index]);
+    else if (!strcmp(argv[index], "--capture-threads"))
+      options.captureThreads = atoi(argv[++index]);
+  }
+}
@@ -0,0 +1,169 @@
+/******************************************************************************
+* File:         metrics.c
+* Brief:        Per-frame timings and counters, rolling statistics and dumps
+*
+* Note:
+* Every frame records the wall clock time of its phases and a few counters
+* (FrameMetrics). The last METRICS_WINDOW frames are kept in a ring, their
+* minimum, median, 99th percentile and maximum are taken by sorting a copy,
+* as in the benchmarks, whenever they are asked for: by the overlay (key
+* 'm', graphics.c) or by the periodic dumps. A single slow frame, such as
+* the one doubling the fountain, therefore shows up in the maximum and p99
+* for as long as it is in the window, instead of vanishing in an average.
+*
+* With --metrics FILE the statistics are written every
+* METRICS_DUMP_INTERVAL seconds and at exit of a headless run: a FILE
+* ending in .json is rewritten with the latest statistics, any other FILE
+* gets CSV rows appended, one per metric and dump.
+******************************************************************************/
+#include "particleSystem.h"
+#include "headless.h"
+#include "metrics.h"
+
+
+
+/******************************************************************************
+* Global variables (declared in metrics.h)
+******************************************************************************/
+FrameMetrics simulationMetrics;
+
+// Name, unit and scale (from the recorded value to the unit) of each metric
+static const struct {
+  const char *name;
+  const char *unit;
+  double scale;
+} metricInfo[METRIC_COUNT] = {
+  { "frame", "ms", 1e3 },
+  { "fence", "ms", 1e3 },
+  { "spawn", "ms", 1e3 },
+  { "progress", "ms", 1e3 },
+  { "pack", "ms", 1e3 },
+  { "setView", "ms", 1e3 },
+  { "draw", "ms", 1e3 },
+  { "swap", "ms", 1e3 },
+  { "spawned", "", 1.0 },
+  { "killed", "", 1.0 },
+  { "updated", "", 1.0 },
+  { "drawCalls", "", 1.0 },
+  { "textureBinds", "", 1.0 },
+  { "bytes", "", 1.0 }
+};
+
+// Ring of the last METRICS_WINDOW frames
+static double history[METRIC_COUNT][METRICS_WINDOW];
+static long long frames;
+
+// Wall clock time of the first frame and of the last dump
+static double firstFrame, lastDump;
+static int dumps;
+
+
+
+/******************************************************************************
+* Name and unit of a metric
+******************************************************************************/
+const char *metricName(int metric)
+{
+  return metricInfo[metric].name;
+}
+
+const char *metricUnit(int metric)
+{
+  return metricInfo[metric].unit;
+}
+
+
+
+/******************************************************************************
+* Add one frame to the ring, dump the statistics if it is time to
+******************************************************************************/
+void recordFrame(const FrameMetrics *frame)
+{
+  int metric, slot = (int)(frames % METRICS_WINDOW);
+  double now = wallClock();
+
+  for (metric = 0; metric < METRIC_COUNT; metric++)
+    history[metric][slot] = frame->value[metric];
+  if (frames++ == 0)
+    firstFrame = lastDump = now;
+  else if (options.metricsFile && now - lastDump >= METRICS_DUMP_INTERVAL) {
+    dumpMetrics();
+    lastDump = now;
+  }
+}
+
+
+
+/******************************************************************************
+* Statistics of one metric over the frames in the ring, in its unit
+******************************************************************************/
+static int compareValues(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+void summariseMetric(int metric, MetricSummary *summary)
+{
+  double values[METRICS_WINDOW], scale = metricInfo[metric].scale;
+  int count = frames < METRICS_WINDOW ? (int)frames : METRICS_WINDOW;
+
+  if (count == 0) {
+    summary->min = summary->median = summary->p99 = summary->max = 0.0;
+    return;
+  }
+  memcpy(values, history[metric], count * sizeof(double));
+  qsort(values, count, sizeof(double), compareValues);
+  summary->min = values[0] * scale;
+  summary->median = (count % 2 ? values[count / 2] :
+                     0.5 * (values[count / 2 - 1] + values[count / 2])) * scale;
+  summary->p99 = values[(int)ceil(0.99 * count) - 1] * scale;
+  summary->max = values[count - 1] * scale;
+}
+
+
+
+/******************************************************************************
+* Write the statistics of all metrics to options.metricsFile (see above)
+******************************************************************************/
+void dumpMetrics(void)
+{
+  const char *path = options.metricsFile;
+  size_t length = path ? strlen(path) : 0;
+  int json = length >= 5 && !strcmp(path + length - 5, ".json");
+  int metric, count = frames < METRICS_WINDOW ? (int)frames : METRICS_WINDOW;
+  double time = frames ? wallClock() - firstFrame : 0.0;
+  MetricSummary summary;
+  FILE *file;
+
+  if (!path)
+    return;
+  file = fopen(path, json || dumps == 0 ? "w" : "a");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return;
+  }
+
+  if (json)
+    fprintf(file, "{\n  \"time\": %.3f,\n  \"frames\": %lld,\n  \"window\": %d,\n"
+                  "  \"metrics\": [\n", time, frames, count);
+  else if (dumps == 0)
+    fprintf(file, "time,frames,window,metric,unit,min,median,p99,max\n");
+  for (metric = 0; metric < METRIC_COUNT; metric++)
+  {
+    summariseMetric(metric, &summary);
+    if (json)
+      fprintf(file, "    {\"metric\": \"%s\", \"unit\": \"%s\", \"min\": %.6g, "
+                    "\"median\": %.6g, \"p99\": %.6g, \"max\": %.6g}%s\n",
+              metricInfo[metric].name, metricInfo[metric].unit, summary.min,
+              summary.median, summary.p99, summary.max, metric + 1 < METRIC_COUNT ? "," : "");
+    else
+      fprintf(file, "%.3f,%lld,%d,%s,%s,%.6g,%.6g,%.6g,%.6g\n", time, frames, count,
+              metricInfo[metric].name, metricInfo[metric].unit, summary.min,
+              summary.median, summary.p99, summary.max);
+  }
+  if (json)
+    fprintf(file, "  ]\n}\n");
+  fclose(file);
+  dumps++;
+}
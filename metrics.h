@@ -0,0 +1,66 @@
+/******************************************************************************
+* File:         metrics.h
+* Brief:        Per-frame timings and counters, rolling statistics and dumps
+******************************************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+
+
+/******************************************************************************
+* Metrics parameters
+******************************************************************************/
+#define METRICS_WINDOW 600				// Frames the statistics are taken over
+#define METRICS_DUMP_INTERVAL 5.0		// Seconds between dumps to --metrics FILE
+
+
+
+/******************************************************************************
+* Values recorded for every frame. Phases are wall clock times in seconds,
+* the others are counts per frame. Spawning, updating and packing are done
+* by the simulation thread while the previous frame is drawn (pipeline.c),
+* "fence" is the time spent waiting for it.
+******************************************************************************/
+enum {
+	METRIC_FRAME,						// Whole frame
+	METRIC_FENCE,						// Waiting for the simulated frame
+	METRIC_SPAWN,						// Spawning particles (all steps of the frame)
+	METRIC_PROGRESS,					// Updating particles
+	METRIC_PACK,						// Packing render buffers
+	METRIC_SET_VIEW,					// Setting the camera
+	METRIC_DRAW,						// Issuing draw calls (not waiting for them)
+	METRIC_SWAP,						// Swapping buffers, includes waiting for the GPU
+	METRIC_SPAWNED,						// Particles spawned
+	METRIC_KILLED,						// Particles which died
+	METRIC_UPDATED,						// Particle updates (all steps of the frame)
+	METRIC_DRAW_CALLS,					// glDraw*() calls
+	METRIC_TEXTURE_BINDS,				// glBindTexture() calls
+	METRIC_BYTES,						// Vertex, index and texel bytes handed to OpenGL
+	METRIC_COUNT
+};
+
+typedef struct {
+	double value[METRIC_COUNT];
+} FrameMetrics;
+
+// Statistics of one metric over the last METRICS_WINDOW frames
+typedef struct {
+	double min, median, p99, max;
+} MetricSummary;
+
+// Simulation part of the frame being simulated (only touched by the thread
+// simulating, see pipeline.c)
+extern FrameMetrics simulationMetrics;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void recordFrame(const FrameMetrics*);	// Add a frame, dump if it is time to
+void summariseMetric(int, MetricSummary*); // Statistics of the recorded frames
+const char *metricName(int);			// Name and unit ("ms" or "")
+const char *metricUnit(int);
+void dumpMetrics(void);					// Write statistics to options.metricsFile
+
+#endif
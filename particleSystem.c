@@ -7,548 +7,1078 @@
 *
 * Note:         
 * Two particle systems implemented, water fountain and smoke emitter. Live particles
-* are kept at the beginning of the array which stores them all. There are two 
-* separate data structures for water and smoke, as well as two for smoke and water
-* particles. It's because of different properties they have.
+* are kept at the beginning of the arrays which store them all. There are two 
+* separate data structures for water and smoke because of different properties
+* their particles have. Each property is stored in its own array (structure of
+* arrays) in single precision, unless compiled with -DDOUBLE_PRECISION.
 *
-* Two rendering options are available (by changing the value of RENDERING_METHOD)
-*   1. Particles are drawn as points
-*   2. Water movement is drawn using lines, while smoke is rendered using point
-*   textures.
-*       
+* Particles are integrated by vectorised kernels (kernels.c) selected at 
+* runtime for the instruction set of the CPU. Random variates are generated in
+* batches from seedable streams (rng.c). Particle arrays are split into chunks
+* of fixed size which are spawned and updated in parallel (threadPool.c), each
+* with its own random stream, so results do not depend on the thread count.
+* Dead particles are flagged by the update kernels and removed afterwards by 
+* a stream compaction pass: every chunk copies its live particles, in order, 
+* to its place (prefix sum of live counts) in a second set of arrays, which 
+* then replaces the first.
+*
+* Particle arrays are allocated on the heap and grow or shrink in whole chunks
+* to follow the number of particles, which never exceeds options.maxParticles.
+* Every update also records the bounding box of each chunk, after compaction
+* the boxes describe consecutive ranges of particles which rendering can cull.
+*
+* Each system is advanced in fixed time steps of its own length, independent
+* of the frame rate (advanceSimulation()). Positions before the last step are
+* kept, so that rendering can interpolate between the last two states.
+*
+* Particles are spawned by emitters (emitter.c), any number of fountains and
+* smoke sources share the particle pool of their system. Each particle is
+* tagged with its emitter, everything else treats the pool as a whole. Dead
+* particles are replaced at a limited rate, so that changes of the total are
+* spread over several frames.
+*
+* Particles do not interact unless asked to: with --water-collisions drops
+* bounce off each other, with --smoke-density smoke is pushed out of dense
+* regions. Neighbours are found through a spatial hash grid (spatialGrid.c)
+* rebuilt before every such step, so both stay linear in the particle count.
+*
+* With --analytic-water the fountain is not integrated at all: drops follow
+* closed-form trajectories and expire in order of their death steps
+* (ballistic.c).
+*
+* Rendering and user interaction are implemented in graphics.c, the simulation 
+* itself does not depend on OpenGL and can run headless (headless.c).
+* Spawning and updating are traced as zones with --trace (trace.c).
 ******************************************************************************/
 #include "particleSystem.h"
+#include "kernels.h"
+#include "rng.h"
+#include "threadPool.h"
+#include "ballistic.h"
+#include "emitter.h"
+#include "spatialGrid.h"
+#include "headless.h"
+#include "metrics.h"
+#include "trace.h"
 
 
 
 /******************************************************************************
-* Main method
+* Global variables (declared in particleSystem.h)
 ******************************************************************************/
-int main(int argc, char *argv[])
-{
-  srand(time(NULL));
-  initParticleSystem();
-  initGraphics(argc, argv);
-  glutMainLoop();
-  return 0;
-}
+Water fountain;
+Smoke smokeEmitter;
+double gravity;
+int angle;
+double windSpeed, xWind, zWind;
+
+// Command line options, defaults (set by parseArguments())
+Options options = {
+  .threads = 1,
+  .steps = 1000,
+  .waterParticles = DEFAULT_NO_OF_PARTICLES,
+  .smokeParticles = DEFAULT_NO_OF_PARTICLES,
+  .waterEmitters = 1,
+  .smokeEmitters = 1,
+  .maxParticles = MAX_NO_OF_PARTICLES,
+  .waterTimeStep = SIMULATION_TICK,
+  .smokeTimeStep = SIMULATION_TICK,
+  .timeScale = 1.0,
+  .pipeline = 1,
+  .depthSort = 1,
+  .prewarm = 1,
+  .waterWeight = 1.0,
+  .smokeWeight = 1.0,
+  .smokeVolume = SMOKE_VOLUME_THRESHOLD
+};
+
+// Particle death flags written by the update kernels, number of particles 
+// left in each chunk and destination of each chunk in the compacted arrays.
+// All are sized for the larger of the two particle systems.
+static unsigned char *deathMask;
+static int *chunkAlive;
+static int *chunkDestination;
+static int scratchCapacity;
+
+// Neighbour grids of the interacting systems and the velocities of the drops
+// before the collisions of a step
+static SpatialGrid waterGrid;
+static SpatialGrid smokeGrid;
+static real *collisionVelocity[3];
+static int collisionCapacity;
+
+// Arrays of each particle system, for code which treats all of them alike.
+// Pointers to the array pointers are kept, so they stay valid when the 
+// arrays are reallocated or swapped with their spare arrays.
+typedef struct {
+  real **arrays[16];
+  int arrayCount;
+  unsigned char **bytes;                // Per-particle byte array (if any)
+  unsigned short **tags;                // Emitter of each particle
+  int *alive;
+  int *capacity;
+  real *spare[16];                      // Compaction destination of each array
+  unsigned char *spareBytes;
+  unsigned short *spareTags;
+  ParticleBounds **bounds;              // One per chunk
+  int *boundsCount;
+} ParticleArrays;
+
+static ParticleArrays waterArrays = {
+  { &fountain.xpos, &fountain.ypos, &fountain.zpos, 
+    &fountain.xvel, &fountain.yvel, &fountain.zvel,
+    &fountain.xprev, &fountain.yprev, &fountain.zprev }, 9, 
+  NULL, &fountain.emitter, &fountain.aliveParticles, &fountain.capacity, { NULL }, NULL, NULL,
+  &fountain.bounds, &fountain.boundsCount
+};
+
+static ParticleArrays smokeArrays = {
+  { &smokeEmitter.xpos, &smokeEmitter.ypos, &smokeEmitter.zpos, 
+    &smokeEmitter.xvel, &smokeEmitter.yvel, &smokeEmitter.zvel,
+    &smokeEmitter.xprev, &smokeEmitter.yprev, &smokeEmitter.zprev,
+    &smokeEmitter.r, &smokeEmitter.g, &smokeEmitter.b, &smokeEmitter.alpha }, 13, 
+  &smokeEmitter.textureIndex, &smokeEmitter.emitter, &smokeEmitter.aliveParticles, 
+  &smokeEmitter.capacity, { NULL }, NULL, NULL, &smokeEmitter.bounds, &smokeEmitter.boundsCount
+};
+
+// Range of particles to spawn and how they are shared by the emitters (see
+// assignEmitters())
+typedef struct {
+  int first, last;
+  double offset;                        // Sampling offset of this step
+  double spacing;                       // Summed rates per particle
+} SpawnRange;
 
 
 
 /******************************************************************************
-* Initialisation function
+* Initialise the particle systems
 ******************************************************************************/
-void initGraphics(int argc, char *argv[])
+void initParticleSystem()
 {
-  int index;
-  glutInit(&argc, argv);
-  glutInitWindowPosition(100, 100);
-  glutInitDisplayMode(GLUT_DOUBLE | GLUT_DEPTH);
-  glutCreateWindow("Particle system");
-  glutFullScreen();
-  glutDisplayFunc(display);
-  glutKeyboardFunc(keyboard);
-  glutSpecialFunc(cursor_keys);
-  glutReshapeFunc(reshape);
-  createMenu();
-
-  // Render points as circles and make them span a few pixels instead of one
-  glEnable(GL_POINT_SMOOTH);
-  glPointSize(POINT_SIZE);
-
-  /*--------------------------------------------------------------------------
-  * Setup for the smoke rendering method using textures
-  *-------------------------------------------------------------------------*/
-  #if RENDERING_METHOD == 2
-
-    // Make points very large (in pixel terms), set the blending funcion
-    glPointSize(POINT_SIZE_TEXTURE);
-    // Render antialiased points and lines in arbitrary order, pixel aithmetic
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_BLEND);
-    //  Specify the drawing mode for point sprites
-    glTexEnvi(GL_POINT_SPRITE, GL_COORD_REPLACE, GL_TRUE);
-    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-    // Enable point sprites and 2D textures
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_POINT_SPRITE);
-
-    // Load textures one by one
-    for (index = 0; index < SMOKE_TEXTURE_NUMBER; index++) {
-      sprintf(stringBuffer, "Textures/smoke%d.png", index);
-      smokeEmitter.textures[index] = SOIL_load_OGL_texture(stringBuffer, 
-                                                           SOIL_LOAD_RGBA, 
-                                                           SOIL_CREATE_NEW_ID, 
-                                                           SOIL_FLAG_MIPMAPS);
-    }
-  #endif
+  TRACE_BEGIN("initParticleSystem");
+  // Set the initial values of particle system parameters
+  fountain.totalParticles = limitParticles(options.waterParticles);
+  fountain.aliveParticles = fountain.boundsCount = 0;
+  smokeEmitter.totalParticles = limitParticles(options.smokeParticles);
+  smokeEmitter.aliveParticles = smokeEmitter.boundsCount = 0;
+  resetBallistic();
+  initEmitters();
+  smokeEmitter.r0 = smokeEmitter.g0 = smokeEmitter.b0 = SMOKE_SHADE;
+  smokeEmitter.chaoticSpeed = SMOKE_CHAOS_SPEED_VAR;
+  gravity = DEFAULT_GRAVITY;
+  windSpeed = SMOKE_WIND_INIT_SPEED;
+  angle = SMOKE_WIND_INIT_DIRECTION;
+  computeWind();
+  resizeParticles();
+
+  // Step lengths, the number of completed steps keeps counting
+  fountain.clock.step = options.waterTimeStep;
+  fountain.clock.accumulator = 0.0;
+  fountain.clock.interpolation = 1.0;
+  smokeEmitter.clock.step = options.smokeTimeStep;
+  smokeEmitter.clock.accumulator = 0.0;
+  smokeEmitter.clock.interpolation = 1.0;
+  fountain.emission.rate = options.waterRate;
+  fountain.emission.owed = 0.0;
+  smokeEmitter.emission.rate = options.smokeRate;
+  smokeEmitter.emission.owed = 0.0;
+  refillSpawnBudget();
+  TRACE_END();
 }
 
 
 
 /******************************************************************************
-* Callback function, called whenever graphics should be redrawn
+* Clamp the number of particles of one system to [1, options.maxParticles]
 ******************************************************************************/
-void display()
+int limitParticles(int count)
 {
-  setView();
-  glClear(GL_COLOR_BUFFER_BIT);         // Clear the screen and depth buffer
-  spawnParticles();                     // Generate new particles to replace dead ones
-  drawParticles();                      // Render particles
-  progressTime();                       // Update particle coordinates and properties
-  glutPostRedisplay();                  // Mark the current window to be redisplayed
-  calculateFPS();                       // Calculate the frame rate
-  
-  if (currentView == &DEFAULT_VEW)      // Display simulation parameter values
-    displayData();  
-
-  glutSwapBuffers();                    // Double buffering in place
+  return count < 1 ? 1 : count > options.maxParticles ? options.maxParticles : count;
 }
 
 
 
 /******************************************************************************
-* Initialise the particle systems
+* Allocate "count" elements of size "size" aligned to PARTICLE_ALIGNMENT and
+* copy the first "keep" elements of "old" into them (old memory is freed)
 ******************************************************************************/
-void initParticleSystem()
+static void *reallocAligned(void *old, int keep, int count, size_t size)
 {
-  // Set the initial values of particle system parameters
-  fountain.totalParticles = DEFAULT_NO_OF_PARTICLES;
-  fountain.aliveParticles = 0;
-  smokeEmitter.totalParticles = DEFAULT_NO_OF_PARTICLES;
-  smokeEmitter.aliveParticles = 0;
-  smokeEmitter.r = smokeEmitter.g = smokeEmitter.b = SMOKE_SHADE;
-  smokeEmitter.chaoticSpeed = SMOKE_CHAOS_SPEED_VAR;
-  gravity = DEFAULT_GRAVITY;
-  currentView = &DEFAULT_VEW;
-  windSpeed = SMOKE_WIND_INIT_SPEED;
-  angle = SMOKE_WIND_INIT_DIRECTION;
-  computeWind();
+  size_t bytes = (size_t)count * size;
+  void *array;
+
+  bytes = (bytes + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+  array = aligned_alloc(PARTICLE_ALIGNMENT, bytes ? bytes : PARTICLE_ALIGNMENT);
+  if (!array) {
+    fprintf(stderr, "Could not allocate memory for %d particles\n", count);
+    exit(1);
+  }
+  if (old && keep > 0)
+    memcpy(array, old, (size_t)keep * size);
+  free(old);
+  return array;
 }
 
 
 
 /******************************************************************************
-* Spawn particles
+* Resize the arrays of one particle system to hold "needed" particles. The 
+* capacity is a whole number of chunks, it grows as soon as it is too small
+* and shrinks once less than half of it is needed (so that a count changing
+* back and forth does not reallocate every time).
 ******************************************************************************/
-void spawnParticles() 
+static void resizeArrays(ParticleArrays *particles, int needed, int alive)
 {
-  // Dead particles are stored at the end of array, thus no need for 'alive'
-  // parameter for each particle
-  int index;
+  int array, capacity = *particles->capacity;
+  int chunks = (needed + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
 
-  // Spawn water particles with different horizontal speeds (side splash) and 
-  // different vertical speeds. Particles are generated from a single point being
-  // the fountain location
-  for (index = fountain.aliveParticles; index < fountain.totalParticles; index++) 
-  {
-    fountain.particles[index].xpos = WATER_FOUNTAIN_X;
-    fountain.particles[index].ypos = WATER_FOUNTAIN_Y;
-    fountain.particles[index].zpos = WATER_FOUNTAIN_Z;
-    fountain.particles[index].xvel = gaussianRandom(0.0, WATER_SIDE_SPLASH_VAR);
-    fountain.particles[index].zvel = boxMuller2Rand;
-    fountain.particles[index].yvel = gaussianRandom(WATER_SPEED_MEAN, WATER_SPEED_VAR);
-    fountain.aliveParticles++;
+  chunks = chunks < 1 ? 1 : chunks;
+  if (needed <= capacity && chunks * PARTICLE_CHUNK_SIZE * 2 > capacity)
+    return;
 
+  capacity = chunks * PARTICLE_CHUNK_SIZE;
+  for (array = 0; array < particles->arrayCount; array++)
+  {
+    *particles->arrays[array] = reallocAligned(*particles->arrays[array], alive, 
+                                               capacity, sizeof(real));
+    particles->spare[array] = reallocAligned(particles->spare[array], 0, capacity, sizeof(real));
   }
+  if (particles->bytes) {
+    *particles->bytes = reallocAligned(*particles->bytes, alive, capacity, 1);
+    particles->spareBytes = reallocAligned(particles->spareBytes, 0, capacity, 1);
+  }
+  *particles->tags = reallocAligned(*particles->tags, alive, capacity, sizeof(unsigned short));
+  particles->spareTags = reallocAligned(particles->spareTags, 0, capacity, sizeof(unsigned short));
+  *particles->boundsCount = *particles->boundsCount < chunks ? *particles->boundsCount : chunks;
+  *particles->bounds = reallocAligned(*particles->bounds, *particles->boundsCount, 
+                                      chunks, sizeof(ParticleBounds));
+  *particles->capacity = capacity;
+}
 
-  // Spawn smoke particles with only vertical speed being nonzero. Set their initial colour
-  // according to the current value of colour parameters (with some random noise). Particles 
-  // are generated from a square area with linear distribution. 
-  for (index = smokeEmitter.aliveParticles; index < smokeEmitter.totalParticles; index++) 
-  {
-    smokeEmitter.particles[index].xpos = uniformRandom(SMOKE_EMITTER_SIZE) + SMOKE_EMITTER_X;
-    smokeEmitter.particles[index].ypos = SMOKE_EMITTER_Y;
-    smokeEmitter.particles[index].zpos = uniformRandom(SMOKE_EMITTER_SIZE) + SMOKE_EMITTER_Z;
-    smokeEmitter.particles[index].xvel = 0.0;
-    smokeEmitter.particles[index].yvel = gaussianRandom(SMOKE_SPEED_MEAN, SMOKE_SPEED_VAR);
-    smokeEmitter.particles[index].zvel = 0.0;
-    smokeEmitter.particles[index].r = gaussianRandom(smokeEmitter.r, SMOKE_SHADE_INIT_VAR);
-    smokeEmitter.particles[index].g = gaussianRandom(smokeEmitter.g, SMOKE_SHADE_INIT_VAR);
-    smokeEmitter.particles[index].b = gaussianRandom(smokeEmitter.b, SMOKE_SHADE_INIT_VAR);
-    smokeEmitter.aliveParticles++;
-    smokeEmitter.particles[index].alpha = gaussianRandom(SMOKE_INIT_ALHPA_MEAN, SMOKE_INIT_ALPHA_VAR);
-    smokeEmitter.particles[index].textureID = smokeEmitter.textures[index % SMOKE_TEXTURE_NUMBER];
+
+
+/******************************************************************************
+* Enforce the particle limit and fit the particle arrays to the number of 
+* particles of each system. Arrays have to hold all particles still alive 
+* (the total may drop below their number, they then die out gradually).
+******************************************************************************/
+void resizeParticles(void)
+{
+  int capacity;
+
+  fountain.totalParticles = limitParticles(fountain.totalParticles);
+  smokeEmitter.totalParticles = limitParticles(smokeEmitter.totalParticles);
+
+  resizeArrays(&waterArrays, fountain.totalParticles > fountain.aliveParticles ? 
+               fountain.totalParticles : fountain.aliveParticles, fountain.aliveParticles);
+  resizeArrays(&smokeArrays, smokeEmitter.totalParticles > smokeEmitter.aliveParticles ? 
+               smokeEmitter.totalParticles : smokeEmitter.aliveParticles, 
+               smokeEmitter.aliveParticles);
+
+  // Scratch arrays follow the larger system, their contents are not kept
+  capacity = fountain.capacity > smokeEmitter.capacity ? fountain.capacity : smokeEmitter.capacity;
+  if (capacity != scratchCapacity) {
+    deathMask = reallocAligned(deathMask, 0, capacity, 1);
+    chunkAlive = reallocAligned(chunkAlive, 0, capacity / PARTICLE_CHUNK_SIZE, sizeof(int));
+    chunkDestination = reallocAligned(chunkDestination, 0, capacity / PARTICLE_CHUNK_SIZE, 
+                                      sizeof(int));
+    scratchCapacity = capacity;
   }
 }
 
 
 
 /******************************************************************************
-* Render the particles
+* ID of the random stream used for chunk "chunk" of an operation ("purpose")
+* in simulation step "step" of the particle system
+******************************************************************************/
+uint64_t chunkStreamID(int purpose, int chunk, unsigned long long step)
+{
+  return (step << 24) | ((uint64_t)chunk << 4) | purpose;
+}
+
+
+
+/******************************************************************************
+* Share a range of new particles among the emitters of a system: the 
+* sampling offset is drawn from a stream of its own, so it does not depend on
+* how the range is split into chunks
 ******************************************************************************/
-void drawParticles() 
+static void shareRange(SpawnRange *range, const EmitterRegistry *sources, int purpose,
+                       unsigned long long step)
+{
+  RandomStream stream;
+
+  seedStream(&stream, randomSeed, chunkStreamID(purpose, 0, step));
+  range->offset = (nextRandom(&stream) >> 11) * (1.0 / 9007199254740992.0);
+  range->spacing = sources->cumulative[sources->activeCount - 1] / (range->last - range->first);
+}
+
+// End of the run of particles from "first" on which share the same emitter
+static int emitterRun(const unsigned short *tags, int first, int last)
 {
   int index;
 
-  /*--------------------------------------------------------------------------
-  * Particles as points
-  *-------------------------------------------------------------------------*/
-  #if RENDERING_METHOD == 1
+  for (index = first + 1; index < last && tags[index] == tags[first]; index++)
+    ;
+  return index;
+}
 
-    // Draw the fountain
-    glBegin (GL_POINTS);
-    glColor3f(WATER_DROP_COLOUR_R , WATER_DROP_COLOUR_G, WATER_DROP_COLOUR_B);
-    for (index = 0; index < fountain.aliveParticles; index++) 
-      glVertex3f(fountain.particles[index].xpos, fountain.particles[index].ypos, fountain.particles[index].zpos);
 
-    // Draw the smoke
-    for (index = 0; index < smokeEmitter.aliveParticles; index++) 
-    {
-      glColor3f(smokeEmitter.particles[index].r, smokeEmitter.particles[index].g, smokeEmitter.particles[index].b);
-      glVertex3f(smokeEmitter.particles[index].xpos, smokeEmitter.particles[index].ypos, smokeEmitter.particles[index].zpos);
-    }
-    glEnd();
-
-  /*--------------------------------------------------------------------------
-  * Water as lines, smoke as point textures
-  *-------------------------------------------------------------------------*/
-  #else
-    // Draw the fountain, join the current position and the future one (determined
-    // by velocity vector by a line)
-    glBegin(GL_LINES);
-    glColor3f(WATER_DROP_COLOUR_R , WATER_DROP_COLOUR_G, WATER_DROP_COLOUR_B);
-    for (index = 0; index < fountain.aliveParticles; index++) 
+
+/******************************************************************************
+* Spawn one chunk of water particles with different horizontal speeds (side 
+* splash) and different vertical speeds. Particles are generated from a single
+* point being the location of their emitter, each run of particles of the
+* same emitter is filled at once.
+******************************************************************************/
+static void spawnWaterChunk(int chunk, void *spawnRange)
+{
+  SpawnRange *range = spawnRange;
+  int index, run, end, first = range->first + chunk * PARTICLE_CHUNK_SIZE;
+  int count = range->last - first < PARTICLE_CHUNK_SIZE ? range->last - first : PARTICLE_CHUNK_SIZE;
+  const Emitter *emitter;
+  RandomStream stream;
+
+  seedStream(&stream, randomSeed, chunkStreamID(STREAM_WATER_SPAWN, chunk, fountain.clock.steps));
+  assignEmitters(&waterSources, fountain.emitter + first, count, 
+                 first - range->first + range->offset, range->spacing);
+  for (run = first; run < first + count; run = end)
+  {
+    end = emitterRun(fountain.emitter, run, first + count);
+    emitter = &waterSources.emitters[fountain.emitter[run]];
+    for (index = run; index < end; index++) 
     {
-      glVertex3f(fountain.particles[index].xpos, fountain.particles[index].ypos, fountain.particles[index].zpos);
-      glVertex3f(fountain.particles[index].xpos + fountain.particles[index].xvel, 
-                 fountain.particles[index].ypos + fountain.particles[index].yvel, 
-                 fountain.particles[index].zpos + fountain.particles[index].zvel);
+      fountain.xpos[index] = fountain.xprev[index] = emitter->position[0];
+      fountain.ypos[index] = fountain.yprev[index] = emitter->position[1];
+      fountain.zpos[index] = fountain.zprev[index] = emitter->position[2];
     }
-    glEnd();
+    fillGaussian(&stream, fountain.xvel + run, end - run, 0.0, emitter->spread);
+    fillGaussian(&stream, fountain.zvel + run, end - run, 0.0, emitter->spread);
+    fillGaussian(&stream, fountain.yvel + run, end - run, emitter->speedMean, emitter->speedVar);
+  }
+}
+
 
 
-    // Draw the smoke. Load the texture depending on particle index, and draw the 
-    // texture with alpha blending
-    glEnable(GL_POINT_SPRITE);
-    glEnable(GL_TEXTURE_2D);
-    for (index = 0; index < smokeEmitter.aliveParticles; index++) 
+/******************************************************************************
+* Spawn one chunk of smoke particles with only vertical speed being nonzero. 
+* Set their initial colour according to the current value of colour parameters 
+* (with some random noise), tinted by their emitter. Particles are generated 
+* from a square area around their emitter with linear distribution.
+******************************************************************************/
+static void spawnSmokeChunk(int chunk, void *spawnRange)
+{
+  SpawnRange *range = spawnRange;
+  int index, run, end, first = range->first + chunk * PARTICLE_CHUNK_SIZE;
+  int count = range->last - first < PARTICLE_CHUNK_SIZE ? range->last - first : PARTICLE_CHUNK_SIZE;
+  const Emitter *emitter;
+  RandomStream stream;
+
+  seedStream(&stream, randomSeed, chunkStreamID(STREAM_SMOKE_SPAWN, chunk, smokeEmitter.clock.steps));
+  assignEmitters(&smokeSources, smokeEmitter.emitter + first, count, 
+                 first - range->first + range->offset, range->spacing);
+  for (run = first; run < first + count; run = end)
+  {
+    end = emitterRun(smokeEmitter.emitter, run, first + count);
+    emitter = &smokeSources.emitters[smokeEmitter.emitter[run]];
+    fillUniform(&stream, smokeEmitter.xpos + run, end - run, emitter->position[0], emitter->spread);
+    fillUniform(&stream, smokeEmitter.zpos + run, end - run, emitter->position[2], emitter->spread);
+    fillGaussian(&stream, smokeEmitter.yvel + run, end - run, emitter->speedMean, emitter->speedVar);
+    fillGaussian(&stream, smokeEmitter.r + run, end - run, smokeEmitter.r0 * emitter->colour[0], 
+                 SMOKE_SHADE_INIT_VAR);
+    fillGaussian(&stream, smokeEmitter.g + run, end - run, smokeEmitter.g0 * emitter->colour[1], 
+                 SMOKE_SHADE_INIT_VAR);
+    fillGaussian(&stream, smokeEmitter.b + run, end - run, smokeEmitter.b0 * emitter->colour[2], 
+                 SMOKE_SHADE_INIT_VAR);
+    fillGaussian(&stream, smokeEmitter.alpha + run, end - run, SMOKE_INIT_ALHPA_MEAN, 
+                 SMOKE_INIT_ALPHA_VAR);
+    for (index = run; index < end; index++) 
     {
-      glBindTexture(GL_TEXTURE_2D, smokeEmitter.particles[index].textureID);
-      glBegin (GL_POINTS);
-      glColor4f(smokeEmitter.particles[index].r, smokeEmitter.particles[index].g, smokeEmitter.particles[index].b, smokeEmitter.particles[index].alpha);
-      glVertex3f(smokeEmitter.particles[index].xpos, smokeEmitter.particles[index].ypos, smokeEmitter.particles[index].zpos);
-      glEnd();
+      smokeEmitter.ypos[index] = emitter->position[1];
+      smokeEmitter.xvel[index] = 0.0;
+      smokeEmitter.zvel[index] = 0.0;
+      smokeEmitter.textureIndex[index] = index % SMOKE_TEXTURE_NUMBER;
     }
-    glDisable(GL_TEXTURE_2D);
-    glDisable(GL_POINT_SPRITE);
+  }
+  memcpy(smokeEmitter.xprev + first, smokeEmitter.xpos + first, count * sizeof(real));
+  memcpy(smokeEmitter.yprev + first, smokeEmitter.ypos + first, count * sizeof(real));
+  memcpy(smokeEmitter.zprev + first, smokeEmitter.zpos + first, count * sizeof(real));
+}
+
+
 
-  #endif
+/******************************************************************************
+* Spawn water particles into the dead slots before "last"
+******************************************************************************/
+static void spawnWaterUpTo(int last) 
+{
+  // Dead particles are stored at the end of array, thus no need for 'alive'
+  // parameter for each particle. Spawning is split into chunks done in parallel
+  SpawnRange range;
+
+  TRACE_BEGIN("spawnWater");
+  range.first = fountain.aliveParticles;
+  range.last = last;
+  if (range.last > range.first && waterSources.activeCount > 0) {
+    shareRange(&range, &waterSources, STREAM_WATER_EMITTERS, fountain.clock.steps);
+    parallelFor((range.last - range.first + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE,
+                spawnWaterChunk, &range);
+    if (options.analyticWater)
+      spawnBallistic(range.first, range.last);
+    fountain.aliveParticles = range.last;
+    simulationMetrics.value[METRIC_SPAWNED] += range.last - range.first;
+  }
+  TRACE_END();
 }
 
 
 
 /******************************************************************************
-* Update the display
+* Spawn smoke particles into the dead slots before "last" (see 
+* spawnWaterUpTo)
 ******************************************************************************/
-void progressTime() 
+static void spawnSmokeUpTo(int last) 
 {
-  int index;
-  double shadeChange;
+  SpawnRange range;
+
+  TRACE_BEGIN("spawnSmoke");
+  range.first = smokeEmitter.aliveParticles;
+  range.last = last;
+  if (range.last > range.first && smokeSources.activeCount > 0) {
+    shareRange(&range, &smokeSources, STREAM_SMOKE_EMITTERS, smokeEmitter.clock.steps);
+    parallelFor((range.last - range.first + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE,
+                spawnSmokeChunk, &range);
+    smokeEmitter.aliveParticles = range.last;
+    simulationMetrics.value[METRIC_SPAWNED] += range.last - range.first;
+  }
+  TRACE_END();
+}
 
-  // Update each water particle parameters. Water particles maintain
-  // their X and Z speeds while the vertical keeps being modified due to
-  // gravity
-  for (index = 0; index < fountain.aliveParticles; index++) 
-  {
-    // if particle falls below the fountain Y coordinate it is killed
-    if (fountain.particles[index].ypos < WATER_FOUNTAIN_Y || fountain.particles[index].ypos > WINDOW_HEIGHT) {
-      fountain.particles[index] = fountain.particles[fountain.aliveParticles - 1];
-      fountain.aliveParticles--;
-    }
-    // Move the particle
-    fountain.particles[index].xpos += fountain.particles[index].xvel;
-    fountain.particles[index].ypos += fountain.particles[index].yvel;
-    fountain.particles[index].zpos += fountain.particles[index].zvel;
-    fountain.particles[index].yvel += WATER_DROP_MASS * gravity;
+
+
+/******************************************************************************
+* Number of particles a system may spawn in a step of "step" seconds, given
+* its total and live particles: the dead ones, at most as many as the 
+* emission rate has made up since the last step and as the frame budget has
+* left. Emission which finds no dead particle to replace is dropped (all but
+* a fraction of a particle), so it cannot be saved up for a burst.
+******************************************************************************/
+static int emitted(Emission *emission, int total, int alive, double step)
+{
+  double rate = emission->rate > 0.0 ? emission->rate : total / EMISSION_RAMP;
+  int count = total - alive;
+
+  emission->owed += rate * step;
+  count = count < emission->owed ? count : (int)emission->owed;
+  count = count > 0 ? count : 0;
+  if (emission->budget >= 0) {
+    count = count < emission->budget ? count : emission->budget;
+    emission->budget -= count;
   }
+  emission->owed = fmin(emission->owed - count, 1.0);
+  return count;
+}
+
+
 
-  // Update each smoke particle parameters. 
-  for (index = 0; index < smokeEmitter.aliveParticles; index++) 
+/******************************************************************************
+* Give both systems options.spawnBudget particles to spawn in the next frame
+* (unlimited if it is 0)
+******************************************************************************/
+void refillSpawnBudget(void)
+{
+  fountain.emission.budget = smokeEmitter.emission.budget = 
+    options.spawnBudget > 0 ? options.spawnBudget : -1;
+}
+
+
+
+/******************************************************************************
+* Fill both particle systems up to their totals at once, regardless of their
+* emission rates
+******************************************************************************/
+void spawnParticles() 
+{
+  resizeParticles();
+  spawnWaterUpTo(fountain.totalParticles);
+  spawnSmokeUpTo(smokeEmitter.totalParticles);
+}
+
+
+
+/******************************************************************************
+* Spawn water particles to replace dead ones, as many as the emission allows
+******************************************************************************/
+void spawnWater(void) 
+{
+  resizeParticles();
+  spawnWaterUpTo(fountain.aliveParticles + emitted(&fountain.emission, fountain.totalParticles, 
+                                                   fountain.aliveParticles, fountain.clock.step));
+}
+
+
+
+/******************************************************************************
+* Spawn smoke particles to replace dead ones (see spawnWater)
+******************************************************************************/
+void spawnSmoke(void) 
+{
+  resizeParticles();
+  spawnSmokeUpTo(smokeEmitter.aliveParticles + 
+                 emitted(&smokeEmitter.emission, smokeEmitter.totalParticles,
+                         smokeEmitter.aliveParticles, smokeEmitter.clock.step));
+}
+
+
+
+/******************************************************************************
+* Count particles of a chunk not flagged in the death mask (no branches, so 
+* the loop can be vectorised)
+******************************************************************************/
+static int countAlive(int first, int count)
+{
+  int index, dead = 0;
+
+  for (index = first; index < first + count; index++)
+    dead += deathMask[index];
+  return count - dead;
+}
+
+
+
+/******************************************************************************
+* Copy the live particles of one chunk to its destination in the spare arrays
+******************************************************************************/
+static void compactChunk(int chunk, void *particleArrays)
+{
+  ParticleArrays *particles = particleArrays;
+  int array, index, written, first = chunk * PARTICLE_CHUNK_SIZE;
+  int count = *particles->alive - first < PARTICLE_CHUNK_SIZE ? 
+              *particles->alive - first : PARTICLE_CHUNK_SIZE;
+  int alive = chunkAlive[chunk], destination = chunkDestination[chunk];
+  const unsigned char *dead = deathMask + first, *bytes;
+  unsigned char *spareBytes;
+  const unsigned short *tags = *particles->tags + first;
+  unsigned short *spareTags = particles->spareTags + destination;
+
+  for (array = 0; array < particles->arrayCount; array++)
   {
-    // if the particle has faded out, kill it
-    if ((smokeEmitter.particles[index].r <= SMOKE_DEATH_THRES && 
-      smokeEmitter.particles[index].g <= SMOKE_DEATH_THRES &&
-      smokeEmitter.particles[index].b <= SMOKE_DEATH_THRES) || 
-      smokeEmitter.particles[index].alpha <= SMOKE_DEATH_THRES) {
-      smokeEmitter.particles[index] = smokeEmitter.particles[smokeEmitter.aliveParticles - 1];
-      smokeEmitter.aliveParticles--;
-    }
+    if (alive == count)
+      memcpy(particles->spare[array] + destination, *particles->arrays[array] + first, 
+             count * sizeof(real));
+    else
+      compactArray(particles->spare[array] + destination, *particles->arrays[array] + first,
+                   dead, count, alive);
+  }
 
-    // Otherwise
-    else {
-      // Move the particle. If smoke hits the ground, make it crawl on it
-      smokeEmitter.particles[index].xpos += smokeEmitter.particles[index].xvel;
-      smokeEmitter.particles[index].zpos += smokeEmitter.particles[index].zvel;
-      smokeEmitter.particles[index].ypos += smokeEmitter.particles[index].yvel;
-      if (smokeEmitter.particles[index].ypos < SMOKE_EMITTER_Y)
-        smokeEmitter.particles[index].ypos = SMOKE_EMITTER_Y;
-  
-      // Apart from minor gravitational force each particle has some chaotic 
-      // movement in every dimension and is affected by the wind (direction and speed)
-      // The vertical chaotic movement is slighlty faster than horizontal one
-      smokeEmitter.particles[index].xvel += gaussianRandom(SMOKE_CHAOS_SPEED_MEAN, smokeEmitter.chaoticSpeed) +
-                                            smokeEmitter.particles[index].ypos * xWind;;
-      smokeEmitter.particles[index].zvel += boxMuller2Rand + smokeEmitter.particles[index].ypos * zWind;
-      smokeEmitter.particles[index].yvel += SMOKE_PARTICLE_MASS * gravity + gaussianRandom(SMOKE_CHAOS_SPEED_MEAN, 
-                                            smokeEmitter.chaoticSpeed * SMOKE_CHAOS_VERTICAL_MUL);
-      
-      // Each particle fades away at slighlty different pace. It both becomes 
-      // darker and more transparent
-      shadeChange = gaussianRandom(SMOKE_SHADE_CHANGE_MEAN, SMOKE_SHADE_CHANGE_VAR);
-      smokeEmitter.particles[index].r -= shadeChange;
-      smokeEmitter.particles[index].g -= shadeChange;
-      smokeEmitter.particles[index].b -= shadeChange;
-      smokeEmitter.particles[index].alpha -= SMOKE_ALPHA_CHANGE;
+  if (particles->bytes) {
+    bytes = *particles->bytes + first;
+    spareBytes = particles->spareBytes + destination;
+    for (index = written = 0; index < count && written < alive; index++)
+    {
+      spareBytes[written] = bytes[index];
+      written += !dead[index];
     }
   }
+
+  for (index = written = 0; index < count && written < alive; index++)
+  {
+    spareTags[written] = tags[index];
+    written += !dead[index];
+  }
 }
 
 
 
 /******************************************************************************
-* Interactive control of the environment using standard keyboard keys
+* Remove dead particles from "chunkCount" updated chunks. Destinations of the
+* chunks are the prefix sums of their live counts, the chunks are compacted 
+* in parallel into the spare arrays which then take the place of the 
+* particle arrays. Returns the number of live particles.
 ******************************************************************************/
-void keyboard(unsigned char key, int x, int y)
+static int compactParticles(ParticleArrays *particles, int chunkCount)
 {
-  switch(key) 
+  int array, chunk, alive = 0;
+  real *swap;
+  unsigned char *swapBytes;
+  unsigned short *swapTags;
+
+  for (chunk = 0; chunk < chunkCount; chunk++)
+  {
+    chunkDestination[chunk] = alive;
+    alive += chunkAlive[chunk];
+  }
+  if (alive == *particles->alive)
+    return alive;
+
+  parallelFor(chunkCount, compactChunk, particles);
+  for (array = 0; array < particles->arrayCount; array++)
   {
-    // Quit the program
-    case 27: exit(0); break;
-    
-    // Decrease and increase the speed of smoke particle movement
-    case 'c': smokeEmitter.chaoticSpeed *= DECREASE_VAL;
-              break; 
-    case 'C': smokeEmitter.chaoticSpeed *= INCREASE_VAL; break; 
-    
-    // Decrease and Increase water particle number
-    case 'f': if (fountain.totalParticles / 2 >= 1)
-                fountain.totalParticles /= 2; 
-              break;
-    case 'F': fountain.totalParticles *= 2; break;
-    
-    // Decrease and Increase smoke particle number
-    case 's': if (smokeEmitter.totalParticles / 2 >= 1)
-                smokeEmitter.totalParticles /= 2; 
-              break;
-    case 'S': smokeEmitter.totalParticles *= 2; break;
-
-    // Decrease and increase the starting red colour component of smoke particle
-    case 'r': if (smokeEmitter.r - SMOKE_COLOUR_CHANGE >= 0.0)
-                smokeEmitter.r -= SMOKE_COLOUR_CHANGE; 
-              break;
-    case 'R': if (smokeEmitter.r + SMOKE_COLOUR_CHANGE <= 1.0)
-                smokeEmitter.r += SMOKE_COLOUR_CHANGE; 
-              break;
-
-    // Decrease and increase the starting green colour component of smoke particle
-    case 'g': if (smokeEmitter.g - SMOKE_COLOUR_CHANGE >= 0.0)
-                smokeEmitter.g -= SMOKE_COLOUR_CHANGE; 
-              break;
-    case 'G': if (smokeEmitter.g + SMOKE_COLOUR_CHANGE <= 1.0)
-                smokeEmitter.g += SMOKE_COLOUR_CHANGE; 
-              break;
-    
-    // Decrease and increase the starting blue colour component of smoke particle
-    case 'b': if (smokeEmitter.b - SMOKE_COLOUR_CHANGE >= 0.0)
-                smokeEmitter.b -= SMOKE_COLOUR_CHANGE; 
-              break;
-    case 'B': if (smokeEmitter.b + SMOKE_COLOUR_CHANGE <= 1.0)
-                smokeEmitter.b += SMOKE_COLOUR_CHANGE; 
-              break;
-
-    // Decrease and increase the wind speed
-    case 'w': windSpeed *= DECREASE_VAL; 
-              computeWind();
-              break;
-    case 'W': windSpeed *= INCREASE_VAL; 
-              computeWind();
-              break;
+    swap = *particles->arrays[array];
+    *particles->arrays[array] = particles->spare[array];
+    particles->spare[array] = swap;
+  }
+  if (particles->bytes) {
+    swapBytes = *particles->bytes;
+    *particles->bytes = particles->spareBytes;
+    particles->spareBytes = swapBytes;
   }
-  glutPostRedisplay();
+  swapTags = *particles->tags;
+  *particles->tags = particles->spareTags;
+  particles->spareTags = swapTags;
+  return alive;
 }
 
 
 
 /******************************************************************************
-* Interactive control of  the enviroment using special keys
+* Bounding box of particle chunks. Ranges of coordinates are collected block
+* by block while the data is still in cache. After compaction each box
+* covers the range of particles its chunk was moved to.
 ******************************************************************************/
-void cursor_keys(int key, int x, int y) 
+typedef struct {
+  real min[3], max[3];
+} Range;
+
+static void emptyRange(Range *range)
+{
+  int axis;
+
+  for (axis = 0; axis < 3; axis++)
+  {
+    range->min[axis] = FLT_MAX;
+    range->max[axis] = -FLT_MAX;
+  }
+}
+
+static void extendRange(Range *range, const real *x, const real *y, const real *z, int count)
 {
-  switch (key) {
-    
-    // Increase and decrease gravitational force
-    case GLUT_KEY_UP: gravity *= DECREASE_VAL; break;
-    case GLUT_KEY_DOWN: gravity *= INCREASE_VAL; break; 
+  arrayRange(x, count, &range->min[0], &range->max[0]);
+  arrayRange(y, count, &range->min[1], &range->max[1]);
+  arrayRange(z, count, &range->min[2], &range->max[2]);
+}
 
-    // Change the wind direction by WIND_DIRECTION_CHANGE degrees
-    case GLUT_KEY_LEFT: 
-      angle += SMOKE_WIND_DIRECTION_CHANGE % 360; 
-      computeWind();
-      break;
+static void storeBounds(ParticleBounds *bounds, const Range *range)
+{
+  int axis;
 
-    case GLUT_KEY_RIGHT: 
-      angle -= SMOKE_WIND_DIRECTION_CHANGE % 360; 
-      computeWind();
-      break;
+  for (axis = 0; axis < 3; axis++)
+  {
+    bounds->min[axis] = range->min[axis];
+    bounds->max[axis] = range->max[axis];
   }
-} // cursor_keys()
+}
+
+static void placeBounds(ParticleBounds *bounds, int chunkCount)
+{
+  int chunk;
+
+  for (chunk = 0; chunk < chunkCount; chunk++)
+  {
+    bounds[chunk].first = chunkDestination[chunk];
+    bounds[chunk].count = chunkAlive[chunk];
+  }
+}
 
 
 
 /******************************************************************************
-* Create manu interface
+* Collisions of one chunk of water drops. Every drop which overlaps another
+* and approaches it loses its share of the relative velocity along the line
+* joining them (equal masses), less what the restitution turns back. Drops
+* only read the velocities from before the step, so the order in which they
+* are processed does not matter. Drops are taken in grid order (entries), 
+* consecutive drops share their neighbourhood and the data of neighbours is
+* read from the copies in grid order.
 ******************************************************************************/
-void createMenu(void) {
-  glutCreateMenu (menu);
-  glutAddMenuEntry ("Reset simulation", 1);
-  glutAddMenuEntry ("", 999);
-  glutAddMenuEntry ("Default view", 2);
-  glutAddMenuEntry ("Fountain view", 3);
-  glutAddMenuEntry ("Smoke view", 4);
-  glutAddMenuEntry ("Fountain top view", 5);
-  glutAddMenuEntry ("Smoke top view", 6);
-  glutAddMenuEntry ("", 999);
-  glutAddMenuEntry ("Quit", 7);
-  glutAttachMenu (GLUT_RIGHT_BUTTON);
+static void gatherVelocityChunk(int chunk, void *unused)
+{
+  int entry, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < waterGrid.count ? 
+             first + PARTICLE_CHUNK_SIZE : waterGrid.count;
+
+  (void)unused;
+  for (entry = first; entry < last; entry++)
+  {
+    collisionVelocity[0][entry] = fountain.xvel[waterGrid.order[entry]];
+    collisionVelocity[1][entry] = fountain.yvel[waterGrid.order[entry]];
+    collisionVelocity[2][entry] = fountain.zvel[waterGrid.order[entry]];
+  }
+}
+
+static void collideWaterChunk(int chunk, void *unused)
+{
+  int entry, index, neighbour, count, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < waterGrid.count ? 
+             first + PARTICLE_CHUNK_SIZE : waterGrid.count;
+  int neighbours[GRID_MAX_NEIGHBOURS], other;
+  const real *x = waterGrid.x, *y = waterGrid.y, *z = waterGrid.z;
+  const real *xvel = collisionVelocity[0], *yvel = collisionVelocity[1];
+  const real *zvel = collisionVelocity[2];
+  real xd, yd, zd, distanceSquared, approach, impulse, xchange, ychange, zchange;
+
+  (void)unused;
+  for (entry = first; entry < last; entry++)
+  {
+    count = gridNeighbours(&waterGrid, x[entry], y[entry], z[entry], 2.0 * WATER_DROP_RADIUS, 
+                           entry, neighbours);
+    xchange = ychange = zchange = 0.0;
+    for (neighbour = 0; neighbour < count; neighbour++)
+    {
+      other = neighbours[neighbour];
+      xd = x[entry] - x[other];
+      yd = y[entry] - y[other];
+      zd = z[entry] - z[other];
+      distanceSquared = xd * xd + yd * yd + zd * zd;
+      approach = (xvel[entry] - xvel[other]) * xd + (yvel[entry] - yvel[other]) * yd + 
+                 (zvel[entry] - zvel[other]) * zd;
+      if (distanceSquared == 0.0 || approach >= 0.0)
+        continue;
+      impulse = -0.5 * (1.0 + WATER_RESTITUTION) * approach / distanceSquared;
+      xchange += impulse * xd;
+      ychange += impulse * yd;
+      zchange += impulse * zd;
+    }
+    index = waterGrid.order[entry];
+    fountain.xvel[index] = xvel[entry] + xchange;
+    fountain.yvel[index] = yvel[entry] + ychange;
+    fountain.zvel[index] = zvel[entry] + zchange;
+  }
+}
+
+static void collideWater(void)
+{
+  int axis, chunks = (fountain.aliveParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+
+  TRACE_BEGIN("collideWater");
+  if (collisionCapacity != fountain.capacity) {
+    for (axis = 0; axis < 3; axis++)
+      collisionVelocity[axis] = reallocAligned(collisionVelocity[axis], 0, fountain.capacity, 
+                                               sizeof(real));
+    collisionCapacity = fountain.capacity;
+  }
+  buildGrid(&waterGrid, fountain.xpos, fountain.ypos, fountain.zpos, fountain.aliveParticles,
+            2.0 * WATER_DROP_RADIUS);
+  parallelFor(chunks, gatherVelocityChunk, NULL);
+  parallelFor(chunks, collideWaterChunk, NULL);
+  TRACE_END();
 }
 
 
 
 /******************************************************************************
-* Create menu entries for changing properties of the particle system
+* Density force on one chunk of smoke particles. Every neighbour closer than
+* SMOKE_SPREAD_RADIUS pushes a particle away, the more the closer it is, so
+* the force grows with the local density. Only positions are read, the 
+* velocity of each particle is changed by its own task. Particles are taken
+* in grid order (see collideWaterChunk).
 ******************************************************************************/
-void menu (int menuentry) {
-  switch (menuentry) 
+static void spreadSmokeChunk(int chunk, void *params)
+{
+  int entry, index, neighbour, count, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < smokeGrid.count ? 
+             first + PARTICLE_CHUNK_SIZE : smokeGrid.count;
+  int neighbours[GRID_MAX_NEIGHBOURS], other;
+  const real *x = smokeGrid.x, *y = smokeGrid.y, *z = smokeGrid.z;
+  real xd, yd, zd, distance, weight, xpush, ypush, zpush;
+  real force = SMOKE_SPREAD_FORCE * ((SmokeStepParams*)params)->timeScale;
+
+  for (entry = first; entry < last; entry++)
   {
-    // Reset parameters to starting values
-    case 1: initParticleSystem(); break;
-    case 2: currentView = &DEFAULT_VEW; break;
-    case 3: currentView = &FOUNTAIN_VIEW; break;
-    case 4: currentView = &SMOKE_VIEW; break;
-    case 5: currentView = &FOUNTAIN_TOP_VIEW; break;
-    case 6: currentView = &SMOKE_TOP_VIEW; break;
-    case 7: exit(0); 
+    count = gridNeighbours(&smokeGrid, x[entry], y[entry], z[entry], SMOKE_SPREAD_RADIUS, 
+                           entry, neighbours);
+    xpush = ypush = zpush = 0.0;
+    for (neighbour = 0; neighbour < count; neighbour++)
+    {
+      other = neighbours[neighbour];
+      xd = x[entry] - x[other];
+      yd = y[entry] - y[other];
+      zd = z[entry] - z[other];
+      distance = sqrt(xd * xd + yd * yd + zd * zd);
+      if (distance == 0.0)
+        continue;
+      weight = 1.0 - distance / SMOKE_SPREAD_RADIUS;
+      weight = weight * weight / distance;
+      xpush += weight * xd;
+      ypush += weight * yd;
+      zpush += weight * zd;
+    }
+    index = smokeGrid.order[entry];
+    smokeEmitter.xvel[index] += force * xpush;
+    smokeEmitter.yvel[index] += force * ypush;
+    smokeEmitter.zvel[index] += force * zpush;
   }
 }
 
+static void spreadSmoke(SmokeStepParams *params)
+{
+  TRACE_BEGIN("spreadSmoke");
+  buildGrid(&smokeGrid, smokeEmitter.xpos, smokeEmitter.ypos, smokeEmitter.zpos, 
+            smokeEmitter.aliveParticles, SMOKE_SPREAD_RADIUS);
+  parallelFor((smokeEmitter.aliveParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE,
+              spreadSmokeChunk, params);
+  TRACE_END();
+}
+
 
 
 /******************************************************************************
-* Reshape function called whenever the application window is reshaped
+* Update one chunk of water particles. Water particles maintain their X and Z 
+* speeds while the vertical keeps being modified due to gravity. If particle 
+* falls below the fountain Y coordinate it is killed
 ******************************************************************************/
-void reshape(int width, int height)
+static void updateWaterChunk(int chunk, void *params)
 {
-  glClearColor(0.0, 0.0, 0.0, 1.0);
-  glViewport(0, 0, (GLsizei)width, (GLsizei)height);
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  gluPerspective(60, (GLfloat)width / (GLfloat)height, 1.0, 10000.0);
-  glMatrixMode(GL_MODELVIEW);
+  int first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < fountain.aliveParticles ? 
+             first + PARTICLE_CHUNK_SIZE : fountain.aliveParticles;
+  int axis, block;
+  WaterBlock water;
+  Range position, velocity;
+
+  emptyRange(&position);
+  emptyRange(&velocity);
+  for (block = first; block < last; block += KERNEL_BLOCK_SIZE)
+  {
+    water.count = last - block < KERNEL_BLOCK_SIZE ? last - block : KERNEL_BLOCK_SIZE;
+    water.xpos = fountain.xpos + block;
+    water.ypos = fountain.ypos + block;
+    water.zpos = fountain.zpos + block;
+    water.xvel = fountain.xvel + block;
+    water.yvel = fountain.yvel + block;
+    water.zvel = fountain.zvel + block;
+    water.dead = deathMask + block;
+    memcpy(fountain.xprev + block, water.xpos, water.count * sizeof(real));
+    memcpy(fountain.yprev + block, water.ypos, water.count * sizeof(real));
+    memcpy(fountain.zprev + block, water.zpos, water.count * sizeof(real));
+    updateWaterBlock(&water, params);
+    extendRange(&position, fountain.xprev + block, fountain.yprev + block, fountain.zprev + block,
+                water.count);
+    extendRange(&position, water.xpos, water.ypos, water.zpos, water.count);
+    extendRange(&velocity, water.xvel, water.yvel, water.zvel, water.count);
+  }
+  chunkAlive[chunk] = countAlive(first, last - first);
+
+  // Lines are drawn from the position along the velocity
+  for (axis = 0; axis < 3; axis++)
+  {
+    position.min[axis] += velocity.min[axis] < 0.0 ? velocity.min[axis] : 0.0;
+    position.max[axis] += velocity.max[axis] > 0.0 ? velocity.max[axis] : 0.0;
+  }
+  storeBounds(&fountain.bounds[chunk], &position);
 }
 
 
 
 /******************************************************************************
-* Implement various camera views
+* Update one chunk of smoke particles. Apart from minor gravitational force 
+* each particle has some chaotic movement in every dimension and is affected 
+* by the wind (direction and speed). The vertical chaotic movement is slighlty 
+* faster than horizontal one. Each particle fades away at slighlty different 
+* pace. It both becomes darker and more transparent, if it has faded out, it 
+* is killed
 ******************************************************************************/
-void setView (void) 
+static void updateSmokeChunk(int chunk, void *params)
 {
-  glMatrixMode(GL_MODELVIEW);
-  glLoadIdentity();
-  gluLookAt(currentView->eyeX, currentView->eyeY, currentView->eyeZ,  
-            currentView->centerX, currentView->centerY, currentView->centerZ,  
-            currentView->upX, currentView->upY, currentView->upZ); 
+  int first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < smokeEmitter.aliveParticles ? 
+             first + PARTICLE_CHUNK_SIZE : smokeEmitter.aliveParticles;
+  int block;
+  SmokeBlock smoke;
+  RandomStream stream;
+  Range position;
+  real xnoise[KERNEL_BLOCK_SIZE] ALIGNED, ynoise[KERNEL_BLOCK_SIZE] ALIGNED;
+  real znoise[KERNEL_BLOCK_SIZE] ALIGNED, shadeChange[KERNEL_BLOCK_SIZE] ALIGNED;
+
+  // Random changes accumulate like a random walk, their spread grows with the
+  // square root of the step length and their mean linearly
+  double timeScale = ((SmokeStepParams*)params)->timeScale;
+  double chaoticSpeed = smokeEmitter.chaoticSpeed * sqrt(timeScale);
+
+  seedStream(&stream, randomSeed, chunkStreamID(STREAM_SMOKE_UPDATE, chunk, smokeEmitter.clock.steps));
+  smoke.xnoise = xnoise;
+  smoke.ynoise = ynoise;
+  smoke.znoise = znoise;
+  smoke.shadeChange = shadeChange;
+  emptyRange(&position);
+  for (block = first; block < last; block += KERNEL_BLOCK_SIZE)
+  {
+    smoke.count = last - block < KERNEL_BLOCK_SIZE ? last - block : KERNEL_BLOCK_SIZE;
+    fillGaussian(&stream, xnoise, smoke.count, SMOKE_CHAOS_SPEED_MEAN * timeScale, chaoticSpeed);
+    fillGaussian(&stream, znoise, smoke.count, SMOKE_CHAOS_SPEED_MEAN * timeScale, chaoticSpeed);
+    fillGaussian(&stream, ynoise, smoke.count, SMOKE_CHAOS_SPEED_MEAN * timeScale, 
+                 chaoticSpeed * SMOKE_CHAOS_VERTICAL_MUL);
+    fillGaussian(&stream, shadeChange, smoke.count, SMOKE_SHADE_CHANGE_MEAN * timeScale, 
+                 SMOKE_SHADE_CHANGE_VAR * sqrt(timeScale));
+    smoke.xpos = smokeEmitter.xpos + block;
+    smoke.ypos = smokeEmitter.ypos + block;
+    smoke.zpos = smokeEmitter.zpos + block;
+    smoke.xvel = smokeEmitter.xvel + block;
+    smoke.yvel = smokeEmitter.yvel + block;
+    smoke.zvel = smokeEmitter.zvel + block;
+    smoke.r = smokeEmitter.r + block;
+    smoke.g = smokeEmitter.g + block;
+    smoke.b = smokeEmitter.b + block;
+    smoke.alpha = smokeEmitter.alpha + block;
+    smoke.dead = deathMask + block;
+    memcpy(smokeEmitter.xprev + block, smoke.xpos, smoke.count * sizeof(real));
+    memcpy(smokeEmitter.yprev + block, smoke.ypos, smoke.count * sizeof(real));
+    memcpy(smokeEmitter.zprev + block, smoke.zpos, smoke.count * sizeof(real));
+    updateSmokeBlock(&smoke, params);
+    extendRange(&position, smokeEmitter.xprev + block, smokeEmitter.yprev + block, 
+                smokeEmitter.zprev + block, smoke.count);
+    extendRange(&position, smoke.xpos, smoke.ypos, smoke.zpos, smoke.count);
+  }
+  chunkAlive[chunk] = countAlive(first, last - first);
+  storeBounds(&smokeEmitter.bounds[chunk], &position);
 }
 
 
 
 /******************************************************************************
-* Return uniformly distributed random double within range [-range,range]
+* Update water particles by one step. Collisions change the velocities first
+* (if enabled, not with analytic trajectories). Chunks of particles are 
+* updated in parallel, then dead particles are removed. Velocities and 
+* accelerations are given per tick, they are scaled by the step length.
 ******************************************************************************/
-double uniformRandom(double range)
+void progressWater(void)
 {
-  return (rand() / (double)RAND_MAX * 2.0 - 1.0) * range; 
+  int chunks, alive = fountain.aliveParticles;
+  WaterStepParams params;
+  double timeScale = fountain.clock.step / SIMULATION_TICK;
+
+  TRACE_BEGIN("progressWater");
+  if (options.analyticWater) {
+    progressBallistic();
+    fountain.boundsCount = 0;
+    simulationMetrics.value[METRIC_KILLED] += alive - fountain.aliveParticles;
+    TRACE_END();
+    return;
+  }
+  params.timeScale = timeScale;
+  params.yAcceleration = WATER_DROP_MASS * gravity * timeScale;
+  params.minY = WATER_FOUNTAIN_Y;
+  params.maxY = WINDOW_HEIGHT;
+  if (options.waterCollisions)
+    collideWater();
+  chunks = (fountain.aliveParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+  parallelFor(chunks, updateWaterChunk, &params);
+  fountain.aliveParticles = compactParticles(&waterArrays, chunks);
+  simulationMetrics.value[METRIC_KILLED] += alive - fountain.aliveParticles;
+  placeBounds(fountain.bounds, chunks);
+  fountain.boundsCount = chunks;
+  fountain.clock.steps++;
+  TRACE_END();
 }
 
 
 
 /******************************************************************************
-* Return gaussian random variable with mean "mean" and standard 
-* deviation "stdDev". Uses two uniform random variables for generation of
-* a normally distributed one (Box-Muller transform)
+* Update smoke particles (see progressWater)
 ******************************************************************************/
-double gaussianRandom(double mean, double stdDev)
+void progressSmoke(void)
 {
-  double uniform1, uniform2, w;
- 
-  do {
-    uniform1 = uniformRandom(1.0);
-    uniform2 = uniformRandom(1.0);
-    w = uniform1 * uniform1 + uniform2 * uniform2;
-  } while ( w >= 1.0 );
-
-  w = sqrt((-2.0 * log(w)) / w);
-  boxMuller2Rand = uniform2 * w * stdDev + mean;
-  return uniform1 * w * stdDev + mean;
+  int chunks, alive = smokeEmitter.aliveParticles;
+  SmokeStepParams params;
+  double timeScale = smokeEmitter.clock.step / SIMULATION_TICK;
+
+  TRACE_BEGIN("progressSmoke");
+  params.timeScale = timeScale;
+  params.yAcceleration = SMOKE_PARTICLE_MASS * gravity * timeScale;
+  params.groundY = SMOKE_EMITTER_Y;
+  params.xWind = xWind * timeScale;
+  params.zWind = zWind * timeScale;
+  params.alphaChange = SMOKE_ALPHA_CHANGE * timeScale;
+  params.deathThreshold = SMOKE_DEATH_THRES;
+  if (options.smokeDensity)
+    spreadSmoke(&params);
+  chunks = (smokeEmitter.aliveParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+  parallelFor(chunks, updateSmokeChunk, &params);
+  smokeEmitter.aliveParticles = compactParticles(&smokeArrays, chunks);
+  simulationMetrics.value[METRIC_KILLED] += alive - smokeEmitter.aliveParticles;
+  placeBounds(smokeEmitter.bounds, chunks);
+  smokeEmitter.boundsCount = chunks;
+  smokeEmitter.clock.steps++;
+  TRACE_END();
 }
 
 
 
 /******************************************************************************
-* Calculate the number of frames per second
+* Advance both particle systems by one step
 ******************************************************************************/
-void calculateFPS()
+void progressTime() 
 {
-  //  Increase frame count
-  frameCount++;
-
-  //  Get the number of milliseconds since glutInit called (or first call
-  //  to glutGet(GLUT ELAPSED TIME)) and calculate time passed
-  currentTime = glutGet(GLUT_ELAPSED_TIME);
-  int timeInterval = currentTime - previousTime;
-
-  if(timeInterval > 1000)
-  {
-    // Calculate the number of frames per second, set the time and reset
-    // the frame count
-    fps = frameCount / (timeInterval / 1000.0f);  
-    previousTime = currentTime;                   
-    frameCount = 0;                         
-  }
+  progressWater();
+  progressSmoke();
 }
 
 
 
 /******************************************************************************
-* Display important characteristics of the simulation
+* Add "seconds" of wall clock time (scaled by options.timeScale) to a clock 
+* and return the number of whole steps to simulate. At most MAX_SUBSTEPS are
+* taken, time beyond that is dropped so that a slow frame does not make the 
+* next one even slower. The remainder sets the interpolation factor used for
+* rendering.
 ******************************************************************************/
-void displayData(void) 
+int clockSteps(SimulationClock *clock, double seconds)
 {
-  glColor3f(1.0, 1.0, 1.0);
-  sprintf(stringBuffer, "FPS: %.2f", fps);
-  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y, stringBuffer);
-  sprintf(stringBuffer, "Water particles: %d", fountain.totalParticles);
-  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 1 * FONT_HEIGHT, stringBuffer);
-  sprintf(stringBuffer, "Smoke particles: %d", smokeEmitter.totalParticles);
-  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 2 * FONT_HEIGHT, stringBuffer);
-  sprintf(stringBuffer, "Gravity: %.2f m/s^2", gravity);
-  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 3 * FONT_HEIGHT, stringBuffer);
-  sprintf(stringBuffer, "Wind speed: %.2f m/s", windSpeed);
-  drawString(GLUT_BITMAP_HELVETICA_12, TEXT_X, TEXT_Y - 4 * FONT_HEIGHT, stringBuffer);
+  int steps = 0;
+
+  clock->accumulator += seconds * options.timeScale;
+  while (clock->accumulator >= clock->step && steps < MAX_SUBSTEPS)
+  {
+    clock->accumulator -= clock->step;
+    steps++;
+  }
+  if (clock->accumulator >= clock->step)
+    clock->accumulator = fmod(clock->accumulator, clock->step);
+  clock->interpolation = clock->accumulator / clock->step;
+  return steps;
 }
 
 
 
 /******************************************************************************
-* Draw string ’str’ in font ’font’, at world (x,y,0)
+* Advance the simulation by "seconds" of wall clock time. Each system runs as
+* many fixed steps as its clock requires, dead particles are replaced before
+* every step (within the spawn budget of the frame). Spawning and updating
+* times are added to simulationMetrics.
 ******************************************************************************/
-void drawString(void* font, float x, float y, char* str) 
+void advanceSimulation(double seconds)
 {
-  char* ch;
-  glRasterPos3f(x, y, 0.0);
-  for (ch = str; *ch; ch++)
-    glutBitmapCharacter(font, (int) *ch);
+  int step, steps;
+  double start, spawned;
+
+  TRACE_BEGIN("advanceSimulation");
+  refillSpawnBudget();
+  steps = clockSteps(&fountain.clock, seconds);
+  for (step = 0; step < steps; step++)
+  {
+    start = wallClock();
+    spawnWater();
+    spawned = wallClock();
+    simulationMetrics.value[METRIC_UPDATED] += fountain.aliveParticles;
+    progressWater();
+    simulationMetrics.value[METRIC_SPAWN] += spawned - start;
+    simulationMetrics.value[METRIC_PROGRESS] += wallClock() - spawned;
+  }
+
+  steps = clockSteps(&smokeEmitter.clock, seconds);
+  for (step = 0; step < steps; step++)
+  {
+    start = wallClock();
+    spawnSmoke();
+    spawned = wallClock();
+    simulationMetrics.value[METRIC_UPDATED] += smokeEmitter.aliveParticles;
+    progressSmoke();
+    simulationMetrics.value[METRIC_SPAWN] += spawned - start;
+    simulationMetrics.value[METRIC_PROGRESS] += wallClock() - spawned;
+  }
+  TRACE_END();
 }
 
 
@@ -562,3 +1092,4 @@ void computeWind(void)
   zWind = SMOKE_PARTICLE_MASS * windSpeed * sin(DEG_TO_RAD * angle) / 10;
 }
 
+
@@ -6,6 +6,8 @@
 * Brief:        Function prototypes and parameters for the particle system 
 *				simulation
 ******************************************************************************/
+#ifndef PARTICLE_SYSTEM_H
+#define PARTICLE_SYSTEM_H
 
 
 
@@ -14,50 +16,102 @@
 ******************************************************************************/
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include <float.h>
-#include "SOIL.h"						// Library for loading textures from files
-
-#ifdef MACOSX							// Include GLUT
-    #include <GLUT/glut.h> 				// MACOSX
-#else
-    #include <GL/glut.h>				// Linux
-#endif
+#include <stdint.h>
 
 
 
 /******************************************************************************
-* Rendering method used
+* Precision of particle data. Single precision halves the memory traffic of 
+* the update and rendering loops, compile with -DDOUBLE_PRECISION to keep 
+* doubles instead. Particle arrays are aligned to cache line size.
 ******************************************************************************/
-#define RENDERING_METHOD 2
+#ifdef DOUBLE_PRECISION
+    typedef double real;
+#else
+    typedef float real;
+#endif
+#define PARTICLE_ALIGNMENT 64
+#define ALIGNED __attribute__((aligned(PARTICLE_ALIGNMENT)))
 
 
 
 /******************************************************************************
 * Simulation parameters
 ******************************************************************************/
-#define POINT_SIZE_TEXTURE 100			// Point size for textured smoke rendering
-#define POINT_SIZE 3					// Point size (non-textured rendering)
 #define WINDOW_WIDTH 1450				// Window size
 #define WINDOW_HEIGHT 800
 #define DEFAULT_GRAVITY -9.81;			// Default gravitational acceleration
-#define MAX_NO_OF_PARTICLES 2000000		// Maximum and default number of 
+#define MAX_NO_OF_PARTICLES 2000000		// Default limit and default number of 
 #define DEFAULT_NO_OF_PARTICLES 1000 	// particles in each particle system
+#define PARTICLE_LIMIT (1 << 28)		// Largest limit accepted by --max-particles
 #define INCREASE_VAL 1.1				// Multipliers for increasing and decreasing
 #define DECREASE_VAL 0.9 				// simulation parameter values
-#define TEXT_X -60						// Starting position of text to draw
-#define TEXT_Y 510
-#define FONT_HEIGHT 12					// Font height (used for drawing multiple lines)
 #define DEG_TO_RAD 0.017453293 			// Degree to radian conversion
 
 
 
+/******************************************************************************
+* Simulation time. Each particle system is advanced in fixed steps of its own
+* length, as many as the elapsed time requires. Particle speeds and rates are
+* given per tick, the step length the simulation parameters were tuned for.
+******************************************************************************/
+#define SIMULATION_TICK (1.0 / 60.0)	// Reference step length in seconds
+#define MAX_SUBSTEPS 8					// Most steps per system and frame, the
+										// rest of the time is dropped
+
+typedef struct {
+	double step;						// Step length in seconds
+	double accumulator;					// Elapsed time not simulated yet
+	double interpolation;				// Rendered state, 0 = previous, 1 = current
+	unsigned long long steps;			// Number of completed steps
+} SimulationClock;
+
+
+
+/******************************************************************************
+* Emission. Dead particles are replaced at most at the emission rate of their
+* system, so that a system grows to a larger total (or refills after a 
+* reset) over several frames instead of in one. A frame budget can cap the
+* particles spawned in one frame as well.
+******************************************************************************/
+#define EMISSION_RAMP 0.25				// Default rate refills an empty system in
+										// this many simulated seconds
+
+typedef struct {
+	double rate;						// New particles per simulated second
+										// (0 = totalParticles / EMISSION_RAMP)
+	double owed;						// Particles made up by the rate and not
+										// spawned yet (at most one when full)
+	int budget;							// Particles left to spawn in this frame
+										// (-1 = unlimited)
+} Emission;
+
+
+
+/******************************************************************************
+* Bounding box of particles [first, first + count) after the last step, for
+* culling. It holds the last two positions of the particles, for water also
+* the end points of the drawn lines (position + velocity).
+******************************************************************************/
+typedef struct {
+	float min[3];
+	float max[3];
+	int first;
+	int count;
+} ParticleBounds;
+
+
+
 /******************************************************************************
 * Waterdrop and water definitions
 ******************************************************************************/
 
-// Constant parameters
+// Constant parameters, the first four describe the default fountain (see
+// emitter.h), drops die below WATER_FOUNTAIN_Y
 #define WATER_FOUNTAIN_X -250.0 		// Fountain location
 #define WATER_FOUNTAIN_Y 0.0
 #define WATER_FOUNTAIN_Z 0.0
@@ -68,18 +122,30 @@
 #define WATER_DROP_COLOUR_G 0.71
 #define WATER_DROP_COLOUR_B 1.0
 #define WATER_DROP_MASS 0.03			// Water particle mass, controls the impact of gravity
+#define WATER_DROP_RADIUS 1.0			// Drops closer than twice this collide
+#define WATER_RESTITUTION 0.5			// Share of approach speed turned back by a collision
 
-// Waterdrop
-typedef struct {
-    double xpos, ypos, zpos;   			// Position
-    double xvel, yvel, zvel;   			// Velocity
-} Waterdrop;
-
-// Water
+// Water, particle data kept as structure of arrays so that the update and
+// rendering loops only stream through the fields they actually touch. The 
+// arrays live on the heap and are resized by resizeParticles()
 typedef struct {
-	Waterdrop particles[MAX_NO_OF_PARTICLES];	// Array of particles
+	real *xpos;							// Position
+	real *ypos;
+	real *zpos;
+	real *xvel;							// Velocity
+	real *yvel;
+	real *zvel;
+	real *xprev;						// Position before the last step
+	real *yprev;
+	real *zprev;
+	unsigned short *emitter;			// Emitter which spawned each drop
 	int totalParticles; 				// Current total number of particles
 	int aliveParticles; 				// Current number of alive particles
+	int capacity;						// Number of particles the arrays can hold
+	ParticleBounds *bounds;				// Bounds of each chunk updated in the last
+	int boundsCount;					// step, in order of their particles
+	SimulationClock clock;				// Time step of the fountain
+	Emission emission;					// Rate of new drops
 } Water;
 
 
@@ -88,7 +154,8 @@ typedef struct {
 * Smoke particle and smoke definitions
 ******************************************************************************/
 
-// Constant parameters
+// Constant parameters, the first six describe the default smoke source (see
+// emitter.h), smoke does not sink below SMOKE_EMITTER_Y
 #define SMOKE_EMITTER_X 250.0			// Smoke emitter location
 #define SMOKE_EMITTER_Y 0.0
 #define SMOKE_EMITTER_Z 0.0
@@ -112,174 +179,149 @@ typedef struct {
 #define SMOKE_WIND_DIRECTION_CHANGE 10 	// Delta angle of the wind after key press	
 #define SMOKE_WIND_INIT_SPEED 0.1		// Initial wind speed and direction (angle)
 #define SMOKE_WIND_INIT_DIRECTION 90.0		
+#define SMOKE_SPREAD_RADIUS 10.0		// Reach of the density force (--smoke-density)
+#define SMOKE_SPREAD_FORCE 0.0005		// Its acceleration per tick and close neighbour
+#define SMOKE_VOLUME_THRESHOLD 250000	// Sprites drawn as a density volume above this
 
-// Smoke particle 
-typedef struct {
-    double xpos, ypos, zpos;   			// Position
-    double xvel, yvel, zvel;   			// Velocity
-    double r, g, b, alpha;   			// Current particle colour and aplha value
-    int textureID;                      // ID of the texture applied to the particle
-} SmokeParticle;
-
-// Smoke 
+// Smoke, particle data kept as structure of arrays (see Water)
 typedef struct {
-	SmokeParticle particles[MAX_NO_OF_PARTICLES];	// Array of particles
+	real *xpos;							// Position
+	real *ypos;
+	real *zpos;
+	real *xvel;							// Velocity
+	real *yvel;
+	real *zvel;
+	real *xprev;						// Position before the last step
+	real *yprev;
+	real *zprev;
+	real *r;							// Current particle colour and alpha value
+	real *g;
+	real *b;
+	real *alpha;
+	unsigned char *textureIndex;		// Smoke texture atlas cell
+	unsigned short *emitter;			// Emitter which spawned each particle
 	int totalParticles; 				// Current total number of particle
 	int aliveParticles; 				// Current number of alive particles
-	double r;							// Smoke initial colour
-	double g;
-	double b;
+	int capacity;						// Number of particles the arrays can hold
+	ParticleBounds *bounds;				// Bounds of chunks (see Water)
+	int boundsCount;
+	SimulationClock clock;				// Time step of the smoke
+	Emission emission;					// Rate of new particles
+	double r0;							// Smoke initial colour
+	double g0;
+	double b0;
 	double chaoticSpeed;				// Speed of chaotic movement
-	int textures[SMOKE_TEXTURE_NUMBER];	// Array of smoke texture IDs
 } Smoke;
 
 
 
 /******************************************************************************
-* Particle systems declaration
+* Parallel update. Particle arrays are split into chunks of fixed size, each
+* chunk is spawned and updated by one thread using its own random stream.
 ******************************************************************************/
-Water fountain;
-Smoke smokeEmitter;
+#define PARTICLE_CHUNK_SIZE 16384		// Must be a multiple of KERNEL_BLOCK_SIZE
+#define STREAM_WATER_SPAWN 1			// Random stream purposes
+#define STREAM_SMOKE_SPAWN 2
+#define STREAM_SMOKE_UPDATE 3
+#define STREAM_WATER_EMITTERS 4
+#define STREAM_SMOKE_EMITTERS 5
+#define STREAM_WATER_PREWARM 6
+#define STREAM_SMOKE_PREWARM 7
 
 
 
 /******************************************************************************
-* Current value of gravity acceleration
-******************************************************************************/		     
-double gravity;
-
-
-
-/******************************************************************************
-* Global vaiables for wind effect simulation
-******************************************************************************/
-int angle;
-double windSpeed, xWind, zWind;
-
-
-/******************************************************************************
-* Camera views
+* Particle systems declaration
 ******************************************************************************/
-
-// Camera view definition
-typedef struct {
-	double eyeX, eyeY, eyeZ;            // position of camera
-    double centerX, centerY, centerZ;   // point at which camera looks
-    double upX, upY, upZ;               // "up" direction of camera
-} CameraView;
-
-
-// General view, shows both the fountain an smoke emitter together with parameter values
-CameraView DEFAULT_VEW = {
-    .eyeX = 0.0,
-    .eyeY = 240.0,
-    .eyeZ = 500.0,
-    .centerX = 0.0,
-    .centerY = 240.0,
-    .centerZ = 0.0,
-    .upX = 0.0,
-    .upY = 1.0,
-    .upZ = 0.0
-};
-
-// Only fountain shown
-CameraView FOUNTAIN_VIEW = {
-    .eyeX = WATER_FOUNTAIN_X + 400,
-    .eyeY = WATER_FOUNTAIN_Y,
-    .eyeZ = WATER_FOUNTAIN_Z,
-    .centerX = WATER_FOUNTAIN_X,
-    .centerY = WATER_FOUNTAIN_Y + 200,
-    .centerZ = WATER_FOUNTAIN_Z,
-    .upX = 0.0,
-    .upY = 1.0,
-    .upZ = 0.0
-};
-
-// Only smoke shown
-CameraView SMOKE_VIEW = {
-    .eyeX = SMOKE_EMITTER_X - 400,
-    .eyeY = SMOKE_EMITTER_Y,
-    .eyeZ = SMOKE_EMITTER_Z,
-    .centerX = SMOKE_EMITTER_X,
-    .centerY = SMOKE_EMITTER_Y + 200,
-    .centerZ = SMOKE_EMITTER_Z,
-    .upX = 0.0,
-    .upY = 1.0,
-    .upZ = 0.0
-};
-
-// View of the fountain from above
-CameraView FOUNTAIN_TOP_VIEW = {
-    .eyeX = WATER_FOUNTAIN_X,
-    .eyeY = 600,
-    .eyeZ = WATER_FOUNTAIN_Z,
-    .centerX = WATER_FOUNTAIN_X,
-    .centerY = WATER_FOUNTAIN_Y,
-    .centerZ = WATER_FOUNTAIN_Z,
-    .upX = 0.0,
-    .upY = 0.0,
-    .upZ = 1.0
-};
-
-// View of the smoke from above
-CameraView SMOKE_TOP_VIEW = {
-    .eyeX = SMOKE_EMITTER_X,
-    .eyeY = 600,
-    .eyeZ = SMOKE_EMITTER_Z,
-    .centerX = SMOKE_EMITTER_X,
-    .centerY = SMOKE_EMITTER_Y,
-    .centerZ = SMOKE_EMITTER_Z,
-    .upX = 0.0,
-    .upY = 0.0,
-    .upZ = 1.0
-};
-
-// Current view
-CameraView *currentView;
+extern Water fountain;
+extern Smoke smokeEmitter;
 
 
 
 /******************************************************************************
-* Global variables for calculation of Frame Rate
-******************************************************************************/
-int frameCount, currentTime, previousTime;
-double fps;
+* Current value of gravity acceleration
+******************************************************************************/		     
+extern double gravity;
 
 
 
 /******************************************************************************
-* String buffer for displaying performance data
+* Global vaiables for wind effect simulation
 ******************************************************************************/
-char stringBuffer[50];
-
+extern int angle;
+extern double windSpeed, xWind, zWind;
 
 
 /******************************************************************************
-* Second random number generated using Box-Muller transform (used for 
-* improved performance)
+* Command line options (see main.c)
 ******************************************************************************/
-double boxMuller2Rand;
+typedef struct {
+	uint64_t seed;						// Seed of the random number generators
+	int threads;						// Number of simulation threads
+	int headless;						// Run without graphics
+	int steps;							// Number of headless simulation steps
+	int waterParticles;					// Initial number of particles
+	int smokeParticles;
+	int waterEmitters;					// Number of emitters on the default grids
+	int smokeEmitters;
+	int maxParticles;					// Limit of particles in each system
+	double waterTimeStep;				// Step lengths in seconds
+	double smokeTimeStep;
+	double timeScale;					// Simulated seconds per wall clock second
+	int clientArrays;					// Render from client memory, not buffer objects
+	int analyticWater;					// Closed-form water trajectories (ballistic.c)
+	int pipeline;						// Simulate the next frame while drawing
+	int depthSort;						// Draw smoke sprites back to front
+	int smokeVolume;					// Draw smoke as a volume above this many
+										// sprites (0 = never)
+	int waterCollisions;				// Water drops bounce off each other
+	int smokeDensity;					// Dense smoke spreads out
+	const char *metricsFile;			// Periodic metrics dumps (NULL = none)
+	const char *traceFile;				// Timeline trace (NULL = no tracing)
+	const char *snapshotFile;			// Snapshot saved and restored by keys
+	const char *restoreFile;			// Snapshot to start from (NULL = none)
+	const char *recordFile;				// Input recording (NULL = none)
+	const char *replayFile;				// Recording to replay (NULL = none)
+	int prewarm;						// Start in steady state (prewarm.c)
+	double prewarmTime;					// Simulated seconds to fast-forward
+	double waterRate;					// Emission rates (0 = default, see
+	double smokeRate;					// Emission)
+	int spawnBudget;					// Most particles spawned per frame and
+										// system (0 = unlimited)
+	double targetFrameTime;				// Frame time the particle totals are
+										// adjusted to (0 = fixed, budget.c)
+	int minParticles;					// Lower bound of adjusted totals
+	double waterWeight;					// Shares of the adjustments
+	double smokeWeight;
+	const char *captureDir;				// Offscreen capture to images (NULL =
+										// window, see capture.c)
+	int captureWidth;					// Size of the captured images
+	int captureHeight;
+	int captureRaw;						// PPM images instead of PNG
+	int captureThreads;					// Number of image encoders
+} Options;
+
+extern Options options;
 
 
 
 /******************************************************************************
 * Function prototypes
 ******************************************************************************/
-double uniformRandom(double);			// Uniform random variable generator
-double gaussianRandom(double, double);	// Gaussian random variable generator
+void parseArguments(int, char *argv[]);	// Parse command line options
 void initParticleSystem(void); 			// Initialise the particle system
-void spawnParticles(void); 				// Spawn particles 
-void drawParticles(void); 				// Render particles
+void spawnParticles(void); 				// Fill both systems, ignoring emission rates
+void spawnWater(void);					// Spawn water particles only
+void spawnSmoke(void);					// Spawn smoke particles only
+void refillSpawnBudget(void);			// Start the spawn budget of a frame
+int limitParticles(int);				// Clamp particle count to [1, options.maxParticles]
+void resizeParticles(void);				// Fit particle arrays to the particle counts
 void progressTime(void); 				// Update particle parameters according to the laws 
-void display(void); 					// OpenGL callback function
-void setView (void);					// Implement various camera views
-void keyboard(unsigned char, int, int); // Keyboard callback function
-void cursor_keys(int, int, int);  		// Special keys callback function
-void reshape(int, int); 				// Window reshape callback function
-void initGraphics(int, char *argv[]); 	// OpenGL initialisation function
-void calculateFPS(void); 				// Calculate the number of frames per second
-void drawString (void*, float, float, char*); // Draw string on screen
-void displayData(void); 				// Display simulation parameters
+int clockSteps(SimulationClock*, double); // Number of steps to take for elapsed time
+void advanceSimulation(double);			// Advance both systems by elapsed wall time
+void progressWater(void);				// Update water particles only
+void progressSmoke(void);				// Update smoke particles only
 void computeWind(void);					// Calculate wind vector
-void createMenu(void);                  // Create menu interface
-void menu(int);                         // Create menu entries
+uint64_t chunkStreamID(int, int, unsigned long long); // Random stream of a chunk
+
+#endif
@@ -0,0 +1,174 @@
+/******************************************************************************
+* File:         pipeline.c
+* Brief:        Simulation of the next frame overlapped with drawing
+*
+* Note:
+* Frame N is drawn from the front frame while a simulation thread advances
+* the particle systems and packs frame N+1 into the back frame (the global
+* render buffers). nextFrame() is the frame fence: it waits for the
+* simulation thread, swaps the frames and hands the simulation thread the
+* next frame before returning the new front frame for drawing. Frames are
+* therefore shown one frame late, in exchange the cheaper of simulating and
+* drawing is hidden behind the other one.
+*
+* Particle systems may only be touched by other threads while the simulation
+* thread is idle, code changing them (user input) calls waitFrame() first.
+* With --no-pipeline frames are simulated by the calling thread instead.
+******************************************************************************/
+#include <pthread.h>
+#include "pipeline.h"
+#include "headless.h"
+#include "trace.h"
+#include "input.h"
+#include "budget.h"
+
+
+
+/******************************************************************************
+* Pipeline state
+******************************************************************************/
+static Frame front, back;
+
+// Frame requested from the simulation thread
+static struct {
+  double elapsed;                       // Wall clock time to simulate
+  double frameTime;                     // Measured time of the last frame (budget.c)
+  int waterLines;
+  int sprites;                          // Nonzero if "billboard" is used
+  Billboard billboard;
+  int culled;                           // Nonzero if "frustum" is used
+  Frustum frustum;
+} request;
+
+static pthread_t simulationThread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frameRequested = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t frameDone = PTHREAD_COND_INITIALIZER;
+static int busy;                        // Request posted and not finished
+static int started;
+
+
+
+/******************************************************************************
+* Advance the simulation and pack the back frame, the metrics of both go with
+* the frame
+******************************************************************************/
+static void simulateFrame(void)
+{
+  double start;
+
+  TRACE_BEGIN("simulateFrame");
+  controlBudget(request.frameTime);
+  recordElapsed(request.elapsed);
+  advanceSimulation(request.elapsed);
+  start = wallClock();
+  TRACE_BEGIN("prepareRenderBuffers");
+  prepareRenderBuffers(request.waterLines, request.sprites ? &request.billboard : NULL,
+                       request.culled ? &request.frustum : NULL);
+  TRACE_END();
+  simulationMetrics.value[METRIC_PACK] = wallClock() - start;
+  back.metrics = simulationMetrics;
+  memset(&simulationMetrics, 0, sizeof(simulationMetrics));
+  back.waterParticles = fountain.totalParticles;
+  back.smokeParticles = smokeEmitter.totalParticles;
+  back.gravity = gravity;
+  back.windSpeed = windSpeed;
+  TRACE_END();
+}
+
+
+
+/******************************************************************************
+* Simulation thread main loop
+******************************************************************************/
+static void *simulationLoop(void *unused)
+{
+  (void)unused;
+  traceThread("simulation", -1);
+  pthread_mutex_lock(&lock);
+  for (;;)
+  {
+    while (!busy)
+      pthread_cond_wait(&frameRequested, &lock);
+    pthread_mutex_unlock(&lock);
+    simulateFrame();
+    pthread_mutex_lock(&lock);
+    busy = 0;
+    pthread_cond_broadcast(&frameDone);
+  }
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Wait until the simulation thread has finished its frame
+******************************************************************************/
+void waitFrame(void)
+{
+  pthread_mutex_lock(&lock);
+  while (busy)
+    pthread_cond_wait(&frameDone, &lock);
+  pthread_mutex_unlock(&lock);
+}
+
+
+
+/******************************************************************************
+* Swap the back frame (global render buffers) with the front frame
+******************************************************************************/
+static void swapFrames(void)
+{
+  RenderBuffers buffers = front.buffers;
+
+  back.buffers = renderBuffers;
+  front = back;
+  renderBuffers = buffers;
+}
+
+
+
+/******************************************************************************
+* Frame fence. Returns the frame to draw and starts simulating the next one,
+* "elapsed" seconds of wall clock time later. "frameTime" is the measured
+* time of the last frame, the particle budget follows it (budget.c). Render
+* buffers are packed as by prepareRenderBuffers(), smoke as points if
+* "billboard" is NULL and without culling if "frustum" is NULL.
+******************************************************************************/
+const Frame *nextFrame(double elapsed, double frameTime, int waterLines,
+                       const Billboard *billboard, const Frustum *frustum)
+{
+  waitFrame();
+  request.elapsed = elapsed;
+  request.frameTime = frameTime;
+  request.waterLines = waterLines;
+  request.sprites = billboard != NULL;
+  if (billboard)
+    request.billboard = *billboard;
+  request.culled = frustum != NULL;
+  if (frustum)
+    request.frustum = *frustum;
+
+  // Without pipelining the new frame is drawn right away
+  if (!options.pipeline) {
+    simulateFrame();
+    swapFrames();
+    return &front;
+  }
+
+  if (!started) {
+    if (pthread_create(&simulationThread, NULL, simulationLoop, NULL)) {
+      fprintf(stderr, "Could not start simulation thread, pipelining disabled\n");
+      options.pipeline = 0;
+      return nextFrame(elapsed, frameTime, waterLines, billboard, frustum);
+    }
+    started = 1;
+  }
+
+  swapFrames();
+  pthread_mutex_lock(&lock);
+  busy = 1;
+  pthread_cond_signal(&frameRequested);
+  pthread_mutex_unlock(&lock);
+  return &front;
+}
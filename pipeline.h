@@ -0,0 +1,34 @@
+/******************************************************************************
+* File:         pipeline.h
+* Brief:        Simulation of the next frame overlapped with drawing
+******************************************************************************/
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "renderBuffer.h"
+#include "metrics.h"
+
+
+
+/******************************************************************************
+* Everything needed to draw one simulated frame. Frames are double-buffered:
+* the front frame is drawn while the back frame is being simulated.
+******************************************************************************/
+typedef struct {
+    RenderBuffers buffers;              // Packed particles
+    int waterParticles;                 // Parameters shown with the frame
+    int smokeParticles;
+    double gravity;
+    double windSpeed;
+    FrameMetrics metrics;               // Spawning, updating and packing it
+} Frame;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+const Frame *nextFrame(double, double, int, const Billboard*, const Frustum*); // Swap frames, simulate the next one
+void waitFrame(void);                   // Fence, wait for the simulation to be idle
+
+#endif
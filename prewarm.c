@@ -0,0 +1,279 @@
+/******************************************************************************
+* File:         prewarm.c
+* Brief:        Start the particle systems in their steady state
+*
+* Note:
+* Spawned from empty, a system starts with all its particles at the emitters
+* and takes a whole particle lifetime to settle, dying and being replaced in
+* waves meanwhile. Instead, prewarmParticles() spawns all particles and gives
+* each one an age drawn uniformly from its own lifetime, which is how the
+* particles of a system that has run for long are spread, then moves it to
+* the state it has at that age:
+*
+* Water drops follow closed-form trajectories (ballistic.h), their state is
+* exact up to rounding. With --analytic-water only their births change.
+*
+* Smoke moves in a random walk. The sums of the random changes over the age
+* are drawn directly from their gaussian distributions: the fade, and for
+* every axis the velocity change with the position change it causes (which
+* are correlated). Wind is applied along the mean path. Ages at which the
+* particle has faded out are rejected and drawn again.
+*
+* Interactions (--water-collisions, --smoke-density) are not sampled. With
+* --prewarm-time S both systems are then fast-forwarded by S simulated
+* seconds with ordinary steps before the first frame, which settles them as
+* well. The budget is simulated time rather than wall clock time, so the
+* state reached does not depend on the speed of the machine and recordings
+* replay it exactly. Ages are drawn per chunk of particles, in parallel, each
+* chunk from its own random stream.
+******************************************************************************/
+#include "particleSystem.h"
+#include "rng.h"
+#include "threadPool.h"
+#include "ballistic.h"
+#include "metrics.h"
+#include "trace.h"
+#include "prewarm.h"
+
+
+
+/******************************************************************************
+* Parameters of one step of a system, changes are per step
+******************************************************************************/
+typedef struct {
+  double timeScale;                     // Step length in ticks
+  double acceleration;                  // Vertical velocity change (gravity)
+  double noiseMean, noise;              // Smoke chaotic velocity change
+  double verticalNoise;
+  double shadeMean, shadeNoise;         // Smoke fade
+  double alphaChange;
+  double xWind, zWind;                  // Wind per unit of height
+} StepParams;
+
+
+
+/******************************************************************************
+* Draw a whole age in [0, life) from a uniform variate
+******************************************************************************/
+static double drawAge(RandomStream *stream, double life)
+{
+  real u;
+
+  if (!(life > 1.0) || isinf(life))
+    return 0.0;
+  fillUniform(stream, &u, 1, 0.5, 0.5);
+  return fmin(floor(u * life), ceil(life) - 1.0);
+}
+
+
+
+/******************************************************************************
+* Age one chunk of water drops. The closed form is the one of ballistic.h,
+* the previous position is the one a step earlier.
+******************************************************************************/
+static void ageWaterChunk(int chunk, void *stepParams)
+{
+  const StepParams *params = stepParams;
+  int index, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < fountain.aliveParticles ?
+             first + PARTICLE_CHUNK_SIZE : fountain.aliveParticles;
+  double h = params->timeScale, a = params->acceleration, n, m;
+  RandomStream stream;
+
+  seedStream(&stream, randomSeed, chunkStreamID(STREAM_WATER_PREWARM, chunk, fountain.clock.steps));
+  for (index = first; index < last; index++)
+  {
+    n = drawAge(&stream, dropLifetime(index, h, a));
+    if (options.analyticWater) {
+      trajectories.birth[index] -= n;
+      continue;
+    }
+    m = n > 0.0 ? n - 1.0 : 0.0;
+    fountain.xprev[index] = fountain.xpos[index] + h * m * fountain.xvel[index];
+    fountain.yprev[index] = fountain.ypos[index] + h * (m * fountain.yvel[index] +
+                            0.5 * a * m * (m - 1.0));
+    fountain.zprev[index] = fountain.zpos[index] + h * m * fountain.zvel[index];
+    fountain.xpos[index] += h * n * fountain.xvel[index];
+    fountain.ypos[index] += h * (n * fountain.yvel[index] + 0.5 * a * n * (n - 1.0));
+    fountain.zpos[index] += h * n * fountain.zvel[index];
+    fountain.yvel[index] += a * n;
+  }
+}
+
+
+
+/******************************************************************************
+* Sums of the random walk of one axis of a smoke particle over "k" steps with
+* velocity change of standard deviation "noise" per step, from two unit
+* gaussian variates. The velocity changes by the sum of the changes, the
+* position by the step length times sum of the velocity changes in the steps
+* before each step (weights k-1, ..., 1).
+******************************************************************************/
+static void walkSums(double k, double h, double noise, const real *z, double *velocity,
+                     double *position)
+{
+  *velocity = noise * sqrt(k) * z[0];
+  *position = k > 1.0 ? noise * h * (0.5 * (k - 1.0) * sqrt(k) * z[0] +
+                        sqrt(k * (k - 1.0) * (k + 1.0) / 12.0) * z[1]) : 0.0;
+}
+
+// Sums of j^1, j^2 and j^3 over j = 1..n
+static void powerSums(double n, double *sum)
+{
+  sum[0] = 0.5 * n * (n + 1.0);
+  sum[1] = n * (n + 1.0) * (2.0 * n + 1.0) / 6.0;
+  sum[2] = sum[0] * sum[0];
+}
+
+
+
+/******************************************************************************
+* Age one smoke particle by "k" steps. The mean height after step j is
+* y0 + c1*j + c2*j^2, the wind adds height times wind to the velocity after
+* every step.
+******************************************************************************/
+static void ageSmokeParticle(int index, double k, const StepParams *params, const real *z)
+{
+  double h = params->timeScale, mean = params->noiseMean;
+  double ay = params->acceleration + mean, vx, vy, vz, xchange, ychange, zchange;
+  double c1 = h * (smokeEmitter.yvel[index] - 0.5 * ay), c2 = 0.5 * h * ay;
+  double y0 = smokeEmitter.ypos[index], m = k - 1.0, heights, weighted, all[3], before[3];
+  double drift = 0.5 * h * k * (k - 1.0);
+
+  // Summed heights after steps 1..k and weighted (k-j) over steps 1..k-1
+  powerSums(k, all);
+  powerSums(m > 0.0 ? m : 0.0, before);
+  heights = y0 * k + c1 * all[0] + c2 * all[1];
+  weighted = m > 0.0 ? k * (y0 * m + c1 * before[0] + c2 * before[1]) -
+                       (y0 * before[0] + c1 * before[1] + c2 * before[2]) : 0.0;
+
+  walkSums(k, h, params->noise, z, &vx, &xchange);
+  walkSums(k, h, params->noise, z + 2, &vz, &zchange);
+  walkSums(k, h, params->verticalNoise, z + 4, &vy, &ychange);
+  smokeEmitter.xpos[index] += h * smokeEmitter.xvel[index] * k + mean * drift + xchange +
+                              h * params->xWind * weighted;
+  smokeEmitter.zpos[index] += h * smokeEmitter.zvel[index] * k + mean * drift + zchange +
+                              h * params->zWind * weighted;
+  smokeEmitter.ypos[index] += h * smokeEmitter.yvel[index] * k + ay * drift + ychange;
+  smokeEmitter.xvel[index] += mean * k + vx + params->xWind * heights;
+  smokeEmitter.zvel[index] += mean * k + vz + params->zWind * heights;
+  smokeEmitter.yvel[index] += ay * k + vy;
+  if (smokeEmitter.ypos[index] < SMOKE_EMITTER_Y)
+    smokeEmitter.ypos[index] = SMOKE_EMITTER_Y;
+}
+
+
+
+/******************************************************************************
+* Age one chunk of smoke particles. The age is drawn up to the step in which
+* the alpha value fades out, and no further than the fade of the colour is
+* likely to go; it is rejected if the colour has faded out by then.
+******************************************************************************/
+static void ageSmokeChunk(int chunk, void *stepParams)
+{
+  const StepParams *params = stepParams;
+  int index, tries, first = chunk * PARTICLE_CHUNK_SIZE;
+  int last = first + PARTICLE_CHUNK_SIZE < smokeEmitter.aliveParticles ?
+             first + PARTICLE_CHUNK_SIZE : smokeEmitter.aliveParticles;
+  double h = params->timeScale, mu = params->shadeMean, sigma = params->shadeNoise;
+  double shade, life, reach, k;
+  real fade, z[6];
+  RandomStream stream;
+
+  seedStream(&stream, randomSeed, chunkStreamID(STREAM_SMOKE_PREWARM, chunk,
+                                                smokeEmitter.clock.steps));
+  for (index = first; index < last; index++)
+  {
+    shade = fmax(fmax(smokeEmitter.r[index], smokeEmitter.g[index]), smokeEmitter.b[index]) -
+            SMOKE_DEATH_THRES;
+    life = (smokeEmitter.alpha[index] - SMOKE_DEATH_THRES) / params->alphaChange;
+    if (mu > 0.0 && shade > 0.0) {
+      // k*mu - PREWARM_SHADE_SPREAD*sigma*sqrt(k) = shade, solved for sqrt(k)
+      reach = (PREWARM_SHADE_SPREAD * sigma + sqrt(PREWARM_SHADE_SPREAD * PREWARM_SHADE_SPREAD *
+               sigma * sigma + 4.0 * mu * shade)) / (2.0 * mu);
+      life = fmin(life, reach * reach);
+    }
+
+    k = fade = 0.0;
+    for (tries = 0; tries < PREWARM_TRIES; tries++)
+    {
+      k = drawAge(&stream, life);
+      fillGaussian(&stream, &fade, 1, k * mu, sqrt(k) * sigma);
+      if (shade - fade > 0.0)
+        break;
+      k = fade = 0.0;
+    }
+    if (k == 0.0)
+      continue;
+
+    fillGaussian(&stream, z, 6, 0.0, 1.0);
+    ageSmokeParticle(index, k, params, z);
+    smokeEmitter.r[index] -= fade;
+    smokeEmitter.g[index] -= fade;
+    smokeEmitter.b[index] -= fade;
+    smokeEmitter.alpha[index] -= k * params->alphaChange;
+    smokeEmitter.xprev[index] = smokeEmitter.xpos[index] - h * smokeEmitter.xvel[index];
+    smokeEmitter.yprev[index] = fmax(smokeEmitter.ypos[index] - h * smokeEmitter.yvel[index],
+                                     SMOKE_EMITTER_Y);
+    smokeEmitter.zprev[index] = smokeEmitter.zpos[index] - h * smokeEmitter.zvel[index];
+  }
+}
+
+
+
+/******************************************************************************
+* Fill both particle systems and move them to steady state (see above), then
+* fast-forward them by options.prewarmTime. Called after the systems were
+* (re)initialised, unless a snapshot is restored.
+******************************************************************************/
+void prewarmParticles(void)
+{
+  StepParams params;
+  int step, steps;
+
+  TRACE_BEGIN("prewarm");
+  if (options.prewarm) {
+    spawnParticles();
+    params.timeScale = fountain.clock.step / SIMULATION_TICK;
+    params.acceleration = WATER_DROP_MASS * gravity * params.timeScale;
+    parallelFor((fountain.aliveParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE,
+                ageWaterChunk, &params);
+    if (options.analyticWater)
+      rescheduleBallistic();
+    fountain.boundsCount = 0;
+
+    params.timeScale = smokeEmitter.clock.step / SIMULATION_TICK;
+    params.acceleration = SMOKE_PARTICLE_MASS * gravity * params.timeScale;
+    params.noiseMean = SMOKE_CHAOS_SPEED_MEAN * params.timeScale;
+    params.noise = smokeEmitter.chaoticSpeed * sqrt(params.timeScale);
+    params.verticalNoise = params.noise * SMOKE_CHAOS_VERTICAL_MUL;
+    params.shadeMean = SMOKE_SHADE_CHANGE_MEAN * params.timeScale;
+    params.shadeNoise = SMOKE_SHADE_CHANGE_VAR * sqrt(params.timeScale);
+    params.alphaChange = SMOKE_ALPHA_CHANGE * params.timeScale;
+    params.xWind = xWind * params.timeScale;
+    params.zWind = zWind * params.timeScale;
+    parallelFor((smokeEmitter.aliveParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE,
+                ageSmokeChunk, &params);
+    smokeEmitter.boundsCount = 0;
+  }
+
+  // Every step of the fast-forward counts as a frame for the spawn budget
+  steps = (int)(options.prewarmTime / fountain.clock.step + 0.5);
+  for (step = 0; step < steps; step++)
+  {
+    refillSpawnBudget();
+    spawnWater();
+    progressWater();
+  }
+  steps = (int)(options.prewarmTime / smokeEmitter.clock.step + 0.5);
+  for (step = 0; step < steps; step++)
+  {
+    refillSpawnBudget();
+    spawnSmoke();
+    progressSmoke();
+  }
+  // The particles spawned and killed are not part of the first frame
+  refillSpawnBudget();
+  memset(&simulationMetrics, 0, sizeof(simulationMetrics));
+  TRACE_END();
+}
@@ -0,0 +1,25 @@
+/******************************************************************************
+* File:         prewarm.h
+* Brief:        Start the particle systems in their steady state
+******************************************************************************/
+#ifndef PREWARM_H
+#define PREWARM_H
+
+
+
+/******************************************************************************
+* Pre-warm parameters
+******************************************************************************/
+#define PREWARM_TRIES 16				// Ages drawn for a smoke particle before it
+										// is left newborn
+#define PREWARM_SHADE_SPREAD 4.0		// Standard deviations of fade beyond which
+										// smoke ages are not drawn
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void prewarmParticles(void);			// Fill both systems in steady state
+
+#endif
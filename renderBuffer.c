@@ -0,0 +1,523 @@
+/******************************************************************************
+* File:         renderBuffer.c
+* Brief:        Packing of particle data into vertex arrays for rendering
+*
+* Note:
+* Vertex arrays are filled in parallel, one chunk of particles per task, so 
+* that each particle system can be drawn with a single call. Water drops are
+* either points or lines joining the current and the next position (given by
+* the velocity vector), coloured by their emitter. Smoke colour is packed into
+* bytes. Smoke particles are either points or camera-facing quads textured
+* with their cell of the smoke atlas, so the whole smoke system is drawn with
+* one texture bound. Positions are interpolated between the last two
+* simulation steps (see SimulationClock). Water following analytic
+* trajectories is evaluated at the interpolated time directly.
+*
+* Particles are culled before packing: ranges of particles whose bounding 
+* box (recorded by the simulation, see ParticleBounds) lies outside the view
+* frustum are skipped, the visible ranges are packed next to each other. A
+* system entirely out of view therefore costs one box test per chunk.
+*
+* Smoke sprites are blended, so they are drawn from the furthest to the 
+* nearest: the depth of every sprite is recorded while packing and sorted
+* into an index buffer (depthSort.c). Once more than options.smokeVolume 
+* sprites are visible, smoke is splatted into a density volume instead 
+* (smokeVolume.c).
+******************************************************************************/
+#include "renderBuffer.h"
+#include "threadPool.h"
+#include "ballistic.h"
+#include "depthSort.h"
+#include "emitter.h"
+#include "smokeVolume.h"
+
+
+
+/******************************************************************************
+* Global variables (declared in renderBuffer.h)
+******************************************************************************/
+RenderBuffers renderBuffers;
+
+// Texture coordinates of the atlas cells (left, top, right, bottom)
+typedef struct {
+  float s0, t0, s1, t1;
+} AtlasCell;
+
+static AtlasCell atlasCells[SMOKE_TEXTURE_NUMBER];
+static int atlasCellsReady;
+
+// Particles [first, last) packed by one task, starting at particle "offset"
+// of the render buffer
+typedef struct {
+  int first, last, offset;
+} PackRange;
+
+static PackRange *packRanges;
+static int packCapacity;
+
+// Sprite packing parameters, depth of each sprite along the view direction
+typedef struct {
+  const Billboard *billboard;
+  const float *depthPlane;              // Near plane, NULL if not sorting
+} SpritePacking;
+
+static real *spriteDepth;
+static int depthCapacity;
+
+// Drop colour of each water emitter
+typedef struct {
+  unsigned char r, g, b, a;
+} ColourBytes;
+
+static ColourBytes *waterColours;
+static int colourCapacity;
+
+
+
+/******************************************************************************
+* Make sure "buffer" can hold "count" elements of size "size". The buffer is
+* also shrunk once less than a quarter of it is used, so that its size 
+* follows the number of particles.
+******************************************************************************/
+static void *reserve(void *buffer, int *capacity, int count, size_t size)
+{
+  if (count <= *capacity && count >= *capacity / 4)
+    return buffer;
+  count = count > 0 ? count : 1;
+  buffer = realloc(buffer, (size_t)count * size);
+  if (!buffer) {
+    fprintf(stderr, "Could not allocate render buffer for %d vertices\n", count);
+    exit(1);
+  }
+  *capacity = count;
+  return buffer;
+}
+
+
+
+/******************************************************************************
+* Convert colour component to a byte
+******************************************************************************/
+static inline unsigned char colourByte(real component)
+{
+  if (component <= 0.0)
+    return 0;
+  if (component >= 1.0)
+    return 255;
+  return (unsigned char)(component * 255.0f + 0.5f);
+}
+
+
+
+/******************************************************************************
+* Position between "previous" (t = 0) and "current" (t = 1)
+******************************************************************************/
+static inline float interpolate(real previous, real current, real t)
+{
+  return previous + (current - previous) * t;
+}
+
+
+
+/******************************************************************************
+* Colour of the water emitters as bytes, and of a drop of emitter "emitter"
+******************************************************************************/
+static void prepareDropColours(void)
+{
+  int emitter;
+  const double *colour;
+
+  waterColours = reserve(waterColours, &colourCapacity, waterSources.count, sizeof(ColourBytes));
+  for (emitter = 0; emitter < waterSources.count; emitter++)
+  {
+    colour = waterSources.emitters[emitter].colour;
+    waterColours[emitter].r = colourByte(colour[0]);
+    waterColours[emitter].g = colourByte(colour[1]);
+    waterColours[emitter].b = colourByte(colour[2]);
+    waterColours[emitter].a = 255;
+  }
+}
+
+static inline void dropColour(ColouredVertex *vertex, unsigned short emitter)
+{
+  vertex->r = waterColours[emitter].r;
+  vertex->g = waterColours[emitter].g;
+  vertex->b = waterColours[emitter].b;
+  vertex->a = waterColours[emitter].a;
+}
+
+
+
+/******************************************************************************
+* Pack one range of water particles ("waterLines" points to the line flag)
+******************************************************************************/
+static void packWaterRange(int task, void *waterLines)
+{
+  int index, first = packRanges[task].first, last = packRanges[task].last;
+  int offset = packRanges[task].offset;
+  real t = fountain.clock.interpolation;
+  ColouredVertex *vertex;
+
+  if (*(int*)waterLines) {
+    for (index = first, vertex = renderBuffers.water + 2 * offset; index < last; 
+         index++, vertex += 2)
+    {
+      dropColour(&vertex[0], fountain.emitter[index]);
+      dropColour(&vertex[1], fountain.emitter[index]);
+      vertex[0].x = interpolate(fountain.xprev[index], fountain.xpos[index], t);
+      vertex[0].y = interpolate(fountain.yprev[index], fountain.ypos[index], t);
+      vertex[0].z = interpolate(fountain.zprev[index], fountain.zpos[index], t);
+      vertex[1].x = vertex[0].x + fountain.xvel[index];
+      vertex[1].y = vertex[0].y + fountain.yvel[index];
+      vertex[1].z = vertex[0].z + fountain.zvel[index];
+    }
+  }
+  else {
+    for (index = first, vertex = renderBuffers.water + offset; index < last; 
+         index++, vertex++)
+    {
+      dropColour(vertex, fountain.emitter[index]);
+      vertex->x = interpolate(fountain.xprev[index], fountain.xpos[index], t);
+      vertex->y = interpolate(fountain.yprev[index], fountain.ypos[index], t);
+      vertex->z = interpolate(fountain.zprev[index], fountain.zpos[index], t);
+    }
+  }
+}
+
+
+
+/******************************************************************************
+* Pack one range of water drops following analytic trajectories (see 
+* ballistic.h). Interpolation 0 is the state one step before the current.
+******************************************************************************/
+static void packTrajectoryRange(int task, void *waterLines)
+{
+  int index, first = packRanges[task].first, last = packRanges[task].last;
+  int offset = packRanges[task].offset;
+  double now = (double)fountain.clock.steps - 1.0 + fountain.clock.interpolation;
+  double n;
+  real x, y, z;
+  ColouredVertex *vertex;
+
+  if (*(int*)waterLines) {
+    for (index = first, vertex = renderBuffers.water + 2 * offset; index < last; 
+         index++, vertex += 2)
+    {
+      n = now - trajectories.birth[index];
+      dropPosition(index, n, &x, &y, &z);
+      dropColour(&vertex[0], fountain.emitter[index]);
+      dropColour(&vertex[1], fountain.emitter[index]);
+      vertex[0].x = x;
+      vertex[0].y = y;
+      vertex[0].z = z;
+      vertex[1].x = x + fountain.xvel[index];
+      vertex[1].y = y + dropVelocity(index, n);
+      vertex[1].z = z + fountain.zvel[index];
+    }
+  }
+  else {
+    for (index = first, vertex = renderBuffers.water + offset; index < last; 
+         index++, vertex++)
+    {
+      dropPosition(index, now - trajectories.birth[index], &x, &y, &z);
+      dropColour(vertex, fountain.emitter[index]);
+      vertex->x = x;
+      vertex->y = y;
+      vertex->z = z;
+    }
+  }
+}
+
+
+
+/******************************************************************************
+* Pack one range of smoke particles as points
+******************************************************************************/
+static void packSmokeRange(int task, void *unused)
+{
+  int index, first = packRanges[task].first, last = packRanges[task].last;
+  real t = smokeEmitter.clock.interpolation;
+  ColouredVertex *vertex;
+
+  (void)unused;
+  for (index = first, vertex = renderBuffers.smoke + packRanges[task].offset; index < last; 
+       index++, vertex++)
+  {
+    vertex->r = colourByte(smokeEmitter.r[index]);
+    vertex->g = colourByte(smokeEmitter.g[index]);
+    vertex->b = colourByte(smokeEmitter.b[index]);
+    vertex->a = colourByte(smokeEmitter.alpha[index]);
+    vertex->x = interpolate(smokeEmitter.xprev[index], smokeEmitter.xpos[index], t);
+    vertex->y = interpolate(smokeEmitter.yprev[index], smokeEmitter.ypos[index], t);
+    vertex->z = interpolate(smokeEmitter.zprev[index], smokeEmitter.zpos[index], t);
+  }
+}
+
+
+
+/******************************************************************************
+* Calculate texture coordinates of the atlas cells. Coordinates are moved 
+* half a texel inwards so that filtering does not pick up neighbouring cells.
+******************************************************************************/
+static void initAtlasCells(void)
+{
+  int cell, column, row;
+  const float texel = 1.0f / SMOKE_ATLAS_SIZE;
+
+  for (cell = 0; cell < SMOKE_TEXTURE_NUMBER; cell++)
+  {
+    column = cell % SMOKE_ATLAS_COLUMNS;
+    row = cell / SMOKE_ATLAS_COLUMNS;
+    atlasCells[cell].s0 = (column * SMOKE_ATLAS_CELL + 0.5f) * texel;
+    atlasCells[cell].t0 = (row * SMOKE_ATLAS_CELL + 0.5f) * texel;
+    atlasCells[cell].s1 = ((column + 1) * SMOKE_ATLAS_CELL - 0.5f) * texel;
+    atlasCells[cell].t1 = ((row + 1) * SMOKE_ATLAS_CELL - 0.5f) * texel;
+  }
+  atlasCellsReady = 1;
+}
+
+
+
+/******************************************************************************
+* Set one corner of a smoke sprite
+******************************************************************************/
+static inline void spriteCorner(TexturedVertex *vertex, const TexturedVertex *centre,
+                                float s, float t, float x, float y, float z)
+{
+  *vertex = *centre;
+  vertex->s = s;
+  vertex->t = t;
+  vertex->x += x;
+  vertex->y += y;
+  vertex->z += z;
+}
+
+
+
+/******************************************************************************
+* Pack one range of smoke particles as quads facing the camera. The top of
+* the image (first rows of the atlas cell) points along the camera up vector.
+* The distance of each sprite from the near plane is stored for sorting.
+******************************************************************************/
+static void packSpriteRange(int task, void *spritePacking)
+{
+  int index, first = packRanges[task].first, last = packRanges[task].last;
+  const SpritePacking *packing = spritePacking;
+  const float *right = packing->billboard->right;
+  const float *up = packing->billboard->up;
+  const float *plane = packing->depthPlane;
+  real *depth = spriteDepth + packRanges[task].offset;
+  real t = smokeEmitter.clock.interpolation;
+  const AtlasCell *cell;
+  TexturedVertex centre, *vertex;
+
+  for (index = first, vertex = renderBuffers.sprites + 4 * packRanges[task].offset; index < last; 
+       index++, vertex += 4)
+  {
+    cell = &atlasCells[smokeEmitter.textureIndex[index]];
+    centre.r = colourByte(smokeEmitter.r[index]);
+    centre.g = colourByte(smokeEmitter.g[index]);
+    centre.b = colourByte(smokeEmitter.b[index]);
+    centre.a = colourByte(smokeEmitter.alpha[index]);
+    centre.x = interpolate(smokeEmitter.xprev[index], smokeEmitter.xpos[index], t);
+    centre.y = interpolate(smokeEmitter.yprev[index], smokeEmitter.ypos[index], t);
+    centre.z = interpolate(smokeEmitter.zprev[index], smokeEmitter.zpos[index], t);
+    spriteCorner(vertex + 0, &centre, cell->s0, cell->t1, 
+                 -right[0] - up[0], -right[1] - up[1], -right[2] - up[2]);
+    spriteCorner(vertex + 1, &centre, cell->s1, cell->t1, 
+                 right[0] - up[0], right[1] - up[1], right[2] - up[2]);
+    spriteCorner(vertex + 2, &centre, cell->s1, cell->t0, 
+                 right[0] + up[0], right[1] + up[1], right[2] + up[2]);
+    spriteCorner(vertex + 3, &centre, cell->s0, cell->t0, 
+                 -right[0] + up[0], -right[1] + up[1], -right[2] + up[2]);
+    if (plane)
+      *depth++ = plane[0] * centre.x + plane[1] * centre.y + plane[2] * centre.z + plane[3];
+  }
+}
+
+
+
+/******************************************************************************
+* Test whether a box, enlarged by "margin" along each axis, intersects the
+* frustum. The box is outside once its corner furthest along the normal of
+* some plane lies behind that plane.
+******************************************************************************/
+static int boxVisible(const ParticleBounds *bounds, const Frustum *frustum, const float *margin)
+{
+  int plane, axis;
+  float distance;
+  const float *equation;
+
+  for (plane = 0; plane < 6; plane++)
+  {
+    equation = frustum->planes[plane];
+    distance = equation[3];
+    for (axis = 0; axis < 3; axis++)
+      distance += equation[axis] * (equation[axis] > 0.0f ? bounds->max[axis] + margin[axis] : 
+                                                            bounds->min[axis] - margin[axis]);
+    if (distance < 0.0f)
+      return 0;
+  }
+  return 1;
+}
+
+
+
+/******************************************************************************
+* Fill packRanges with the ranges of particles to pack, those with a box
+* outside "frustum" (if not NULL) are left out. Particles not covered by any
+* box (spawned after the last step, or not integrated) are always packed. 
+* Returns the number of ranges, "packed" receives the number of particles.
+******************************************************************************/
+static int visibleRanges(const ParticleBounds *bounds, int boundsCount, int alive, 
+                         const Frustum *frustum, const float *margin, int *packed)
+{
+  int range, ranges = 0, first, last, covered = 0;
+  int needed = boundsCount + alive / PARTICLE_CHUNK_SIZE + 1;
+
+  packRanges = reserve(packRanges, &packCapacity, needed, sizeof(PackRange));
+  *packed = 0;
+  for (range = 0; range < boundsCount; range++)
+  {
+    first = bounds[range].first;
+    last = first + bounds[range].count < alive ? first + bounds[range].count : alive;
+    covered = last > covered ? last : covered;
+    if (last <= first || (frustum && !boxVisible(&bounds[range], frustum, margin)))
+      continue;
+    packRanges[ranges].first = first;
+    packRanges[ranges].last = last;
+    packRanges[ranges++].offset = *packed;
+    *packed += last - first;
+  }
+
+  for (first = covered; first < alive; first = last)
+  {
+    last = first + PARTICLE_CHUNK_SIZE < alive ? first + PARTICLE_CHUNK_SIZE : alive;
+    packRanges[ranges].first = first;
+    packRanges[ranges].last = last;
+    packRanges[ranges++].offset = *packed;
+    *packed += last - first;
+  }
+  return ranges;
+}
+
+
+
+/******************************************************************************
+* Pack the visible live particles into the render buffers. Water is packed as
+* line segments (two vertices per drop) if "waterLines" is nonzero, as points
+* otherwise. Smoke is packed as sprites (four vertices per particle) oriented
+* along the axes in "billboard", or as points if "billboard" is NULL. Nothing
+* is culled if "frustum" is NULL, otherwise sprites are also sorted back to 
+* front (unless options.depthSort is off). Too many sprites are replaced by
+* a density volume.
+******************************************************************************/
+void prepareRenderBuffers(int waterLines, const Billboard *billboard, const Frustum *frustum)
+{
+  int axis, ranges, packed;
+  float margin[3] = {0.0f, 0.0f, 0.0f};
+  SpritePacking packing;
+
+  ranges = visibleRanges(fountain.bounds, fountain.boundsCount, fountain.aliveParticles,
+                         frustum, margin, &packed);
+  renderBuffers.waterVertices = packed * (waterLines ? 2 : 1);
+  renderBuffers.water = reserve(renderBuffers.water, &renderBuffers.waterCapacity, 
+                                renderBuffers.waterVertices, sizeof(ColouredVertex));
+  prepareDropColours();
+  parallelFor(ranges, options.analyticWater ? packTrajectoryRange : packWaterRange, &waterLines);
+
+  // Sprites reach from their centre along the billboard axes
+  if (billboard)
+    for (axis = 0; axis < 3; axis++)
+      margin[axis] = fabsf(billboard->right[axis]) + fabsf(billboard->up[axis]);
+  ranges = visibleRanges(smokeEmitter.bounds, smokeEmitter.boundsCount, 
+                         smokeEmitter.aliveParticles, frustum, margin, &packed);
+  renderBuffers.volume.vertexCount = 0;
+  if (billboard && options.smokeVolume > 0 && packed > options.smokeVolume &&
+      buildSmokeVolume(&renderBuffers.volume, billboard)) {
+    renderBuffers.smokeVertices = renderBuffers.spriteVertices = 0;
+    renderBuffers.spriteIndexCount = 0;
+  }
+  else if (billboard) {
+    if (!atlasCellsReady)
+      initAtlasCells();
+    renderBuffers.smokeVertices = 0;
+    renderBuffers.spriteVertices = packed * 4;
+    renderBuffers.sprites = reserve(renderBuffers.sprites, &renderBuffers.spriteCapacity, 
+                                    renderBuffers.spriteVertices, sizeof(TexturedVertex));
+    packing.billboard = billboard;
+    packing.depthPlane = frustum && options.depthSort ? frustum->planes[4] : NULL;
+    if (packing.depthPlane)
+      spriteDepth = reserve(spriteDepth, &depthCapacity, packed, sizeof(real));
+    parallelFor(ranges, packSpriteRange, &packing);
+
+    renderBuffers.spriteIndexCount = packing.depthPlane ? renderBuffers.spriteVertices : 0;
+    if (packing.depthPlane) {
+      renderBuffers.spriteIndices = reserve(renderBuffers.spriteIndices, 
+                                            &renderBuffers.spriteIndexCapacity,
+                                            renderBuffers.spriteIndexCount, sizeof(unsigned int));
+      sortSprites(spriteDepth, packed, renderBuffers.spriteIndices);
+    }
+  }
+  else {
+    renderBuffers.spriteVertices = renderBuffers.spriteIndexCount = 0;
+    renderBuffers.smokeVertices = packed;
+    renderBuffers.smoke = reserve(renderBuffers.smoke, &renderBuffers.smokeCapacity, 
+                                  renderBuffers.smokeVertices, sizeof(ColouredVertex));
+    parallelFor(ranges, packSmokeRange, NULL);
+  }
+}
+
+
+
+/******************************************************************************
+* Calculate the frustum of a camera at "eye" looking at "centre" (gluLookAt())
+* with a perspective projection (gluPerspective(), field of view in degrees)
+******************************************************************************/
+void viewFrustum(Frustum *frustum, const double *eye, const double *centre, const double *up,
+                 double fieldOfView, double aspect, double near, double far)
+{
+  double forward[3], right[3], top[3], length;
+  double tanY = tan(0.5 * fieldOfView * DEG_TO_RAD), tanX = tanY * aspect;
+  double normals[6][3];
+  int axis, plane;
+
+  for (axis = 0; axis < 3; axis++)
+    forward[axis] = centre[axis] - eye[axis];
+  length = sqrt(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+  for (axis = 0; axis < 3; axis++)
+    forward[axis] /= length;
+
+  // right = forward x up, top = right x forward (as in gluLookAt())
+  right[0] = forward[1] * up[2] - forward[2] * up[1];
+  right[1] = forward[2] * up[0] - forward[0] * up[2];
+  right[2] = forward[0] * up[1] - forward[1] * up[0];
+  length = sqrt(right[0] * right[0] + right[1] * right[1] + right[2] * right[2]);
+  for (axis = 0; axis < 3; axis++)
+    right[axis] /= length;
+  top[0] = right[1] * forward[2] - right[2] * forward[1];
+  top[1] = right[2] * forward[0] - right[0] * forward[2];
+  top[2] = right[0] * forward[1] - right[1] * forward[0];
+
+  // Side planes pass through the eye, near and far planes face each other
+  for (axis = 0; axis < 3; axis++)
+  {
+    normals[0][axis] = forward[axis] * tanX + right[axis];   // Left
+    normals[1][axis] = forward[axis] * tanX - right[axis];   // Right
+    normals[2][axis] = forward[axis] * tanY + top[axis];     // Bottom
+    normals[3][axis] = forward[axis] * tanY - top[axis];     // Top
+    normals[4][axis] = forward[axis];                        // Near
+    normals[5][axis] = -forward[axis];                       // Far
+  }
+  for (plane = 0; plane < 6; plane++)
+  {
+    frustum->planes[plane][3] = 0.0f;
+    for (axis = 0; axis < 3; axis++)
+    {
+      frustum->planes[plane][axis] = normals[plane][axis];
+      frustum->planes[plane][3] -= normals[plane][axis] * eye[axis];
+    }
+  }
+  frustum->planes[4][3] -= near;
+  frustum->planes[5][3] += far;
+}
@@ -0,0 +1,113 @@
+/******************************************************************************
+* File:         renderBuffer.h
+* Brief:        Packing of particle data into vertex arrays for rendering
+******************************************************************************/
+#ifndef RENDER_BUFFER_H
+#define RENDER_BUFFER_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Vertex formats, matching OpenGL interleaved array layouts
+******************************************************************************/
+
+// Colour and position (GL_C4UB_V3F)
+typedef struct {
+    unsigned char r, g, b, a;
+    float x, y, z;
+} ColouredVertex;
+
+// Texture coordinates, colour and position (GL_T2F_C4UB_V3F)
+typedef struct {
+    float s, t;
+    unsigned char r, g, b, a;
+    float x, y, z;
+} TexturedVertex;
+
+
+
+/******************************************************************************
+* Smoke texture atlas. All smoke images are resampled into square cells of a
+* single texture, cell "textureIndex" holds image smoke<textureIndex>.png.
+******************************************************************************/
+#define SMOKE_ATLAS_SIZE 1024			// Width and height of the atlas in texels
+#define SMOKE_ATLAS_COLUMNS 5			// Cells per row (and rows)
+#define SMOKE_ATLAS_CELL (SMOKE_ATLAS_SIZE / SMOKE_ATLAS_COLUMNS) // Cell size in texels
+
+// Camera axes used to turn smoke particles into screen-aligned sprites
+typedef struct {
+    float right[3];                     // Camera right vector, half sprite width long
+    float up[3];                        // Camera up vector, half sprite height long
+} Billboard;
+
+
+
+/******************************************************************************
+* View frustum used to cull particles before packing them. A point is inside
+* if a*x + b*y + c*z + d >= 0 for all six planes (a, b, c, d).
+******************************************************************************/
+typedef struct {
+    float planes[6][4];
+} Frustum;
+
+
+
+/******************************************************************************
+* Smoke density volume, drawn instead of the sprites once there are more than
+* options.smokeVolume of them (see smokeVolume.c). Cells are cubes, texels
+* hold the colour (premultiplied by alpha) and the opacity of one slice, X 
+* varying fastest. Slices are quads across the volume, back to front, with
+* 3D texture coordinates.
+******************************************************************************/
+#define VOLUME_RESOLUTION 64			// Cells along the longest side
+#define VOLUME_MAX_CELLS 32768			// Most cells of a volume
+
+// 3D texture coordinates and position
+typedef struct {
+    float s, t, r;
+    float x, y, z;
+} SliceVertex;
+
+typedef struct {
+    unsigned char *texels;              // RGBA texels, size[0] * size[1] * size[2]
+    int size[3];                        // Cells along each axis (powers of two)
+    int capacity;
+    SliceVertex vertices[4 * VOLUME_RESOLUTION]; // Slice quads
+    int vertexCount;                    // 0 if smoke is drawn as sprites
+} SmokeVolume;
+
+
+
+/******************************************************************************
+* Vertex arrays of the particle systems, filled by prepareRenderBuffers()
+******************************************************************************/
+typedef struct {
+    ColouredVertex *water;              // Water vertices
+    int waterVertices;
+    int waterCapacity;
+    ColouredVertex *smoke;              // Smoke vertices (points)
+    int smokeVertices;
+    int smokeCapacity;
+    TexturedVertex *sprites;            // Smoke sprites (quads, four vertices each)
+    int spriteVertices;
+    int spriteCapacity;
+    unsigned int *spriteIndices;        // Sprite vertices back to front (if sorted)
+    int spriteIndexCount;
+    int spriteIndexCapacity;
+    SmokeVolume volume;                 // Smoke as a density volume (if many)
+} RenderBuffers;
+
+extern RenderBuffers renderBuffers;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void prepareRenderBuffers(int, const Billboard*, const Frustum*); // Pack visible particles
+void viewFrustum(Frustum*, const double*, const double*, const double*, 
+                 double, double, double, double); // Frustum of a gluLookAt/gluPerspective view
+
+#endif
@@ -0,0 +1,244 @@
+/******************************************************************************
+* File:         rng.c
+* Brief:        Fast random number generation
+*
+* Note:
+* Random bits come from xoshiro256++ generators. Every stream is seeded from
+* the simulation seed and a stream ID hashed with splitmix64, so parts of the
+* simulation (for example chunks of particles) can own independent streams
+* which do not depend on the order in which they are used. Normal variates
+* are generated using the ziggurat method (Marsaglia and Tsang), which needs
+* a single table lookup and comparison in more than 98% of cases instead of
+* a rejection loop with log() and sqrt().
+******************************************************************************/
+#include "rng.h"
+
+
+
+/******************************************************************************
+* Ziggurat parameters and tables
+******************************************************************************/
+#define ZIGGURAT_LAYERS 128
+#define ZIGGURAT_R 3.442619855899			// Start of the tail
+#define ZIGGURAT_AREA 9.91256303526217e-3	// Area of each layer
+
+static uint32_t kn[ZIGGURAT_LAYERS];		// Fast acceptance thresholds
+static double wn[ZIGGURAT_LAYERS];			// Layer widths scaled to 32-bit integers
+static double fn[ZIGGURAT_LAYERS];			// Density at layer boundaries
+static int zigguratReady;
+
+
+
+/******************************************************************************
+* Global variables (declared in rng.h)
+******************************************************************************/
+uint64_t randomSeed;
+RandomStream defaultStream;
+
+
+
+/******************************************************************************
+* splitmix64 step, used for seeding xoshiro streams
+******************************************************************************/
+static uint64_t splitMix(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+
+
+/******************************************************************************
+* Calculate the ziggurat tables
+******************************************************************************/
+static void initZiggurat(void)
+{
+  double dn = ZIGGURAT_R, tn = dn, q;
+  double m1 = 2147483648.0;
+  int index;
+
+  q = ZIGGURAT_AREA / exp(-0.5 * dn * dn);
+  kn[0] = (uint32_t)((dn / q) * m1);
+  kn[1] = 0;
+  wn[0] = q / m1;
+  wn[ZIGGURAT_LAYERS - 1] = dn / m1;
+  fn[0] = 1.0;
+  fn[ZIGGURAT_LAYERS - 1] = exp(-0.5 * dn * dn);
+
+  for (index = ZIGGURAT_LAYERS - 2; index >= 1; index--)
+  {
+    dn = sqrt(-2.0 * log(ZIGGURAT_AREA / dn + exp(-0.5 * dn * dn)));
+    kn[index + 1] = (uint32_t)((dn / tn) * m1);
+    tn = dn;
+    fn[index] = exp(-0.5 * dn * dn);
+    wn[index] = dn / m1;
+  }
+  zigguratReady = 1;
+}
+
+
+
+/******************************************************************************
+* Seed the simulation. Sets up the default stream and the ziggurat tables,
+* must be called before any other function of this module.
+******************************************************************************/
+void seedRandom(uint64_t seed)
+{
+  if (!zigguratReady)
+    initZiggurat();
+  randomSeed = seed;
+  seedStream(&defaultStream, seed, 0);
+}
+
+
+
+/******************************************************************************
+* Seed a stream from the simulation seed and stream ID
+******************************************************************************/
+void seedStream(RandomStream *stream, uint64_t seed, uint64_t streamID)
+{
+  uint64_t state = seed ^ splitMix(&streamID);
+
+  stream->state[0] = splitMix(&state);
+  stream->state[1] = splitMix(&state);
+  stream->state[2] = splitMix(&state);
+  stream->state[3] = splitMix(&state);
+}
+
+
+
+/******************************************************************************
+* Return next 64 random bits (xoshiro256++)
+******************************************************************************/
+static inline uint64_t rotateLeft(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t next(RandomStream *stream)
+{
+  uint64_t *s = stream->state;
+  uint64_t result = rotateLeft(s[0] + s[3], 23) + s[0];
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotateLeft(s[3], 45);
+  return result;
+}
+
+uint64_t nextRandom(RandomStream *stream)
+{
+  return next(stream);
+}
+
+
+
+/******************************************************************************
+* Uniform variate in range (0,1), built from the top 53 random bits
+******************************************************************************/
+static inline double uniform01(RandomStream *stream)
+{
+  return ((next(stream) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+
+
+/******************************************************************************
+* Standard normal variate, ziggurat method. The top 32 bits give the signed
+* position within a layer, independent lower bits select the layer.
+******************************************************************************/
+static double normalTail(RandomStream *stream, int32_t hz, uint32_t iz)
+{
+  double x, y;
+  uint64_t bits;
+
+  for (;;)
+  {
+    // Base layer, sample from the tail beyond ZIGGURAT_R
+    if (iz == 0) {
+      do {
+        x = -log(uniform01(stream)) / ZIGGURAT_R;
+        y = -log(uniform01(stream));
+      } while (y + y < x * x);
+      return hz > 0 ? ZIGGURAT_R + x : -ZIGGURAT_R - x;
+    }
+
+    // Wedge of the layer, accept if under the density curve
+    x = hz * wn[iz];
+    if (fn[iz] + uniform01(stream) * (fn[iz - 1] - fn[iz]) < exp(-0.5 * x * x))
+      return x;
+
+    // Otherwise start over
+    bits = next(stream);
+    hz = (int32_t)(bits >> 32);
+    iz = (bits >> 11) & (ZIGGURAT_LAYERS - 1);
+    if ((uint32_t)llabs(hz) < kn[iz])
+      return hz * wn[iz];
+  }
+}
+
+static inline double normal(RandomStream *stream)
+{
+  uint64_t bits = next(stream);
+  int32_t hz = (int32_t)(bits >> 32);
+  uint32_t iz = (bits >> 11) & (ZIGGURAT_LAYERS - 1);
+
+  if ((uint32_t)llabs(hz) < kn[iz])
+    return hz * wn[iz];
+  return normalTail(stream, hz, iz);
+}
+
+
+
+/******************************************************************************
+* Return uniformly distributed random double within range [-range,range]
+******************************************************************************/
+double uniformRandom(double range)
+{
+  return (uniform01(&defaultStream) * 2.0 - 1.0) * range;
+}
+
+
+
+/******************************************************************************
+* Return gaussian random variable with mean "mean" and standard
+* deviation "stdDev"
+******************************************************************************/
+double gaussianRandom(double mean, double stdDev)
+{
+  return normal(&defaultStream) * stdDev + mean;
+}
+
+
+
+/******************************************************************************
+* Fill "count" elements of "out" with uniform variates within range
+* [centre-range, centre+range]
+******************************************************************************/
+void fillUniform(RandomStream *stream, real *out, int count, real centre, real range)
+{
+  int index;
+
+  for (index = 0; index < count; index++)
+    out[index] = (uniform01(stream) * 2.0 - 1.0) * range + centre;
+}
+
+
+
+/******************************************************************************
+* Fill "count" elements of "out" with gaussian variates with mean "mean" and
+* standard deviation "stdDev"
+******************************************************************************/
+void fillGaussian(RandomStream *stream, real *out, int count, real mean, real stdDev)
+{
+  int index;
+
+  for (index = 0; index < count; index++)
+    out[index] = normal(stream) * stdDev + mean;
+}
@@ -0,0 +1,44 @@
+/******************************************************************************
+* File:         rng.h
+* Brief:        Fast random number generation. Independent xoshiro256++ 
+*               streams with batch generation of uniform and normal variates
+******************************************************************************/
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Random stream (xoshiro256++ generator state). Streams seeded with the same
+* seed but different stream IDs are statistically independent.
+******************************************************************************/
+typedef struct {
+    uint64_t state[4];
+} RandomStream;
+
+
+
+/******************************************************************************
+* Seed of the simulation and the stream used by uniformRandom() and 
+* gaussianRandom()
+******************************************************************************/
+extern uint64_t randomSeed;
+extern RandomStream defaultStream;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void seedRandom(uint64_t);              // Seed the simulation (default stream)
+void seedStream(RandomStream*, uint64_t, uint64_t); // Seed stream from seed and stream ID
+uint64_t nextRandom(RandomStream*);     // Next 64 random bits
+double uniformRandom(double);			// Uniform random variable generator
+double gaussianRandom(double, double);	// Gaussian random variable generator
+void fillUniform(RandomStream*, real*, int, real, real);  // Batch of uniform variates
+void fillGaussian(RandomStream*, real*, int, real, real); // Batch of gaussian variates
+
+#endif
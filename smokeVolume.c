@@ -0,0 +1,376 @@
+/******************************************************************************
+* File:         smokeVolume.c
+* Brief:        Level of detail for dense smoke: a coarse density volume
+*
+* Note:
+* With hundreds of thousands of smoke sprites drawing is limited by fill
+* rate, every sprite covers SPRITE_SIZE squared pixels and most of them lie
+* behind others. Above a threshold the sprites are replaced by a volume:
+* every particle is splatted (trilinear weights) into a grid of cubic cells
+* around all the smoke, the grid is uploaded as a 3D texture and drawn as
+* one textured slice per layer of cells, perpendicular to the axis closest
+* to the view direction, back to front. Fill cost then depends on the
+* screen area and resolution of the volume, not on the number of particles.
+*
+* A cell sums the alpha of its particles and their colour weighted by alpha,
+* the sums are then spread over the size of a sprite (separable tent filter)
+* as a sprite covers several cells. Each sprite hides its area times the 
+* mean alpha of the smoke images, spread over the area of a cell seen along
+* the view direction, overlapping sprites combine to an opacity of 
+* 1 - exp(-summed coverage) per slice.
+*
+* Particles are split among VOLUME_TASKS tasks whatever the number of
+* threads, each sums into its own grid and the grids are added in task
+* order, so the volume does not depend on the thread count.
+******************************************************************************/
+#include "smokeVolume.h"
+#include "threadPool.h"
+
+
+
+/******************************************************************************
+* Sums of every task: alpha, then red, green and blue weighted by alpha, for
+* each cell. Grown as needed and reused between frames.
+******************************************************************************/
+static float *sums;
+static int sumCapacity;
+
+// Volume being built
+typedef struct {
+  SmokeVolume *volume;
+  int cells;                            // Number of cells
+  float origin[3];                      // Outer corner of the first cell
+  float cellSize;
+  float opacity;                        // Coverage of a summed alpha of one
+  float profile[VOLUME_RESOLUTION + 1]; // Sprite profile, weight of cells 0, 1...
+  int reach;                            // away, up to "reach"
+  int axis;                             // Axis being spread along
+  float *source, *destination;          // Sums before and after
+} Splat;
+
+
+
+/******************************************************************************
+* Grow a buffer, contents are not kept
+******************************************************************************/
+static void *grow(void *buffer, size_t size)
+{
+  free(buffer);
+  buffer = malloc(size);
+  if (!buffer) {
+    fprintf(stderr, "Could not allocate smoke volume\n");
+    exit(1);
+  }
+  return buffer;
+}
+
+
+
+/******************************************************************************
+* Helpers: colour component as a byte, smallest power of two not below
+* "count"
+******************************************************************************/
+static inline unsigned char colourByte(float component)
+{
+  if (component <= 0.0f)
+    return 0;
+  if (component >= 1.0f)
+    return 255;
+  return (unsigned char)(component * 255.0f + 0.5f);
+}
+
+static int powerOfTwo(int count)
+{
+  int power = 1;
+
+  while (power < count)
+    power *= 2;
+  return power;
+}
+
+
+
+/******************************************************************************
+* Profile of a sprite "halfSize" wide (half its width) along one axis: a
+* tent over the cells it reaches, with weights adding up to one
+******************************************************************************/
+static void spriteProfile(Splat *splat, float halfSize)
+{
+  float radius = SMOKE_PROFILE_REACH * halfSize / splat->cellSize, total = 0.0f;
+  int offset;
+
+  splat->reach = (int)ceilf(radius) < VOLUME_RESOLUTION ? (int)ceilf(radius) : VOLUME_RESOLUTION;
+  for (offset = 0; offset <= splat->reach; offset++)
+  {
+    splat->profile[offset] = 1.0f - offset / (radius + 1.0f);
+    total += offset ? 2.0f * splat->profile[offset] : splat->profile[offset];
+  }
+  for (offset = 0; offset <= splat->reach; offset++)
+    splat->profile[offset] /= total;
+}
+
+
+
+/******************************************************************************
+* Splat one task's share of the smoke particles into its own sums. Positions
+* are interpolated as for the sprites, particles beyond the outer cell
+* centres are clamped to them.
+******************************************************************************/
+static void splatTask(int task, void *volumeSplat)
+{
+  const Splat *splat = volumeSplat;
+  const int *size = splat->volume->size;
+  const real *previous[3] = {smokeEmitter.xprev, smokeEmitter.yprev, smokeEmitter.zprev};
+  const real *current[3] = {smokeEmitter.xpos, smokeEmitter.ypos, smokeEmitter.zpos};
+  const int stride[3] = {4, 4 * size[0], 4 * size[0] * size[1]};
+  int count = smokeEmitter.aliveParticles;
+  int index, first = (int)((long long)count * task / VOLUME_TASKS);
+  int last = (int)((long long)count * (task + 1) / VOLUME_TASKS);
+  int axis, corner, low, base, step[3];
+  float *sum = sums + (size_t)task * splat->cells * 4, *target;
+  float weight[3][2], position, alpha, part, scale = 1.0f / splat->cellSize;
+  real t = smokeEmitter.clock.interpolation;
+
+  memset(sum, 0, (size_t)splat->cells * 4 * sizeof(float));
+  for (index = first; index < last; index++)
+  {
+    alpha = smokeEmitter.alpha[index];
+    if (!(alpha > 0.0f))
+      continue;
+
+    // Cell whose centre is below the particle along each axis, the next one
+    // "step" further
+    base = 0;
+    for (axis = 0; axis < 3; axis++)
+    {
+      position = previous[axis][index] + (current[axis][index] - previous[axis][index]) * t;
+      position = (position - splat->origin[axis]) * scale - 0.5f;
+      position = position > 0.0f ? position < size[axis] - 1 ? position : size[axis] - 1 : 0.0f;
+      low = (int)position;
+      weight[axis][1] = position - low;
+      weight[axis][0] = 1.0f - weight[axis][1];
+      base += low * stride[axis];
+      step[axis] = low + 1 < size[axis] ? stride[axis] : 0;
+    }
+    for (corner = 0; corner < 8; corner++)
+    {
+      part = alpha * weight[0][corner & 1] * weight[1][(corner >> 1) & 1] * weight[2][corner >> 2];
+      target = sum + base + (corner & 1) * step[0] + ((corner >> 1) & 1) * step[1] + 
+               (corner >> 2) * step[2];
+      target[0] += part;
+      target[1] += part * smokeEmitter.r[index];
+      target[2] += part * smokeEmitter.g[index];
+      target[3] += part * smokeEmitter.b[index];
+    }
+  }
+}
+
+
+
+/******************************************************************************
+* Add the sums of all tasks for one layer of cells (constant Z) to those of
+* the first task
+******************************************************************************/
+static void addLayer(int layer, void *volumeSplat)
+{
+  const Splat *splat = volumeSplat;
+  int layerCells = splat->volume->size[0] * splat->volume->size[1];
+  int value, task, first = layer * layerCells * 4, last = first + layerCells * 4;
+  const float *sum;
+
+  for (task = 1; task < VOLUME_TASKS; task++)
+  {
+    sum = sums + (size_t)task * splat->cells * 4;
+    for (value = first; value < last; value++)
+      sums[value] += sum[value];
+  }
+}
+
+
+
+/******************************************************************************
+* Spread the sums along one axis with the sprite profile (a tent as wide as
+* a sprite), from "source" to "destination". Part "part" is a layer of
+* constant Z when spreading along X or Y, a row of constant Y along Z.
+******************************************************************************/
+static void spreadPart(int part, void *volumeSplat)
+{
+  const Splat *splat = volumeSplat;
+  const int *size = splat->volume->size;
+  int axis = splat->axis, length = size[axis], lines, line, first, stride;
+  int cell, offset, other, channel;
+  const float *source;
+  float *destination, weight;
+
+  lines = axis == 0 ? size[1] : size[0];
+  stride = axis == 0 ? 4 : axis == 1 ? 4 * size[0] : 4 * size[0] * size[1];
+  for (line = 0; line < lines; line++)
+  {
+    first = axis == 0 ? 4 * size[0] * (line + size[1] * part) :
+            axis == 1 ? 4 * (line + size[0] * size[1] * part) : 4 * (line + size[0] * part);
+    for (cell = 0; cell < length; cell++)
+    {
+      destination = splat->destination + first + cell * stride;
+      destination[0] = destination[1] = destination[2] = destination[3] = 0.0f;
+      for (offset = -splat->reach; offset <= splat->reach; offset++)
+      {
+        other = cell + offset;
+        if (other < 0 || other >= length)
+          continue;
+        source = splat->source + first + other * stride;
+        weight = splat->profile[offset < 0 ? -offset : offset];
+        for (channel = 0; channel < 4; channel++)
+          destination[channel] += weight * source[channel];
+      }
+    }
+  }
+}
+
+
+
+/******************************************************************************
+* Turn the sums of one layer of cells (constant Z) into texels
+******************************************************************************/
+static void texelLayer(int layer, void *volumeSplat)
+{
+  const Splat *splat = volumeSplat;
+  int layerCells = splat->volume->size[0] * splat->volume->size[1];
+  int cell, channel, first = layer * layerCells;
+  unsigned char *texel;
+  const float *sum;
+  float opacity;
+
+  for (cell = first; cell < first + layerCells; cell++)
+  {
+    sum = splat->source + (size_t)cell * 4;
+    opacity = 1.0f - expf(-splat->opacity * sum[0]);
+    texel = splat->volume->texels + (size_t)cell * 4;
+    for (channel = 1; channel < 4; channel++)
+      texel[channel - 1] = sum[0] > 0.0f ? colourByte(opacity * sum[channel] / sum[0]) : 0;
+    texel[3] = colourByte(opacity);
+  }
+}
+
+
+
+/******************************************************************************
+* Build the density volume of the smoke and its slices for a view whose
+* sprites would span the axes in "billboard". Returns 0 (and builds nothing)
+* if there is no smoke to splat.
+******************************************************************************/
+int buildSmokeVolume(SmokeVolume *volume, const Billboard *billboard)
+{
+  const float *right = billboard->right, *up = billboard->up;
+  float low[3], high[3], forward[3], texture[3], extent, largest = 0.0f, length;
+  int axis, range, cells, slice, layer, corner, slices, across, along;
+  SliceVertex *vertex;
+  Splat splat;
+
+  if (smokeEmitter.boundsCount == 0 || smokeEmitter.aliveParticles == 0)
+    return 0;
+
+  // Box around all smoke, enlarged by the reach of the sprites
+  for (axis = 0; axis < 3; axis++)
+  {
+    low[axis] = FLT_MAX;
+    high[axis] = -FLT_MAX;
+    for (range = 0; range < smokeEmitter.boundsCount; range++)
+    {
+      low[axis] = fminf(low[axis], smokeEmitter.bounds[range].min[axis]);
+      high[axis] = fmaxf(high[axis], smokeEmitter.bounds[range].max[axis]);
+    }
+    low[axis] -= fabsf(right[axis]) + fabsf(up[axis]);
+    high[axis] += fabsf(right[axis]) + fabsf(up[axis]);
+    largest = fmaxf(largest, high[axis] - low[axis]);
+  }
+  if (!(largest > 0.0f))
+    return 0;
+
+  // View direction, up x right points along it (as the axes come from
+  // gluLookAt()), slices are perpendicular to its largest component
+  forward[0] = up[1] * right[2] - up[2] * right[1];
+  forward[1] = up[2] * right[0] - up[0] * right[2];
+  forward[2] = up[0] * right[1] - up[1] * right[0];
+  length = sqrtf(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+  if (!(length > 0.0f))
+    return 0;
+  along = 0;
+  for (axis = 0; axis < 3; axis++)
+  {
+    forward[axis] /= length;
+    if (fabsf(forward[axis]) > fabsf(forward[along]))
+      along = axis;
+  }
+
+  // VOLUME_RESOLUTION cells along the longest side, larger cells if there
+  // would be more than VOLUME_MAX_CELLS
+  splat.volume = volume;
+  splat.cellSize = largest / VOLUME_RESOLUTION;
+  for (;;)
+  {
+    cells = 1;
+    for (axis = 0; axis < 3; axis++)
+    {
+      extent = ceilf((high[axis] - low[axis]) / splat.cellSize);
+      volume->size[axis] = powerOfTwo(extent < VOLUME_RESOLUTION ? (int)extent : VOLUME_RESOLUTION);
+      cells *= volume->size[axis];
+    }
+    if (cells <= VOLUME_MAX_CELLS)
+      break;
+    splat.cellSize *= 1.25f;
+  }
+  for (axis = 0; axis < 3; axis++)
+    splat.origin[axis] = 0.5f * (low[axis] + high[axis] - volume->size[axis] * splat.cellSize);
+  splat.cells = cells;
+  splat.opacity = SMOKE_IMAGE_COVERAGE * 4.0f *
+                  sqrtf(right[0] * right[0] + right[1] * right[1] + right[2] * right[2]) *
+                  sqrtf(up[0] * up[0] + up[1] * up[1] + up[2] * up[2]) /
+                  (fabsf(forward[along]) * splat.cellSize * splat.cellSize);
+
+  if (cells > sumCapacity) {
+    sums = grow(sums, (size_t)VOLUME_TASKS * cells * 4 * sizeof(float));
+    sumCapacity = cells;
+  }
+  if (cells > volume->capacity) {
+    volume->texels = grow(volume->texels, (size_t)cells * 4);
+    volume->capacity = cells;
+  }
+  parallelFor(VOLUME_TASKS, splatTask, &splat);
+  parallelFor(volume->size[2], addLayer, &splat);
+
+  // Spread the sums over the size of the sprites, between the grids of the
+  // first two tasks
+  spriteProfile(&splat, sqrtf(right[0] * right[0] + right[1] * right[1] + right[2] * right[2]));
+  splat.source = sums;
+  splat.destination = sums + (size_t)cells * 4;
+  for (splat.axis = 0; splat.axis < 3; splat.axis++)
+  {
+    parallelFor(volume->size[splat.axis == 2 ? 1 : 2], spreadPart, &splat);
+    splat.destination = splat.source;
+    splat.source = sums + (splat.source == sums ? (size_t)cells * 4 : 0);
+  }
+  parallelFor(volume->size[2], texelLayer, &splat);
+
+  // One quad through the cell centres of every layer along "along", the
+  // furthest first
+  slices = volume->size[along];
+  for (slice = 0, vertex = volume->vertices; slice < slices; slice++)
+  {
+    layer = forward[along] > 0.0f ? slices - 1 - slice : slice;
+    for (corner = 0; corner < 4; corner++, vertex++)
+    {
+      across = (along + 1) % 3;
+      texture[across] = corner == 1 || corner == 2;
+      texture[(along + 2) % 3] = corner >= 2;
+      texture[along] = (layer + 0.5f) / slices;
+      vertex->s = texture[0];
+      vertex->t = texture[1];
+      vertex->r = texture[2];
+      vertex->x = splat.origin[0] + texture[0] * volume->size[0] * splat.cellSize;
+      vertex->y = splat.origin[1] + texture[1] * volume->size[1] * splat.cellSize;
+      vertex->z = splat.origin[2] + texture[2] * volume->size[2] * splat.cellSize;
+    }
+  }
+  volume->vertexCount = 4 * slices;
+  return 1;
+}
@@ -0,0 +1,27 @@
+/******************************************************************************
+* File:         smokeVolume.h
+* Brief:        Level of detail for dense smoke: a coarse density volume
+******************************************************************************/
+#ifndef SMOKE_VOLUME_H
+#define SMOKE_VOLUME_H
+
+#include "renderBuffer.h"
+
+
+
+/******************************************************************************
+* Volume parameters
+******************************************************************************/
+#define VOLUME_TASKS 8					// Splatting tasks (fixed, see smokeVolume.c)
+#define SMOKE_IMAGE_COVERAGE 0.37		// Mean alpha of the smoke images
+#define SMOKE_PROFILE_REACH 0.75		// Reach of their alpha, relative to half
+										// the sprite size
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+int buildSmokeVolume(SmokeVolume*, const Billboard*); // Splat smoke, 0 if none to splat
+
+#endif
@@ -0,0 +1,546 @@
+/******************************************************************************
+* File:         snapshot.c
+* Brief:        Binary snapshots of the simulation state
+*
+* Note:
+* A snapshot holds everything the simulation continues from: the live
+* particles of both systems with their chunk bounds, the emitters, the drop
+* heap of --analytic-water, the clocks and emission state, gravity, wind,
+* smoke colour and the random seed (chunk streams are derived from the seed
+* and the step, see chunkStreamID()), and the options which change how the
+* state evolves. A run restored from a snapshot therefore continues exactly
+* as the run which saved it, given the same inputs (input.c).
+*
+* The file is a header followed by one section per array (the emitters
+* first), each starting at a multiple of PARTICLE_ALIGNMENT, in native byte
+* order and precision; the header records both and the version, files which
+* do not match are refused.
+* Saving copies the state into a buffer, so the simulation can go on while
+* another thread writes the buffer to a temporary file, renamed over the
+* snapshot once complete. Restoring maps the file into memory and copies
+* each section straight into the resized particle arrays.
+******************************************************************************/
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "particleSystem.h"
+#include "rng.h"
+#include "emitter.h"
+#include "ballistic.h"
+#include "headless.h"
+#include "snapshot.h"
+
+
+
+/******************************************************************************
+* File layout
+******************************************************************************/
+#define SNAPSHOT_MAGIC "PSYSSNAP"
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_SECTIONS 40
+
+// Flags of the options stored with the state
+#define SNAPSHOT_ANALYTIC_WATER 1
+#define SNAPSHOT_WATER_COLLISIONS 2
+#define SNAPSHOT_SMOKE_DENSITY 4
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;                   // SNAPSHOT_BYTE_ORDER as written
+  uint32_t realSize;                    // sizeof(real)
+  uint32_t flags;
+  uint64_t size;                        // Whole file
+  uint64_t seed;
+  RandomStream defaultStream;
+  double gravity, windSpeed;
+  int32_t angle;
+  int32_t maxParticles;
+  double timeScale;
+  int32_t waterTotal, waterAlive, waterBounds;
+  int32_t smokeTotal, smokeAlive, smokeBounds;
+  SimulationClock waterClock, smokeClock;
+  Emission waterEmission, smokeEmission;
+  int32_t spawnBudget;
+  double smokeColour[3], chaoticSpeed;
+  int32_t waterEmitters, smokeEmitters;
+  int32_t heapSize;                     // Drop heap (--analytic-water)
+  double trajectoryScale, trajectoryAcceleration;
+} SnapshotHeader;
+
+// Arrays whose contents are checked when restoring (see checkSections())
+enum {
+  SECTION_WATER_TAGS = 1,
+  SECTION_SMOKE_TAGS,
+  SECTION_DROP_ENTRIES,
+  SECTION_HEAP_DROPS,
+  SECTION_CHECKS
+};
+
+// One array of the state, where it is in memory, its size in bytes and how
+// its contents are checked (0 = not at all)
+typedef struct {
+  void *data;
+  size_t size;
+  int check;
+} Section;
+
+// Snapshot handed to the writing thread
+typedef struct {
+  char *path;
+  void *data;
+  size_t size;
+} SnapshotWrite;
+
+static pthread_t writer;
+static int writing;
+
+
+
+/******************************************************************************
+* Sections of the state described by "header", pointing at the current
+* arrays (sized for the counts in the header when restoring). Returns their
+* number.
+******************************************************************************/
+static int snapshotSections(const SnapshotHeader *header, Section *sections)
+{
+  real *water[9] = { fountain.xpos, fountain.ypos, fountain.zpos,
+                     fountain.xvel, fountain.yvel, fountain.zvel,
+                     fountain.xprev, fountain.yprev, fountain.zprev };
+  real *smoke[13] = { smokeEmitter.xpos, smokeEmitter.ypos, smokeEmitter.zpos,
+                      smokeEmitter.xvel, smokeEmitter.yvel, smokeEmitter.zvel,
+                      smokeEmitter.xprev, smokeEmitter.yprev, smokeEmitter.zprev,
+                      smokeEmitter.r, smokeEmitter.g, smokeEmitter.b, smokeEmitter.alpha };
+  size_t waterReal = (size_t)header->waterAlive * sizeof(real);
+  size_t smokeReal = (size_t)header->smokeAlive * sizeof(real);
+  double *heapDeath;
+  int *heapDrop, *dropEntry;
+  int array, count = 0;
+
+  sections[count++] = (Section){ waterSources.emitters,
+                                 header->waterEmitters * sizeof(Emitter), 0 };
+  sections[count++] = (Section){ smokeSources.emitters,
+                                 header->smokeEmitters * sizeof(Emitter), 0 };
+  for (array = 0; array < 9; array++)
+    sections[count++] = (Section){ water[array], waterReal, 0 };
+  sections[count++] = (Section){ fountain.emitter, header->waterAlive * sizeof(unsigned short),
+                                 SECTION_WATER_TAGS };
+  sections[count++] = (Section){ fountain.bounds,
+                                 header->waterBounds * sizeof(ParticleBounds), 0 };
+  for (array = 0; array < 13; array++)
+    sections[count++] = (Section){ smoke[array], smokeReal, 0 };
+  sections[count++] = (Section){ smokeEmitter.textureIndex, (size_t)header->smokeAlive, 0 };
+  sections[count++] = (Section){ smokeEmitter.emitter,
+                                 header->smokeAlive * sizeof(unsigned short),
+                                 SECTION_SMOKE_TAGS };
+  sections[count++] = (Section){ smokeEmitter.bounds,
+                                 header->smokeBounds * sizeof(ParticleBounds), 0 };
+  if (header->flags & SNAPSHOT_ANALYTIC_WATER) {
+    ballisticHeap(&heapDeath, &heapDrop, &dropEntry);
+    sections[count++] = (Section){ trajectories.birth, header->waterAlive * sizeof(double), 0 };
+    sections[count++] = (Section){ dropEntry, header->waterAlive * sizeof(int),
+                                   SECTION_DROP_ENTRIES };
+    sections[count++] = (Section){ heapDeath, header->heapSize * sizeof(double), 0 };
+    sections[count++] = (Section){ heapDrop, header->heapSize * sizeof(int), SECTION_HEAP_DROPS };
+  }
+  return count;
+}
+
+// Offset of the section following one which ends at "offset"
+static size_t alignSection(size_t offset)
+{
+  return (offset + PARTICLE_ALIGNMENT - 1) / PARTICLE_ALIGNMENT * PARTICLE_ALIGNMENT;
+}
+
+// Size of a file holding "count" sections
+static size_t snapshotSize(const Section *sections, int count)
+{
+  size_t size = sizeof(SnapshotHeader);
+  int section;
+
+  for (section = 0; section < count; section++)
+    size = alignSection(size) + sections[section].size;
+  return size;
+}
+
+
+
+/******************************************************************************
+* Describe the current state
+******************************************************************************/
+static void describeState(SnapshotHeader *header)
+{
+  int heapSize = 0;
+  double *heapDeath;
+  int *heapDrop, *dropEntry;
+
+  if (options.analyticWater)
+    heapSize = ballisticHeap(&heapDeath, &heapDrop, &dropEntry);
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->byteOrder = SNAPSHOT_BYTE_ORDER;
+  header->realSize = sizeof(real);
+  header->flags = (options.analyticWater ? SNAPSHOT_ANALYTIC_WATER : 0) |
+                  (options.waterCollisions ? SNAPSHOT_WATER_COLLISIONS : 0) |
+                  (options.smokeDensity ? SNAPSHOT_SMOKE_DENSITY : 0);
+  header->seed = randomSeed;
+  header->defaultStream = defaultStream;
+  header->gravity = gravity;
+  header->windSpeed = windSpeed;
+  header->angle = angle;
+  header->maxParticles = options.maxParticles;
+  header->timeScale = options.timeScale;
+  header->waterTotal = fountain.totalParticles;
+  header->waterAlive = fountain.aliveParticles;
+  header->waterBounds = fountain.boundsCount;
+  header->smokeTotal = smokeEmitter.totalParticles;
+  header->smokeAlive = smokeEmitter.aliveParticles;
+  header->smokeBounds = smokeEmitter.boundsCount;
+  header->waterClock = fountain.clock;
+  header->smokeClock = smokeEmitter.clock;
+  header->waterEmission = fountain.emission;
+  header->smokeEmission = smokeEmitter.emission;
+  header->spawnBudget = options.spawnBudget;
+  header->smokeColour[0] = smokeEmitter.r0;
+  header->smokeColour[1] = smokeEmitter.g0;
+  header->smokeColour[2] = smokeEmitter.b0;
+  header->chaoticSpeed = smokeEmitter.chaoticSpeed;
+  header->waterEmitters = waterSources.count;
+  header->smokeEmitters = smokeSources.count;
+  header->heapSize = heapSize;
+  header->trajectoryScale = trajectories.timeScale;
+  header->trajectoryAcceleration = trajectories.acceleration;
+}
+
+
+
+/******************************************************************************
+* Write a snapshot buffer to its file (writing thread)
+******************************************************************************/
+static void *writeSnapshot(void *snapshotWrite)
+{
+  SnapshotWrite *write = snapshotWrite;
+  size_t length = strlen(write->path);
+  char *temporary = malloc(length + 5);
+  FILE *file = NULL;
+  int written = 0;
+
+  if (temporary) {
+    sprintf(temporary, "%s.tmp", write->path);
+    file = fopen(temporary, "wb");
+  }
+  if (file) {
+    written = fwrite(write->data, 1, write->size, file) == write->size;
+    written = !fclose(file) && written && !rename(temporary, write->path);
+  }
+  if (written)
+    printf("Snapshot written to %s (%.1f MB)\n", write->path, write->size / 1048576.0);
+  else
+    fprintf(stderr, "Could not write snapshot %s\n", write->path);
+
+  free(temporary);
+  free(write->data);
+  free(write->path);
+  free(write);
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Copy the state into a snapshot of file "path", written in the background.
+* Must be called while the simulation is idle. Returns 0 on failure.
+******************************************************************************/
+int saveSnapshot(const char *path)
+{
+  static int registered;
+  Section sections[SNAPSHOT_SECTIONS];
+  SnapshotHeader header;
+  SnapshotWrite *write;
+  size_t offset = sizeof(SnapshotHeader);
+  int section, count;
+
+  finishSnapshot();
+  describeState(&header);
+  count = snapshotSections(&header, sections);
+  header.size = snapshotSize(sections, count);
+
+  write = malloc(sizeof(SnapshotWrite));
+  if (write) {
+    write->path = malloc(strlen(path) + 1);
+    write->data = calloc(1, header.size);
+    write->size = header.size;
+  }
+  if (!write || !write->path || !write->data) {
+    fprintf(stderr, "Could not allocate snapshot of %.1f MB\n", header.size / 1048576.0);
+    if (write) {
+      free(write->path);
+      free(write->data);
+      free(write);
+    }
+    return 0;
+  }
+  strcpy(write->path, path);
+  memcpy(write->data, &header, sizeof(header));
+  for (section = 0; section < count; section++)
+  {
+    offset = alignSection(offset);
+    if (sections[section].size > 0)
+      memcpy((char*)write->data + offset, sections[section].data, sections[section].size);
+    offset += sections[section].size;
+  }
+
+  if (!registered) {
+    atexit(finishSnapshot);
+    registered = 1;
+  }
+  if (pthread_create(&writer, NULL, writeSnapshot, write))
+    writeSnapshot(write);
+  else
+    writing = 1;
+  return 1;
+}
+
+
+
+/******************************************************************************
+* Wait until the snapshot being written (if any) is complete
+******************************************************************************/
+void finishSnapshot(void)
+{
+  if (writing) {
+    pthread_join(writer, NULL);
+    writing = 0;
+  }
+}
+
+
+
+/******************************************************************************
+* Check a header read from a file of "size" bytes, returns an error message
+* or NULL if the snapshot can be restored
+******************************************************************************/
+static const char *checkHeader(const SnapshotHeader *header, size_t size)
+{
+  int chunks = (header->maxParticles + PARTICLE_CHUNK_SIZE - 1) / PARTICLE_CHUNK_SIZE;
+
+  if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, 8))
+    return "not a snapshot";
+  if (header->version != SNAPSHOT_VERSION)
+    return "snapshot version not supported";
+  if (header->byteOrder != SNAPSHOT_BYTE_ORDER || header->realSize != sizeof(real))
+    return "snapshot written on another platform or in another precision";
+  if (header->size != size)
+    return "snapshot truncated";
+  if (header->maxParticles < 1 || header->maxParticles > PARTICLE_LIMIT ||
+      header->waterAlive < 0 || header->waterAlive > header->maxParticles ||
+      header->smokeAlive < 0 || header->smokeAlive > header->maxParticles ||
+      header->waterTotal < 1 || header->waterTotal > header->maxParticles ||
+      header->smokeTotal < 1 || header->smokeTotal > header->maxParticles ||
+      header->waterBounds < 0 || header->waterBounds > chunks ||
+      header->smokeBounds < 0 || header->smokeBounds > chunks ||
+      header->waterEmitters < 1 || header->waterEmitters > EMITTER_LIMIT ||
+      header->smokeEmitters < 1 || header->smokeEmitters > EMITTER_LIMIT ||
+      header->heapSize < 0 || header->heapSize > header->waterAlive ||
+      ((header->flags & SNAPSHOT_ANALYTIC_WATER) && header->heapSize != header->waterAlive))
+    return "snapshot damaged";
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Check the arrays of the snapshot in "data" (header already checked) which
+* index others: every particle must be tagged with one of the saved
+* emitters, and the drop heap of --analytic-water must hold every live drop
+* once, at the entry the drop records. Returns an error message or NULL.
+******************************************************************************/
+static const char *checkSections(const SnapshotHeader *header, const char *data)
+{
+  Section sections[SNAPSHOT_SECTIONS];
+  const char *contents[SECTION_CHECKS] = { NULL };
+  const unsigned short *waterTags, *smokeTags;
+  const int *entries, *drops;
+  size_t offset = sizeof(SnapshotHeader);
+  int section, index, count = snapshotSections(header, sections);
+
+  for (section = 0; section < count; section++)
+  {
+    offset = alignSection(offset);
+    contents[sections[section].check] = data + offset;
+    offset += sections[section].size;
+  }
+
+  waterTags = (const unsigned short*)contents[SECTION_WATER_TAGS];
+  smokeTags = (const unsigned short*)contents[SECTION_SMOKE_TAGS];
+  for (index = 0; index < header->waterAlive; index++)
+    if (waterTags[index] >= header->waterEmitters)
+      return "particle of an emitter which is not saved";
+  for (index = 0; index < header->smokeAlive; index++)
+    if (smokeTags[index] >= header->smokeEmitters)
+      return "particle of an emitter which is not saved";
+
+  if (header->flags & SNAPSHOT_ANALYTIC_WATER) {
+    entries = (const int*)contents[SECTION_DROP_ENTRIES];
+    drops = (const int*)contents[SECTION_HEAP_DROPS];
+    for (index = 0; index < header->heapSize; index++)
+      if (drops[index] < 0 || drops[index] >= header->waterAlive || entries[drops[index]] != index)
+        return "snapshot damaged";
+  }
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Make the arrays of one particle system hold its saved particles and chunk
+* bounds (the bounds of the last step may cover more chunks than are alive)
+******************************************************************************/
+static void fitParticles(int *total, int *alive, int savedTotal, int savedAlive, int bounds)
+{
+  *alive = 0;
+  *total = savedTotal > savedAlive ? savedTotal : savedAlive;
+  *total = *total > bounds * PARTICLE_CHUNK_SIZE ? *total : bounds * PARTICLE_CHUNK_SIZE;
+  resizeParticles();
+  *total = savedTotal;
+  *alive = savedAlive;
+}
+
+
+
+/******************************************************************************
+* Restore the state from snapshot file "path". Must be called while the
+* simulation is idle. Returns 0, with the state unchanged, on failure.
+******************************************************************************/
+int loadSnapshot(const char *path)
+{
+  Section sections[SNAPSHOT_SECTIONS];
+  SnapshotHeader header;
+  const char *error, *data;
+  double start = wallClock();
+  size_t offset = sizeof(SnapshotHeader);
+  struct stat status;
+  int file, section, count;
+
+  finishSnapshot();
+  file = open(path, O_RDONLY);
+  if (file < 0 || fstat(file, &status) || status.st_size < (off_t)sizeof(SnapshotHeader)) {
+    fprintf(stderr, "Could not read snapshot %s\n", path);
+    if (file >= 0)
+      close(file);
+    return 0;
+  }
+  data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map snapshot %s\n", path);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(header));
+  error = checkHeader(&header, status.st_size);
+  if (!error && snapshotSize(sections, snapshotSections(&header, sections)) !=
+                header.size)
+    error = "snapshot damaged";
+  if (!error)
+    error = checkSections(&header, data);
+  if (error) {
+    fprintf(stderr, "Could not restore %s: %s\n", path, error);
+    munmap((void*)data, status.st_size);
+    return 0;
+  }
+
+  // Options and globals first, particle counts are limited by them
+  options.maxParticles = header.maxParticles;
+  options.timeScale = header.timeScale;
+  options.analyticWater = (header.flags & SNAPSHOT_ANALYTIC_WATER) != 0;
+  options.waterCollisions = (header.flags & SNAPSHOT_WATER_COLLISIONS) != 0;
+  options.smokeDensity = (header.flags & SNAPSHOT_SMOKE_DENSITY) != 0;
+  options.seed = header.seed;
+  seedRandom(header.seed);
+  defaultStream = header.defaultStream;
+  gravity = header.gravity;
+  windSpeed = header.windSpeed;
+  angle = header.angle;
+  computeWind();
+  fountain.clock = header.waterClock;
+  smokeEmitter.clock = header.smokeClock;
+  fountain.emission = header.waterEmission;
+  smokeEmitter.emission = header.smokeEmission;
+  options.waterRate = header.waterEmission.rate;
+  options.smokeRate = header.smokeEmission.rate;
+  options.spawnBudget = header.spawnBudget;
+  smokeEmitter.r0 = header.smokeColour[0];
+  smokeEmitter.g0 = header.smokeColour[1];
+  smokeEmitter.b0 = header.smokeColour[2];
+  smokeEmitter.chaoticSpeed = header.chaoticSpeed;
+
+  // Size the arrays for the saved particles, then copy the sections in
+  fitParticles(&fountain.totalParticles, &fountain.aliveParticles, header.waterTotal,
+               header.waterAlive, header.waterBounds);
+  fitParticles(&smokeEmitter.totalParticles, &smokeEmitter.aliveParticles, header.smokeTotal,
+               header.smokeAlive, header.smokeBounds);
+  fountain.boundsCount = header.waterBounds;
+  smokeEmitter.boundsCount = header.smokeBounds;
+  resetBallistic();
+
+  // The emitters come first, the registries are sized for them before the
+  // sections are copied (which copies them once more)
+  offset = alignSection(sizeof(SnapshotHeader));
+  setEmitters(&waterSources, (const Emitter*)(data + offset), header.waterEmitters);
+  offset = alignSection(offset + header.waterEmitters * sizeof(Emitter));
+  setEmitters(&smokeSources, (const Emitter*)(data + offset), header.smokeEmitters);
+  offset = sizeof(SnapshotHeader);
+  count = snapshotSections(&header, sections);
+  for (section = 0; section < count; section++)
+  {
+    offset = alignSection(offset);
+    if (sections[section].size > 0)
+      memcpy(sections[section].data, data + offset, sections[section].size);
+    offset += sections[section].size;
+  }
+  if (options.analyticWater) {
+    trajectories.timeScale = header.trajectoryScale;
+    trajectories.acceleration = header.trajectoryAcceleration;
+    setBallisticHeap(header.heapSize);
+  }
+  munmap((void*)data, status.st_size);
+
+  printf("Snapshot %s restored: %d water and %d smoke particles in %.1f ms\n", path,
+         fountain.aliveParticles, smokeEmitter.aliveParticles, (wallClock() - start) * 1e3);
+  return 1;
+}
+
+
+
+/******************************************************************************
+* 64-bit hash of the state saved in a snapshot (without the header), equal
+* for equal states. Used to compare replays (input.c).
+******************************************************************************/
+uint64_t stateChecksum(void)
+{
+  Section sections[SNAPSHOT_SECTIONS];
+  SnapshotHeader header;
+  uint64_t hash = 0xcbf29ce484222325ULL, word;
+  const unsigned char *bytes;
+  size_t index;
+  int section, count;
+
+  describeState(&header);
+  count = snapshotSections(&header, sections);
+  for (section = 0; section < count; section++)
+  {
+    bytes = sections[section].data;
+    for (index = 0; index + 8 <= sections[section].size; index += 8)
+    {
+      memcpy(&word, bytes + index, 8);
+      hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; index < sections[section].size; index++)
+      hash = (hash ^ bytes[index]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,28 @@
+/******************************************************************************
+* File:         snapshot.h
+* Brief:        Binary snapshots of the simulation state
+******************************************************************************/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Snapshot parameters
+******************************************************************************/
+#define SNAPSHOT_VERSION 2				// Incremented whenever the layout changes
+#define SNAPSHOT_FILE "particleSystem.snapshot" // Default of --snapshot
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+int saveSnapshot(const char*);			// Write the state in the background
+void finishSnapshot(void);				// Wait for a snapshot being written
+int loadSnapshot(const char*);			// Restore the state, 0 on failure
+uint64_t stateChecksum(void);			// Hash of the state a snapshot holds
+
+#endif
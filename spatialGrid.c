@@ -0,0 +1,309 @@
+/******************************************************************************
+* File:         spatialGrid.c
+* Brief:        Uniform spatial hash grid for fixed-radius neighbour queries
+*
+* Note:
+* Space is divided into cubic cells, each cell is hashed to one of a power of
+* two buckets. The grid is rebuilt from scratch every step: the bucket of
+* every particle is computed, then the particles are sorted by bucket with a
+* least significant digit radix sort, whose passes are parallel counting
+* sorts (each block of particles counts its digits, a prefix sum over
+* (digit, block) gives every block its place in each bucket, then the blocks
+* scatter independently). The sort is stable, so particles of one bucket
+* stay in index order and results do not depend on the thread count.
+*
+* Cells next to each other along X get consecutive buckets, so particles of
+* a row of cells are next to each other in the sorted order. A query with a
+* radius up to the cell size visits the 27 cells around the point, its own
+* cell first as it holds most of the neighbours. The hash is linear in the
+* cell coordinates, so the buckets of these cells are at fixed offsets from
+* the bucket of the point: offsets shared by several cells (hash collisions)
+* are dropped when the grid is built, particles of other cells in a bucket
+* are rejected by the distance test. Queries for particles taken in the 
+* sorted order touch the same buckets one after the other and mostly hit 
+* the cache.
+******************************************************************************/
+#include "spatialGrid.h"
+#include "threadPool.h"
+
+
+
+/******************************************************************************
+* Sort state, digit counts of each block of the current pass. Only one grid
+* is built at a time.
+******************************************************************************/
+#define GRID_BLOCK_SIZE PARTICLE_CHUNK_SIZE
+#define GRID_BUCKETS (1 << GRID_DIGIT_BITS)
+
+static int (*offsets)[GRID_BUCKETS];
+static int blockCapacity;
+
+// One pass of the sort and the positions being sorted
+typedef struct {
+  SpatialGrid *grid;
+  int shift;                            // First bit of the digit
+  const real *x, *y, *z;
+} GridPass;
+
+
+
+/******************************************************************************
+* Grow the grid buffers, contents are not kept
+******************************************************************************/
+static void *grow(void *buffer, size_t size)
+{
+  free(buffer);
+  buffer = malloc(size);
+  if (!buffer) {
+    fprintf(stderr, "Could not allocate spatial grid\n");
+    exit(1);
+  }
+  return buffer;
+}
+
+static void reserveGrid(SpatialGrid *grid, int blocks)
+{
+  if (grid->count > grid->capacity) {
+    grid->key = grow(grid->key, (size_t)grid->count * sizeof(unsigned int));
+    grid->order = grow(grid->order, (size_t)grid->count * sizeof(int));
+    grid->spareKey = grow(grid->spareKey, (size_t)grid->count * sizeof(unsigned int));
+    grid->spareOrder = grow(grid->spareOrder, (size_t)grid->count * sizeof(int));
+    grid->x = grow(grid->x, (size_t)grid->count * sizeof(real));
+    grid->y = grow(grid->y, (size_t)grid->count * sizeof(real));
+    grid->z = grow(grid->z, (size_t)grid->count * sizeof(real));
+    grid->capacity = grid->count;
+  }
+  if ((1 << grid->bits) > grid->startCapacity) {
+    grid->start = grow(grid->start, ((size_t)1 << grid->bits) * sizeof(int));
+    grid->startCapacity = 1 << grid->bits;
+  }
+  if (blocks > blockCapacity) {
+    offsets = grow(offsets, (size_t)blocks * sizeof(*offsets));
+    blockCapacity = blocks;
+  }
+}
+
+
+
+/******************************************************************************
+* Cell of a coordinate and bucket of a cell
+******************************************************************************/
+static inline int cellOf(real position, real cellSize)
+{
+  return (int)floor(position / cellSize);
+}
+
+static inline unsigned int bucketOf(int x, int y, int z, int bits)
+{
+  return ((unsigned int)x + (unsigned int)y * 19349663u + (unsigned int)z * 83492791u) & 
+         ((1u << bits) - 1);
+}
+
+// Cells visited by a query: the cell of the point, then those sharing a face,
+// an edge and a corner with it
+static const signed char queryCells[27][3] = {
+  { 0, 0, 0}, {-1, 0, 0}, { 1, 0, 0}, { 0,-1, 0}, { 0, 1, 0}, { 0, 0,-1}, { 0, 0, 1},
+  {-1,-1, 0}, { 1,-1, 0}, {-1, 1, 0}, { 1, 1, 0}, {-1, 0,-1}, { 1, 0,-1}, {-1, 0, 1}, 
+  { 1, 0, 1}, { 0,-1,-1}, { 0, 1,-1}, { 0,-1, 1}, { 0, 1, 1}, {-1,-1,-1}, { 1,-1,-1}, 
+  {-1, 1,-1}, { 1, 1,-1}, {-1,-1, 1}, { 1,-1, 1}, {-1, 1, 1}, { 1, 1, 1}
+};
+
+
+
+/******************************************************************************
+* Blocks of the sort: compute the buckets (counting the first digit), count
+* the digit of a later pass, move the entries to their places
+******************************************************************************/
+static void hashBlock(int block, void *gridPass)
+{
+  const GridPass *pass = gridPass;
+  SpatialGrid *grid = pass->grid;
+  int index, first = block * GRID_BLOCK_SIZE;
+  int last = first + GRID_BLOCK_SIZE < grid->count ? first + GRID_BLOCK_SIZE : grid->count;
+  unsigned int bucket;
+
+  memset(offsets[block], 0, sizeof(offsets[0]));
+  for (index = first; index < last; index++)
+  {
+    bucket = bucketOf(cellOf(pass->x[index], grid->cellSize), 
+                      cellOf(pass->y[index], grid->cellSize),
+                      cellOf(pass->z[index], grid->cellSize), grid->bits);
+    grid->key[index] = bucket;
+    grid->order[index] = index;
+    offsets[block][bucket & (GRID_BUCKETS - 1)]++;
+  }
+}
+
+static void countBlock(int block, void *gridPass)
+{
+  const GridPass *pass = gridPass;
+  const SpatialGrid *grid = pass->grid;
+  int index, first = block * GRID_BLOCK_SIZE;
+  int last = first + GRID_BLOCK_SIZE < grid->count ? first + GRID_BLOCK_SIZE : grid->count;
+
+  memset(offsets[block], 0, sizeof(offsets[0]));
+  for (index = first; index < last; index++)
+    offsets[block][(grid->key[index] >> pass->shift) & (GRID_BUCKETS - 1)]++;
+}
+
+static void scatterBlock(int block, void *gridPass)
+{
+  const GridPass *pass = gridPass;
+  SpatialGrid *grid = pass->grid;
+  int index, destination, first = block * GRID_BLOCK_SIZE;
+  int last = first + GRID_BLOCK_SIZE < grid->count ? first + GRID_BLOCK_SIZE : grid->count;
+  int *offset = offsets[block];
+
+  for (index = first; index < last; index++)
+  {
+    destination = offset[(grid->key[index] >> pass->shift) & (GRID_BUCKETS - 1)]++;
+    grid->spareKey[destination] = grid->key[index];
+    grid->spareOrder[destination] = grid->order[index];
+  }
+}
+
+// First destination of every (digit, block), blocks in order within a digit
+static void prefixSum(int blocks)
+{
+  int block, digit, total = 0, count;
+
+  for (digit = 0; digit < GRID_BUCKETS; digit++)
+  {
+    for (block = 0; block < blocks; block++)
+    {
+      count = offsets[block][digit];
+      offsets[block][digit] = total;
+      total += count;
+    }
+  }
+}
+
+// Record the first entry of every bucket starting in a block, copy the 
+// positions of the entries
+static void markBlock(int block, void *gridPass)
+{
+  const GridPass *pass = gridPass;
+  SpatialGrid *grid = pass->grid;
+  int index, first = block * GRID_BLOCK_SIZE;
+  int last = first + GRID_BLOCK_SIZE < grid->count ? first + GRID_BLOCK_SIZE : grid->count;
+
+  for (index = first; index < last; index++)
+  {
+    if (index == 0 || grid->key[index] != grid->key[index - 1])
+      grid->start[grid->key[index]] = index;
+    grid->x[index] = pass->x[grid->order[index]];
+    grid->y[index] = pass->y[grid->order[index]];
+    grid->z[index] = pass->z[grid->order[index]];
+  }
+}
+
+
+
+/******************************************************************************
+* Bucket offsets of the cells visited by a query, each offset only once
+******************************************************************************/
+static void aroundOffsets(SpatialGrid *grid)
+{
+  int cell, seen;
+  unsigned int offset;
+
+  grid->aroundCount = 0;
+  for (cell = 0; cell < 27; cell++)
+  {
+    offset = bucketOf(queryCells[cell][0], queryCells[cell][1], queryCells[cell][2], grid->bits);
+    for (seen = 0; seen < grid->aroundCount && grid->around[seen] != offset; seen++)
+      ;
+    if (seen == grid->aroundCount)
+      grid->around[grid->aroundCount++] = offset;
+  }
+}
+
+
+
+/******************************************************************************
+* Sort "count" particles at positions (x, y, z) into cells of size "cellSize"
+******************************************************************************/
+void buildGrid(SpatialGrid *grid, const real *x, const real *y, const real *z, int count,
+               real cellSize)
+{
+  int blocks = (count + GRID_BLOCK_SIZE - 1) / GRID_BLOCK_SIZE;
+  unsigned int *swapKey;
+  int *swapOrder;
+  GridPass pass;
+
+  grid->count = count;
+  grid->cellSize = cellSize;
+  for (grid->bits = GRID_MIN_BITS; grid->bits < GRID_MAX_BITS && (1 << grid->bits) < count;
+       grid->bits++)
+    ;
+  reserveGrid(grid, blocks);
+  aroundOffsets(grid);
+  memset(grid->start, 0xff, ((size_t)1 << grid->bits) * sizeof(int));
+  if (count == 0)
+    return;
+
+  pass.grid = grid;
+  pass.x = x;
+  pass.y = y;
+  pass.z = z;
+  parallelFor(blocks, hashBlock, &pass);
+  for (pass.shift = 0; pass.shift < grid->bits; pass.shift += GRID_DIGIT_BITS)
+  {
+    if (pass.shift > 0)
+      parallelFor(blocks, countBlock, &pass);
+    prefixSum(blocks);
+    parallelFor(blocks, scatterBlock, &pass);
+    swapKey = grid->key;
+    grid->key = grid->spareKey;
+    grid->spareKey = swapKey;
+    swapOrder = grid->order;
+    grid->order = grid->spareOrder;
+    grid->spareOrder = swapOrder;
+  }
+  parallelFor(blocks, markBlock, &pass);
+}
+
+
+
+/******************************************************************************
+* Write the entries within "radius" (at most the cell size) of point
+* (x, y, z) to "neighbours", except entry "exclude". At most
+* GRID_MAX_NEIGHBOURS are returned, in the order they are found among the
+* first GRID_MAX_CANDIDATES entries of the visited buckets. Returns their 
+* number. The particle of an entry is grid->order[entry].
+******************************************************************************/
+int gridNeighbours(const SpatialGrid *grid, real x, real y, real z, real radius, int exclude,
+                   int *neighbours)
+{
+  unsigned int base, bucket, mask = (1u << grid->bits) - 1;
+  int cell, entry, last, candidates = GRID_MAX_CANDIDATES, found = 0;
+  real xd, yd, zd, limit = radius * radius;
+
+  if (grid->count == 0)
+    return 0;
+  base = bucketOf(cellOf(x, grid->cellSize), cellOf(y, grid->cellSize), 
+                  cellOf(z, grid->cellSize), grid->bits);
+
+  for (cell = 0; cell < grid->aroundCount; cell++)
+  {
+    bucket = (base + grid->around[cell]) & mask;
+    entry = grid->start[bucket];
+    if (entry < 0)
+      continue;
+    last = entry + candidates < grid->count ? entry + candidates : grid->count;
+    for (; entry < last && grid->key[entry] == bucket; entry++, candidates--)
+    {
+      xd = grid->x[entry] - x;
+      yd = grid->y[entry] - y;
+      zd = grid->z[entry] - z;
+      if (entry == exclude || xd * xd + yd * yd + zd * zd > limit)
+        continue;
+      neighbours[found++] = entry;
+      if (found == GRID_MAX_NEIGHBOURS)
+        return found;
+    }
+    if (candidates == 0)
+      return found;
+  }
+  return found;
+}
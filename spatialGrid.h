@@ -0,0 +1,58 @@
+/******************************************************************************
+* File:         spatialGrid.h
+* Brief:        Uniform spatial hash grid for fixed-radius neighbour queries
+******************************************************************************/
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include "particleSystem.h"
+
+
+
+/******************************************************************************
+* Grid parameters. The number of buckets follows the number of particles, a
+* query returns at most GRID_MAX_NEIGHBOURS particles and examines at most
+* GRID_MAX_CANDIDATES, so the work per particle stays bounded even where 
+* many particles share a few cells.
+******************************************************************************/
+#define GRID_MIN_BITS 10				// Fewest and most buckets (log2)
+#define GRID_MAX_BITS 24
+#define GRID_DIGIT_BITS 8				// Bits sorted by each pass
+#define GRID_MAX_NEIGHBOURS 32
+#define GRID_MAX_CANDIDATES 256
+
+
+
+/******************************************************************************
+* Particles sorted by the hash bucket of their cell. "order" lists the
+* particles bucket by bucket (entries), "key" holds the bucket and x, y, z
+* the position of each entry, start[bucket] is the first entry of each 
+* bucket (-1 if it is empty).
+******************************************************************************/
+typedef struct {
+	int count;							// Number of particles
+	real cellSize;						// Edge of a cell, largest query radius
+	int bits;							// log2 of the number of buckets
+	unsigned int around[27];			// Distinct bucket offsets of the cells 
+	int aroundCount;					// visited by a query
+	unsigned int *key;					// Bucket of each sorted particle
+	int *order;							// Particles sorted by bucket
+	real *x, *y, *z;					// Their positions
+	int *start;							// First entry of each bucket
+	unsigned int *spareKey;				// Sort buffers
+	int *spareOrder;
+	int capacity;						// Particles the buffers can hold
+	int startCapacity;					// Buckets "start" can hold
+} SpatialGrid;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void buildGrid(SpatialGrid*, const real*, const real*, const real*, int, real);
+										// Sort particles into cells of given size
+int gridNeighbours(const SpatialGrid*, real, real, real, real, int, int*);
+										// Entries within radius of a point
+
+#endif
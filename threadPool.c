@@ -0,0 +1,151 @@
+/******************************************************************************
+* File:         threadPool.c
+* Brief:        Fixed-size pool of worker threads executing parallel loops
+*
+* Note:
+* Workers sleep on a condition variable until parallelFor() publishes a new 
+* loop. Loop indices are then handed out one at a time through an atomic 
+* counter to the workers and the calling thread, which returns once every 
+* worker has finished. Tasks must not depend on which thread runs them.
+* The share of a loop run by each thread is traced as a zone (trace.c).
+******************************************************************************/
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadPool.h"
+#include "trace.h"
+
+
+
+/******************************************************************************
+* Pool state
+******************************************************************************/
+int threadCount = 1;
+
+static pthread_t workers[MAX_THREADS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static ParallelTask currentTask;        // Loop being executed
+static void *currentArg;
+static int taskCount;
+static atomic_int nextTask;             // Next loop index to hand out
+static int generation;                  // Incremented for every new loop
+static int busyWorkers;                 // Workers still executing the loop
+
+
+
+/******************************************************************************
+* Execute loop indices until there are none left
+******************************************************************************/
+static void runTasks(ParallelTask task, void *arg, int count)
+{
+  int index;
+
+  TRACE_BEGIN("parallelFor");
+  while ((index = atomic_fetch_add(&nextTask, 1)) < count)
+    task(index, arg);
+  TRACE_END();
+}
+
+
+
+/******************************************************************************
+* Worker thread main loop, "number" counts the workers from 1
+******************************************************************************/
+static void *worker(void *number)
+{
+  int seenGeneration = 0;
+  ParallelTask task;
+  void *arg;
+  int count;
+
+  traceThread("worker", (int)(intptr_t)number);
+  pthread_mutex_lock(&lock);
+  for (;;)
+  {
+    while (generation == seenGeneration)
+      pthread_cond_wait(&workReady, &lock);
+    seenGeneration = generation;
+    task = currentTask;
+    arg = currentArg;
+    count = taskCount;
+    pthread_mutex_unlock(&lock);
+
+    runTasks(task, arg, count);
+
+    pthread_mutex_lock(&lock);
+    if (--busyWorkers == 0)
+      pthread_cond_signal(&workDone);
+  }
+  return NULL;
+}
+
+
+
+/******************************************************************************
+* Return the number of online processors
+******************************************************************************/
+int defaultThreadCount(void)
+{
+  long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  return processors < 1 ? 1 : processors > MAX_THREADS ? MAX_THREADS : (int)processors;
+}
+
+
+
+/******************************************************************************
+* Start "threads" - 1 worker threads, the caller of parallelFor() is the last
+* one. Must be called once, before any parallel loop.
+******************************************************************************/
+void initThreadPool(int threads)
+{
+  int index;
+
+  threadCount = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+  for (index = 0; index < threadCount - 1; index++) {
+    if (pthread_create(&workers[index], NULL, worker, (void*)(intptr_t)(index + 1))) {
+      fprintf(stderr, "Could not create worker thread, using %d threads\n", index + 1);
+      threadCount = index + 1;
+      break;
+    }
+  }
+}
+
+
+
+/******************************************************************************
+* Call task(index, arg) for every index in [0,count) and wait until all of 
+* them have completed
+******************************************************************************/
+void parallelFor(int count, ParallelTask task, void *arg)
+{
+  int index;
+
+  // Not worth waking up the workers
+  if (threadCount == 1 || count <= 1) {
+    for (index = 0; index < count; index++)
+      task(index, arg);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  currentTask = task;
+  currentArg = arg;
+  taskCount = count;
+  atomic_store(&nextTask, 0);
+  busyWorkers = threadCount - 1;
+  generation++;
+  pthread_cond_broadcast(&workReady);
+  pthread_mutex_unlock(&lock);
+
+  runTasks(task, arg, count);
+
+  pthread_mutex_lock(&lock);
+  while (busyWorkers > 0)
+    pthread_cond_wait(&workDone, &lock);
+  pthread_mutex_unlock(&lock);
+}
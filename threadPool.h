@@ -0,0 +1,39 @@
+/******************************************************************************
+* File:         threadPool.h
+* Brief:        Fixed-size pool of worker threads executing parallel loops
+******************************************************************************/
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+
+
+/******************************************************************************
+* Maximum number of threads (including the calling thread)
+******************************************************************************/
+#define MAX_THREADS 256
+
+
+
+/******************************************************************************
+* Task executed for every index of a parallel loop, the second argument is 
+* passed unchanged from parallelFor()
+******************************************************************************/
+typedef void (*ParallelTask)(int, void*);
+
+
+
+/******************************************************************************
+* Number of threads taking part in parallel loops
+******************************************************************************/
+extern int threadCount;
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void initThreadPool(int);               // Start the worker threads
+int defaultThreadCount(void);           // Number of online processors
+void parallelFor(int, ParallelTask, void*); // Run task for indices [0,count)
+
+#endif
@@ -0,0 +1,202 @@
+/******************************************************************************
+* File:         trace.c
+* Brief:        Timeline tracing of scoped zones, Chrome trace-event export
+*
+* Note:
+* With --trace FILE, zones around the hot functions (TRACE_BEGIN() and
+* TRACE_END()) are recorded as they complete: zone name, start and duration.
+* Every thread writes to a ring of its own, allocated when it first opens a
+* zone, so recording takes no locks and no atomics; only registering a
+* thread takes an atomic increment. A ring keeps the last TRACE_EVENTS
+* zones of its thread, older ones are overwritten.
+*
+* writeTrace() rewrites FILE in the Chrome trace-event format (complete "X"
+* events, one track per thread), which chrome://tracing and Perfetto open.
+* It is called at exit and on demand (key 't'), at points where the
+* simulation and the worker threads are idle (see waitFrame()), so that the
+* rings are not written while they are read.
+******************************************************************************/
+#include <stdatomic.h>
+#include "particleSystem.h"
+#include "threadPool.h"
+#include "headless.h"
+#include "trace.h"
+
+
+
+/******************************************************************************
+* Trace state
+******************************************************************************/
+int tracing;
+
+// Ring of the zones completed by one thread and the zones it has open
+typedef struct {
+  const char *name;
+  double start, duration;
+} TraceEvent;
+
+typedef struct {
+  TraceEvent events[TRACE_EVENTS];
+  unsigned long long written;           // Zones completed so far
+  const char *open[TRACE_MAX_DEPTH];    // Zones opened and not closed
+  double openStart[TRACE_MAX_DEPTH];
+  int depth;
+  const char *name;                     // Thread name and number
+  int number;
+} TraceBuffer;
+
+// Main and simulation threads and the workers
+#define TRACE_MAX_THREADS (MAX_THREADS + 2)
+
+static TraceBuffer *buffers[TRACE_MAX_THREADS];
+static atomic_int bufferCount;
+static double origin;                   // Wall clock time of time 0 in the trace
+
+// Ring of the calling thread, its name until the ring is allocated
+static _Thread_local TraceBuffer *threadBuffer;
+static _Thread_local const char *threadName;
+static _Thread_local int threadNumber = -1;
+
+
+
+/******************************************************************************
+* Start tracing if a trace file was asked for, the trace is written at exit
+******************************************************************************/
+void startTrace(void)
+{
+  if (!options.traceFile)
+    return;
+  origin = wallClock();
+  tracing = 1;
+  traceThread("main", -1);
+  atexit(writeTrace);
+}
+
+
+
+/******************************************************************************
+* Name the calling thread, may be called before tracing starts
+******************************************************************************/
+void traceThread(const char *name, int number)
+{
+  threadName = name;
+  threadNumber = number;
+  if (threadBuffer) {
+    threadBuffer->name = name;
+    threadBuffer->number = number;
+  }
+}
+
+
+
+/******************************************************************************
+* Allocate the ring of the calling thread, NULL if there is none to be had
+******************************************************************************/
+static TraceBuffer *registerThread(void)
+{
+  int slot = atomic_fetch_add(&bufferCount, 1);
+
+  if (slot >= TRACE_MAX_THREADS) {
+    atomic_fetch_sub(&bufferCount, 1);
+    return NULL;
+  }
+  threadBuffer = calloc(1, sizeof(TraceBuffer));
+  if (!threadBuffer) {
+    fprintf(stderr, "Could not allocate trace buffer, tracing disabled\n");
+    tracing = 0;
+    return NULL;
+  }
+  threadBuffer->name = threadName ? threadName : "thread";
+  threadBuffer->number = threadName ? threadNumber : slot;
+  buffers[slot] = threadBuffer;
+  return threadBuffer;
+}
+
+
+
+/******************************************************************************
+* Open and close zones. Zones nested deeper than TRACE_MAX_DEPTH are not
+* recorded.
+******************************************************************************/
+void traceBegin(const char *zone)
+{
+  TraceBuffer *buffer = threadBuffer ? threadBuffer : registerThread();
+
+  if (!buffer)
+    return;
+  if (buffer->depth < TRACE_MAX_DEPTH) {
+    buffer->open[buffer->depth] = zone;
+    buffer->openStart[buffer->depth] = wallClock();
+  }
+  buffer->depth++;
+}
+
+void traceEnd(void)
+{
+  TraceBuffer *buffer = threadBuffer;
+  TraceEvent *event;
+
+  if (!buffer || buffer->depth == 0)
+    return;
+  if (--buffer->depth < TRACE_MAX_DEPTH) {
+    event = &buffer->events[buffer->written & (TRACE_EVENTS - 1)];
+    event->name = buffer->open[buffer->depth];
+    event->start = buffer->openStart[buffer->depth];
+    event->duration = wallClock() - event->start;
+    buffer->written++;
+  }
+}
+
+
+
+/******************************************************************************
+* Write the zones kept by every thread to options.traceFile, times in
+* microseconds since tracing started
+******************************************************************************/
+void writeTrace(void)
+{
+  int thread, count = atomic_load(&bufferCount), events = 0;
+  unsigned long long index, first;
+  const TraceBuffer *buffer;
+  const TraceEvent *event;
+  FILE *file;
+
+  if (!options.traceFile || origin == 0.0)
+    return;
+  file = fopen(options.traceFile, "w");
+  if (!file) {
+    fprintf(stderr, "Could not open %s\n", options.traceFile);
+    return;
+  }
+
+  fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(file, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+                "\"args\": {\"name\": \"particleSystem\"}}");
+  for (thread = 0; thread < count && thread < TRACE_MAX_THREADS; thread++)
+  {
+    buffer = buffers[thread];
+    if (!buffer)
+      continue;
+    if (buffer->number < 0)
+      fprintf(file, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                    "\"args\": {\"name\": \"%s\"}}", thread + 1, buffer->name);
+    else
+      fprintf(file, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                    "\"args\": {\"name\": \"%s %d\"}}", thread + 1, buffer->name,
+              buffer->number);
+    fprintf(file, ",\n  {\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, "
+                  "\"tid\": %d, \"args\": {\"sort_index\": %d}}", thread + 1, thread);
+
+    first = buffer->written > TRACE_EVENTS ? buffer->written - TRACE_EVENTS : 0;
+    for (index = first; index < buffer->written; index++, events++)
+    {
+      event = &buffer->events[index & (TRACE_EVENTS - 1)];
+      fprintf(file, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"pid\": 1, \"tid\": %d}", event->name, (event->start - origin) * 1e6,
+              event->duration * 1e6, thread + 1);
+    }
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+  printf("Trace of %d zones written to %s\n", events, options.traceFile);
+}
@@ -0,0 +1,39 @@
+/******************************************************************************
+* File:         trace.h
+* Brief:        Timeline tracing of scoped zones, Chrome trace-event export
+******************************************************************************/
+#ifndef TRACE_H
+#define TRACE_H
+
+
+
+/******************************************************************************
+* Trace parameters
+******************************************************************************/
+#define TRACE_EVENTS 65536				// Zones kept per thread (power of two)
+#define TRACE_MAX_DEPTH 32				// Nesting of zones recorded per thread
+
+
+
+/******************************************************************************
+* Zones: every TRACE_BEGIN() is closed by a TRACE_END() on the same thread,
+* on every path out of the zone. Without --trace a zone costs one test.
+******************************************************************************/
+extern int tracing;						// Nonzero with --trace FILE
+
+#define TRACE_BEGIN(zone) do { if (tracing) traceBegin(zone); } while (0)
+#define TRACE_END() do { if (tracing) traceEnd(); } while (0)
+
+
+
+/******************************************************************************
+* Function prototypes
+******************************************************************************/
+void startTrace(void);					// Start tracing if options.traceFile is set
+void traceThread(const char*, int);		// Name the calling thread ("name number",
+										// no number if negative)
+void traceBegin(const char*);			// Open a zone (name must be a literal)
+void traceEnd(void);					// Close the innermost open zone
+void writeTrace(void);					// Write the trace to options.traceFile
+
+#endif